@@ -1,27 +1,494 @@
+#define _GNU_SOURCE // For writer-preferring read-write locks
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <strings.h>
 #include <ncurses.h>
 #include <ctype.h>
+#include <stdint.h>
+#include <stddef.h>
+#include <limits.h>
+#include <math.h>
 #include <setjmp.h> // For setjmp and longjmp
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdatomic.h>
+#include <time.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <sys/file.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/signalfd.h>
+#include <poll.h>
 
-#define MAX_STUDENTS 100
-#define NUM_SUBJECTS 5
+#define MAX_SUBJECTS 20 // Most subjects a schema may name
+#define SUBJECT_NAME_SIZE 32 // Subject name buffer size, including the terminator
+#define NAME_SIZE 50 // Name buffer size, including the terminator
+#define NAME_BLOCK_BITS 20 // Names are kept in blocks of 1 << NAME_BLOCK_BITS bytes
+#define NAME_BLOCK_SIZE (1u << NAME_BLOCK_BITS)
+#define NAME_MAX_BLOCKS (1 << (32 - NAME_BLOCK_BITS)) // As many as 32-bit name offsets reach
+#define NAME_INTERN_MIN_CAPACITY 4096 // Initial slot count of the name intern table
+#define STORE_CHUNK_SIZE 1024 // Records per store chunk
+#define COMPACT_STEP_CHUNKS 16 // Store chunks one compaction step works through
+#define COMPACT_IDLE_MS 50 // Idle time at the main menu before each compaction step
+#define ARENA_BLOCK_CHUNKS 16 // Store chunks carved from one arena block
+#define SORT_INSERTION_RUN 16 // Run length sorted by insertion sort before merging
+#define HASH_MIN_CAPACITY 1024 // Initial slot count of the student number index
+#define GRAM_MIN_CAPACITY 4096 // Initial slot count of the name trigram table
+#define FUZZY_LANES 8 // Names scored together by one edit-distance kernel pass
+#define FUZZY_TOP_K 20 // Closest matches offered when a search finds nothing
 
+#define GRADE_MAX_SCORE 255 // Highest grade a record holds, as grades are stored in a byte
+#define STATS_MAX_GRADE 100 // Grade histograms cover 0 to STATS_MAX_GRADE
+#define STATS_MAX_TOTAL (MAX_SUBJECTS * STATS_MAX_GRADE) // Histogram slots for the total score
+#define STATS_BELOW_RANGE INT_MIN // Order statistic among values below a histogram
+#define STATS_ABOVE_RANGE INT_MAX // Order statistic among values above a histogram
+#define GRADE_CODES (26 * 3) // Letter grades A+ to Z-; see gradeName
+#define GRADE_MAX_CUTOFFS 16 // Letter grades in one subject's grading scale
+
+#define SNAPSHOT_FILE "students.db"
+#define JOURNAL_FILE "students.journal"
+#define SCALE_FILE "grading.scale"
+#define SCHEMA_FILE "subjects.schema"
+#define SNAPSHOT_MAGIC 0x42444753u // "SGDB"
+#define SNAPSHOT_VERSION 3
+#define SNAPSHOT_V1_HEADER_SIZE 24
+#define SNAPSHOT_PAGE_SIZE 4096 // Record pages start on this boundary
+#define SNAPSHOT_BYTE_ORDER 0x01020304u // Mapped records are in host byte order
+#define RECORD_MAX_SIZE (4 * (3 + MAX_SUBJECTS) + NAME_SIZE) // Encoded Student, see encodeStudent
+#define JOURNAL_BUFFER_SIZE 65536 // Pending journal bytes that force a commit
+#define JOURNAL_MAGIC 0x4C4A4753u // "SGJL"
+#define JOURNAL_HEADER_SIZE 8 // Magic, then the generation of the snapshot the entries apply to
+
+#define IMPORT_WINDOW_SIZE (16 << 20) // CSV bytes parsed and inserted per batch
+#define IMPORT_MIN_SLICE (1 << 20) // Smallest part of a window given its own parser thread
+#define IMPORT_MAX_MESSAGES 5 // Rejected rows described in an import report
+#define IMPORT_DEFER_ROWS 10000 // Imports this large rebuild the sort and name indexes afterwards
+#define EXPORT_BUFFER_SIZE (1 << 20) // Output bytes gathered before each write
+#define QUERY_LINE_SIZE 1024 // Longest headless command line
+#define QUERY_MAX_WORDS (3 + MAX_SUBJECTS) // register takes the most words
+#define FILTER_MAX_OPS 32 // Tests and operators in one filter expression, which also bounds its nesting
+#define JOURNAL_CHECKPOINT_SIZE (16 << 20) // Journal size at which a headless run folds it into the snapshot
+#define SERVER_SOCKET "students.sock" // Default socket of --serve and --socket
+#define SERVER_INPUT_SIZE (64 * QUERY_LINE_SIZE) // Pipelined command bytes a connection buffers
+#define FRAME_HEADER_SIZE 9 // "%08x\n" before each chunk of an answer sent to a client
+#define CLIENT_MAX_PENDING 1024 // Commands a client sends ahead of their answers
+#define BENCH_MAX_SIZES 16
+#define BENCH_LOOKUPS 100000 // Student number lookups timed per roster size
+#define BENCH_SEARCHES 1000 // Name searches timed per roster size and kind
+#define BENCH_DELETES 200 // Most deletions timed per roster size
+#define BENCH_SCAN_BUDGET 10000000 // Records processed per whole-roster benchmark, spread over repetitions
+#define POOL_MAX_THREADS 64 // Most threads a parallel pass runs on
+#define POOL_PART_ITEMS 32768 // Handles per part of a parallel sort: with their keys, about an L2 cache
+#define POOL_PART_CHUNKS 8 // Store chunks per part of a parallel scan
+#define INDEX_MAX_DEPTH 64 // Bounds the height of any SortIndex (AVL trees stay below 1.45 log2 n)
+
+// The store keeps only the first student_size bytes of a record, which end
+// after the grades of the subjects in the schema, so grades must come last.
+// The name lives in name_arena (see studentName). The total is kept since most
+// views sort or filter on it; the average and letter grades are derived when needed.
 typedef struct {
-    int id;
-    int student_number; // Student number
-    char name[50]; // Name
-    int grades[NUM_SUBJECTS]; // Grades
-    char letter_grades[NUM_SUBJECTS]; // Letter grades
-    int total_score; // Total score
-    double average; // Average
+    int32_t id;
+    int32_t student_number; // Student number
+    uint32_t name_offset; // Name, in name_arena
+    int16_t total_score; // Total score
+    uint8_t name_length; // Name bytes, not counting the terminator
+    uint8_t grades[MAX_SUBJECTS]; // Grades, one per subject in the schema
 } Student;
 
-Student students[MAX_STUDENTS];
-int num_students = 0;
+// Bump allocator: memory is handed out from large blocks and never moved or freed
+typedef struct ArenaBlock {
+    struct ArenaBlock *next;
+    size_t used;
+    size_t size;
+    unsigned char data[];
+} ArenaBlock;
+
+typedef struct {
+    ArenaBlock *head;
+    size_t block_size; // Minimum size of each new block
+} Arena;
+
+// Names of every record, each kept once and NUL-terminated. A record refers to its
+// name by offset; no name straddles a block, so the top bits of an offset pick
+// the block. Blocks never move and the directory is fixed, so readers may follow
+// offsets while the writer adds names. A mapped snapshot heap provides the first
+// blocks; names added since are interned through a hash table (slots hold an
+// offset plus one, 0 when empty), which a save empties again.
+typedef struct {
+    const char *blocks[NAME_MAX_BLOCKS];
+    int num_blocks;
+    char *tail; // Last block, if names are added to it
+    uint64_t used; // Offset of the next name
+    uint32_t *slots;
+    uint32_t capacity; // Power of two, at most half full
+    uint32_t count;
+} NameArena;
+
+// Snapshot header (version 2 on); the rest of its page is reserved
+typedef struct {
+    uint32_t magic;
+    uint32_t version;
+    uint32_t byte_order;
+    uint32_t record_size;
+    uint32_t count;
+    uint32_t next_handle;
+    uint64_t records_offset; // Page-aligned array of DiskRecords
+    uint64_t heap_offset; // Page-aligned string heap holding the names
+    uint64_t heap_size;
+    uint32_t header_crc; // CRC-32 of the fields above
+    uint32_t generation; // Counts saves; the journal is stamped with it. Zero in files from before it was kept
+} SnapshotHeader;
+
+// Fixed-width snapshot record (version 3 on), used in place through a read-only
+// mapping: the handle, then the stored bytes of the Student, whose name offset
+// points into the snapshot's string heap. A record takes disk_record_size bytes.
+typedef struct {
+    int32_t handle;
+    unsigned char student[]; // student_size bytes
+} DiskRecord;
+
+// Fixed-size block of records; chunks are never reallocated once created
+typedef struct {
+    int handles[STORE_CHUNK_SIZE]; // Handle of the record in each slot
+    unsigned char records[]; // STORE_CHUNK_SIZE records, student_size bytes apart
+} StudentChunk;
+
+// Letter grade cutoffs for each subject, best grade first, compiled into a
+// lookup table from score to grade code. A grade code is 3 * (letter - 'A'),
+// plus 0 for '+', 1 for no sign or 2 for '-'.
+typedef struct {
+    int num_cutoffs[MAX_SUBJECTS];
+    unsigned char codes[MAX_SUBJECTS][GRADE_MAX_CUTOFFS];
+    int min_scores[MAX_SUBJECTS][GRADE_MAX_CUTOFFS]; // Lowest score earning each grade; the last is 0
+    unsigned char table[MAX_SUBJECTS][STATS_MAX_GRADE + 2]; // Scores 0-100, then any score outside them
+} GradingScale;
+
+// Kernels over grade columns are built for AVX2 and for the baseline instruction
+// set (SSE2 on x86-64), and the loader picks the best one the CPU supports
+#if defined(__GNUC__) && defined(__x86_64__)
+#define GRADE_KERNEL __attribute__((target_clones("avx2", "default")))
+#else
+#define GRADE_KERNEL
+#endif
+
+// Growable record store: growing adds a chunk, so existing records never move.
+// Every record also gets a handle that is never reused and survives deletions
+// of other records, so indexes can refer to records by handle.
+// Deleting a record leaves a tombstone (handle -1) in its slot; compaction later
+// closes the gaps a few chunks at a time, keeping the store order.
+// Records loaded from a mapped snapshot stay in the mapping until their chunk
+// is first touched; until then the chunk directory entry is NULL.
+typedef struct {
+    Arena arena;
+    StudentChunk **chunks; // Chunk directory
+    int *chunk_live; // Live records in each chunk
+    int num_chunks;
+    int chunk_capacity; // Capacity of the chunk directory
+    int count; // Number of live records
+    int slots; // Slots in use, live or tombstone
+    int compact_read; // Next slot compaction examines, -1 when not compacting
+    int compact_write; // Slot compaction fills next
+    int *handle_positions; // Store position of each handle, -1 once removed
+    int handle_capacity;
+    int next_handle;
+    int handle_map_stale; // handle_positions must be rebuilt before use
+    const unsigned char *mapped_records; // Snapshot records backing NULL chunks, disk_record_size bytes apart
+    const char *mapped_heap; // Snapshot string heap
+    uint64_t mapped_heap_size;
+    struct StoreVersions *versions; // Set while readers may pin versions, see storePin
+} StudentStore;
+
+StudentStore student_store = { { NULL, 0 }, NULL, NULL, 0, 0, 0, 0, -1, 0, NULL, 0, 0, 0, NULL, NULL, 0, NULL };
+
+// Records of the store as they were when it was published. Its chunks are never
+// written again: a writer copies a chunk a version shares before changing it.
+// Chunks that were still in the mapping are NULL and read from there.
+typedef struct StoreVersion {
+    GradingScale scale; // Scale in use when it was published
+    StudentChunk **chunks; // Chunk directory
+    int num_chunks;
+    long retired; // Epoch in which a newer version replaced it
+    struct StoreVersion *next; // Next retired version
+} StoreVersion;
+
+// A thread that pins versions; epoch is 0 while it has none pinned
+typedef struct StoreReader {
+    long epoch;
+    struct StoreReader *next;
+} StoreReader;
+
+typedef struct {
+    StudentChunk *chunk;
+    long epoch; // Epoch in which a copy replaced it
+} RetiredChunk;
+
+// Copy-on-write versions of a store for readers that run beside its writer.
+// Writers advance the epoch after each batch of changes; what they replace is
+// retired in the current epoch and recycled once every pinned reader is newer.
+typedef struct StoreVersions {
+    pthread_mutex_t lock; // Guards everything below
+    long epoch;
+    StoreVersion *latest; // Last version published, NULL before the first pin
+    int latest_stale; // The store has changed since latest was published
+    StoreReader *readers;
+    StoreVersion *retired_versions;
+    RetiredChunk *retired_chunks;
+    int num_retired;
+    int retired_capacity;
+    StudentChunk **spare_chunks; // Recycled chunks, reused before the arena grows
+    int num_spare;
+    int spare_capacity;
+} StoreVersions;
+
+StoreVersions store_versions = { PTHREAD_MUTEX_INITIALIZER, 1, NULL, 0, NULL, NULL, NULL, 0, 0, NULL, 0, 0 };
+
+NameArena name_arena;
+
+// Subjects of the schema, see loadSchema; record sizes follow from their number
+int num_subjects;
+char subject_names[MAX_SUBJECTS][SUBJECT_NAME_SIZE];
+size_t student_size; // Bytes of a stored Student
+size_t disk_record_size; // Bytes of a DiskRecord
+
+int number_index_stale = 0; // Set after a bulk load until the number index is rebuilt
+int roster_indexes_stale = 0; // Same for the sort and name indexes, which bulk adds may also defer
+int roster_stats_stale = 0; // Set after a bulk load until the running aggregates are rebuilt
+
+// Two scales: a new one is filled in beside the one in use, then swapped in
+GradingScale grading_scales[2];
+const GradingScale *grading_scale = &grading_scales[0];
+
+// Fields the sort engine can order by. Each has a standing index, except the
+// subjects, which are sorted on demand: SORT_BY_SUBJECT + i orders by subject i.
+typedef enum {
+    SORT_BY_NAME,
+    SORT_BY_NUMBER,
+    SORT_BY_TOTAL_SCORE,
+    NUM_SORT_FIELDS,
+    SORT_BY_SUBJECT = NUM_SORT_FIELDS
+} SortField;
+
+typedef struct {
+    SortField field;
+    int order; // 1 for ascending, -1 for descending
+} SortKey;
+
+// Order-statistic AVL tree node; nodes are indexed by record handle
+typedef struct {
+    int left; // Child handles, -1 for none
+    int right;
+    int height;
+    int size; // Nodes in this subtree
+} IndexNode;
+
+// Standing secondary index over the store, ordered by field then handle
+typedef struct {
+    SortField field;
+    IndexNode *nodes;
+    int capacity;
+    int root;
+} SortIndex;
+
+SortIndex sort_indexes[NUM_SORT_FIELDS] = {
+    { SORT_BY_NAME, NULL, 0, -1 },
+    { SORT_BY_NUMBER, NULL, 0, -1 },
+    { SORT_BY_TOTAL_SCORE, NULL, 0, -1 }
+};
+
+typedef struct {
+    int student_number;
+    int handle; // -1 for an empty slot
+} NumberSlot;
+
+// Open-addressing (linear probing) hash index from student number to handle
+typedef struct {
+    NumberSlot *slots;
+    int capacity; // Power of two, at most half full
+    int shift; // 32 - log2(capacity), see fibonacciHash
+    int count;
+} NumberIndex;
+
+NumberIndex number_index = { NULL, 0, 0, 0 };
+
+// Growable list of record handles
+typedef struct {
+    int *handles;
+    int count;
+    int capacity;
+} HandleList;
+
+// Handles of every name containing one trigram, kept sorted ascending
+typedef struct {
+    uint32_t gram; // Three lower-cased name bytes; 0 marks an empty slot
+    HandleList posting;
+} GramSlot;
+
+// Inverted index from name trigrams to handles, for substring search
+typedef struct {
+    GramSlot *slots;
+    int capacity; // Power of two, at most half full
+    int shift; // 32 - log2(capacity), see fibonacciHash
+    int count;
+} GramIndex;
+
+GramIndex gram_index = { NULL, 0, 0, 0 };
+
+typedef enum {
+    JOURNAL_ADD = 1,
+    JOURNAL_UPDATE,
+    JOURNAL_REMOVE
+} JournalOp;
+
+// Append-only log of roster changes since the last snapshot. Entries are
+// buffered and written with a single fsync per commit (group commit).
+typedef struct {
+    int fd; // -1 until loading is done, so replayed changes are not logged again
+    unsigned char buffer[JOURNAL_BUFFER_SIZE + 2 * (8 + 1 + RECORD_MAX_SIZE)];
+    size_t used;
+    uint32_t generation; // Of the snapshot on disk, which the journal header must match
+} Journal;
+
+Journal journal = { -1, {0}, 0, 0 };
+
+// Outcome of a CSV import
+typedef struct {
+    long imported;
+    long rejected;
+    int num_messages;
+    char messages[IMPORT_MAX_MESSAGES][96]; // The first few rejected rows
+} ImportReport;
+
+typedef enum {
+    EXPORT_CSV,
+    EXPORT_JSON_LINES
+} ExportFormat;
+
+// Rows an export keeps; every condition must hold
+typedef struct {
+    int min_total; // Inclusive total score range
+    int max_total;
+    char name[NAME_SIZE]; // Case-insensitive substring of the name; empty matches all
+} ExportFilter;
+
+// Comparisons a filter test makes; names only use equality and FILTER_CONTAINS
+typedef enum {
+    FILTER_LESS,
+    FILTER_LESS_EQUAL,
+    FILTER_GREATER,
+    FILTER_GREATER_EQUAL,
+    FILTER_EQUAL,
+    FILTER_NOT_EQUAL,
+    FILTER_CONTAINS // Substring ignoring case
+} FilterCompare;
+
+// Instructions of a compiled filter: tests push a result, the rest combine them
+typedef enum {
+    FILTER_GRADE,
+    FILTER_LETTER,
+    FILTER_TOTAL,
+    FILTER_AVERAGE,
+    FILTER_NUMBER,
+    FILTER_NAME,
+    FILTER_AND,
+    FILTER_OR,
+    FILTER_NOT
+} FilterCode;
+
+#define FILTER_ANY (-1) // Subject of a test that holds if it holds for some subject
+#define FILTER_ALL (-2) // ... or only if it holds for every subject
+
+typedef struct {
+    FilterCode code;
+    FilterCompare compare;
+    int subject; // Grade and letter tests: a subject, FILTER_ANY or FILTER_ALL
+    int operand; // Letter grades are negated grade codes, so that better grades are greater
+    double real; // Average operand
+    char text[NAME_SIZE]; // Name operand
+} FilterOp;
+
+// A filter expression compiled to postfix. Tests that the whole filter requires
+// (joined to it by AND at the top level) are listed as conjuncts, so that the
+// search can start from an index for one of them.
+typedef struct {
+    FilterOp ops[FILTER_MAX_OPS];
+    int num_ops;
+    int conjuncts[FILTER_MAX_OPS]; // Indexes into ops
+    int num_conjuncts;
+} FilterProgram;
+
+// Running aggregates over the whole roster, kept current by every roster change;
+// column num_subjects holds the total score. Each column has a histogram of its
+// possible scores, and values outside it are only counted in the below/above bins.
+typedef struct {
+    int count;
+    long long sum[MAX_SUBJECTS + 1];
+    double sum_squares[MAX_SUBJECTS + 1]; // Exact while under 2^53
+    int histogram[MAX_SUBJECTS + 1][STATS_MAX_TOTAL + 1];
+    int below[MAX_SUBJECTS + 1];
+    int above[MAX_SUBJECTS + 1];
+    int letter_counts[MAX_SUBJECTS][GRADE_CODES]; // Students per letter grade code
+} RosterStats;
+
+// Ranking of one RosterStats column, best first: students are bucketed by score
+// (above the histogram, its top score down to 0, then below 0), each bucket
+// listing its handles in rank order, and a Fenwick tree over the bucket sizes
+// finds the bucket holding any rank. Equal scores rank in registration order.
+typedef struct {
+    HandleList buckets[STATS_MAX_TOTAL + 3];
+    int tree[STATS_MAX_TOTAL + 4]; // 1-based
+} RankIndex;
+
+// Where one student stands in a ranking
+typedef struct {
+    int score;
+    int position; // 0-based place in the ranking, ties in registration order
+    int above; // Students with a higher score
+    int tied; // Students with the same score, this one included
+    int count;
+} RankStanding;
+
+// One column of RosterStats summarized. Order statistics are nearest-rank, and
+// are STATS_BELOW_RANGE or STATS_ABOVE_RANGE when they fall outside the histogram.
+typedef struct {
+    double mean;
+    double stddev; // Population standard deviation
+    int min;
+    int p10;
+    int p25;
+    int median;
+    int p75;
+    int p90;
+    int max;
+} StatsSummary;
+
+// Screen model of a menu: which item is highlighted on screen, so moving the
+// highlight repaints two lines instead of the whole screen
+typedef struct {
+    char **items;
+    int count;
+    int highlight;
+    int drawn; // Highlight currently on screen, -1 to repaint every item
+    int row; // Screen row of the first item
+    int col; // Column of the items, -1 to center each one
+} MenuModel;
+
+// Rows shown by displayStudents: a handle list, a sorted index, or the whole store
+typedef struct {
+    const int *handles; // Used when index is NULL; NULL means store order
+    const SortIndex *index;
+    int order; // Walk direction for index views
+    int count;
+    int field; // Sort field the rows are in, -1 for none
+} StudentView;
 
-const char *subject_names[NUM_SUBJECTS] = {"Korean", "English", "Math", "Science", "Korean History"};
+// One part of a parallel pass; worker numbers run from 0 to poolThreads() - 1
+typedef void (*PoolTask)(void *context, int part, int worker);
 
 jmp_buf mainMenuJmpBuf; // For longjmp to main menu
 
@@ -30,19 +497,140 @@ void studentRegistration();
 void viewStudents();
 void modifyStudentInfo();
 void deleteStudent();
-char assignLetterGrade(int score);
-void displayStudents(Student *list, int count, int return_code);
-void sortStudentsByName(int order);
-void sortStudentsByNumber(int order);
-void sortStudentsByTotalScore(int order);
+unsigned char assignLetterGrade(int subject, int score);
+unsigned char scaleLetterGrade(const GradingScale *scale, int subject, int score);
+void gradeName(int code, char name[3]);
+void gradingScaleDefault(GradingScale *scale);
+const char *parseGradeCutoffs(char **words, int count, GradingScale *scale, int subject);
+void formatGradeCutoffs(const GradingScale *scale, int subject, char *out);
+void loadGradingScale();
+void setGradingScale(const GradingScale *scale);
+void scaleScreen();
+void displayStudents(const StudentView *view, int return_code);
+void sortHandles(int *handles, int count, const SortKey *keys, int num_keys);
 void searchOutput();
+void filterOutput();
 void sortedOutput();
-void editStudent(Student *s);
+void editStudent(int handle);
+int findStudentByNumber(const char *title);
+void drawScreenFrame(const char *title);
+int pickStudent(const char *title, const char *instructions, int *highlight);
+void menuDraw(MenuModel *menu, int cols);
+int menuKey(MenuModel *menu, int c);
+
+void outOfMemory();
+void *arenaAlloc(Arena *arena, size_t size);
+void nameArenaMap(NameArena *arena, const char *heap, uint64_t size);
+void nameArenaForget(NameArena *arena);
+int poolThreads();
+void poolRun(int parts, PoolTask task, void *context);
+int storeAppend(StudentStore *store, const Student *s);
+int storeAppendWithHandle(StudentStore *store, const Student *s, int handle);
+StudentChunk *storeChunk(StudentStore *store, int c);
+Student *storeAt(StudentStore *store, int pos);
+const Student *storePeek(const StudentStore *store, int pos, Student *scratch);
+int storeHandleAt(StudentStore *store, int pos);
+int storePositionOf(StudentStore *store, int handle);
+Student *storeByHandle(StudentStore *store, int handle);
+void storeRemove(StudentStore *store, int pos);
+int storeListHandles(StudentStore *store, int *handles);
+void storeLoadAll(StudentStore *store);
+int storeNextLive(StudentStore *store, int pos);
+int storeSelect(StudentStore *store, int rank);
+int storeRankOf(StudentStore *store, int pos);
+int storeCompactStep(StudentStore *store, int max_chunks);
+StudentChunk *storeWritableChunk(StudentStore *store, int c);
+Student *storeWritableAt(StudentStore *store, int pos);
+void storeAddReader(StudentStore *store, StoreReader *reader);
+void storeRemoveReader(StudentStore *store, StoreReader *reader);
+const StoreVersion *storePin(StudentStore *store, StoreReader *reader);
+void storeUnpin(StudentStore *store, StoreReader *reader);
+void storeAdvanceEpoch(StudentStore *store);
+const Student *versionPeek(const StudentStore *store, const StoreVersion *version, int pos, Student *scratch);
+int compareHandles(SortField field, int a, int b);
+void indexInsert(SortIndex *index, int handle);
+void indexRemove(SortIndex *index, int handle);
+int indexSelect(const SortIndex *index, int rank);
+int indexRank(const SortIndex *index, int handle);
+void indexList(const SortIndex *index, int order, int *handles);
+int numberIndexFind(const NumberIndex *index, int student_number);
+void numberIndexInsert(NumberIndex *index, int student_number, int handle);
+void numberIndexRemove(NumberIndex *index, int student_number);
+void handleListPush(HandleList *list, int handle);
+void gramIndexAdd(GramIndex *index, const char *name, int handle);
+void gramIndexRemove(GramIndex *index, const char *name, int handle);
+void searchNames(const char *query, HandleList *out);
+void fuzzySearchNames(const char *query, int k, HandleList *out);
+const char *filterCompile(const char *text, FilterProgram *program);
+void filterStudents(const FilterProgram *program, HandleList *out);
+int rosterAdd(const Student *s);
+int rosterUpdate(int handle, const Student *s);
+void rosterRemove(int handle);
+const Student *viewStudentAt(const StudentView *view, int i);
+void indexBuild(SortIndex *index, const int *sorted, int count);
+void rosterRebuildIndexes();
+void rosterEnsureNumberIndex();
+void rosterEnsureIndexes();
+int rosterFindNumber(int student_number);
+void computeStudentScores(Student *s);
+double studentAverage(const Student *s);
+uint8_t clampGrade(int grade);
+int parseGrade(const char *text, uint8_t *grade);
+int getGradeInput(const char *prompt);
+const char *studentName(const Student *s);
+void studentSetName(Student *s, const char *name);
+void studentCopy(Student *to, const Student *from);
+void loadSchema();
+void storageFailure(const char *path);
+uint32_t crc32(uint32_t crc, const unsigned char *data, size_t len);
+int encodeStudent(unsigned char *buf, int handle, const Student *s);
+int decodeStudent(const unsigned char *buf, size_t len, int *handle, Student *s);
+void journalAppend(JournalOp op, int handle, const Student *s);
+void journalCommit();
+void loadStudents();
+void saveStudents();
+int parseInteger(const char *text, int *value);
+int importCsv(const char *path, ImportReport *report);
+void importScreen();
+long exportStudents(const char *path, ExportFormat format, const SortKey *order, const ExportFilter *filter);
+int commandLine(int argc, char *argv[]);
+const RosterStats *rosterStats();
+void rosterEnsureRankIndexes();
+int rankSelect(int column, int rank);
+void rankList(int column, int first, int count, HandleList *out);
+void rankStanding(int column, int handle, RankStanding *standing);
+int statsPercentile(const RosterStats *stats, int column, double percent);
+void statsSummarize(const RosterStats *stats, int column, StatsSummary *summary);
+void statsScreen();
+int runHeadless(int argc, char *argv[]);
+int runBenchmark(int argc, char *argv[]);
+int runServer(const char *path);
+int runClient(int argc, char *argv[]);
+void exportScreen();
 
 int getIntegerInput(const char *prompt);
 void getStringInput(const char *prompt, char *buffer, int buffer_size);
 
-int main() {
+int main(int argc, char *argv[]) {
+    // Every record layout depends on the subjects, so they are read first
+    loadSchema();
+    gradingScaleDefault(&grading_scales[0]);
+
+    // Benchmarks build their own rosters and never touch the saved data
+    if (argc > 1 && strcmp(argv[1], "--bench") == 0)
+        return runBenchmark(argc, argv);
+    // Clients leave the saved data to the server they connect to
+    if (argc > 1 && strcmp(argv[1], "--socket") == 0)
+        return runClient(argc, argv);
+
+    // Load saved data before ncurses starts, so errors reach the terminal.
+    // The scale comes first, since replaying the journal counts letter grades.
+    loadGradingScale();
+    loadStudents();
+
+    if (argc > 1)
+        return commandLine(argc, argv);
+
     // Initialize ncurses
     initscr();
     cbreak();
@@ -59,7 +647,7 @@ int main() {
     // Main loop
     if (setjmp(mainMenuJmpBuf) != 0) {
         // After longjmp, clear the screen
-        clear();
+        erase();
     }
 
     int exit_program = 0;
@@ -69,11 +657,13 @@ int main() {
 
     // Clean up ncurses
     endwin();
+
+    // Fold the journal into a fresh snapshot
+    saveStudents();
     return 0;
 }
 
 int mainMenu() {
-    int highlight = 0;
     int choice = -1;
     int c;
     char *choices[] = {
@@ -81,59 +671,44 @@ int mainMenu() {
             "2. View Students",
             "3. Modify Student Info",
             "4. Delete Student",
-            "5. Exit Program"
+            "5. Import from CSV",
+            "6. Export to File",
+            "7. Grading Scale",
+            "8. Exit Program"
     };
-    int n_choices = sizeof(choices) / sizeof(char *);
+    MenuModel menu = { choices, sizeof(choices) / sizeof(char *), 0, -1, 4, -1 };
+    int redraw = 1;
 
     while(1) {
-        choice = -1; // Reset choice
-        clear();
         int rows, cols;
         getmaxyx(stdscr, rows, cols);
+        if (redraw) {
+            redraw = 0;
+            drawScreenFrame("Student Management System");
 
-        // Draw border
-        box(stdscr, 0, 0);
-
-        // Title
-        attron(COLOR_PAIR(2) | A_BOLD);
-        mvprintw(1, (cols - strlen("Student Management System"))/2, "Student Management System");
-        attroff(COLOR_PAIR(2) | A_BOLD);
-
-        // Separator
-        mvhline(2, 1, ACS_HLINE, cols - 2);
-
-        // Menu
-        int start_row = 4;
-        for (int i = 0; i < n_choices; ++i) {
-            if (i == highlight) {
-                attron(A_REVERSE | A_BOLD);
-                mvprintw(start_row + i, (cols - strlen(choices[i]))/2, "%s", choices[i]);
-                attroff(A_REVERSE | A_BOLD);
-            } else {
-                mvprintw(start_row + i, (cols - strlen(choices[i]))/2, "%s", choices[i]);
-            }
+            // Instructions
+            attron(A_DIM);
+            mvprintw(rows - 2, 2, "Use arrow keys to navigate, Enter to select.");
+            attroff(A_DIM);
+            menu.drawn = -1;
         }
 
-        // Instructions
-        attron(A_DIM);
-        mvprintw(rows - 2, 2, "Use arrow keys to navigate, Enter to select.");
-        attroff(A_DIM);
+        // Menu
+        menuDraw(&menu, cols);
 
+        // Compact deleted slots while the menu sits idle; no screen holds a store position here
+        timeout(student_store.compact_read >= 0 ? COMPACT_IDLE_MS : -1);
         c = getch();
-        switch(c) {
-            case KEY_UP:
-                highlight = (highlight - 1 + n_choices) % n_choices;
-                break;
-            case KEY_DOWN:
-                highlight = (highlight + 1) % n_choices;
-                break;
-            case 10: // Enter key
-                choice = highlight;
-                break;
-            default:
-                break;
+        timeout(-1);
+        if (c == ERR) {
+            storeCompactStep(&student_store, COMPACT_STEP_CHUNKS);
+            continue;
         }
+        choice = menuKey(&menu, c);
+        if (c == KEY_RESIZE)
+            redraw = 1;
         if (choice != -1) { // Enter key pressed
+            redraw = 1; // The chosen screen draws over this one
             switch(choice) {
                 case 0:
                     studentRegistration();
@@ -148,6 +723,15 @@ int mainMenu() {
                     deleteStudent();
                     break;
                 case 4:
+                    importScreen();
+                    break;
+                case 5:
+                    exportScreen();
+                    break;
+                case 6:
+                    scaleScreen();
+                    break;
+                case 7:
                     return 1; // Exit program
                 default:
                     break;
@@ -156,19 +740,31 @@ int mainMenu() {
     }
 }
 
+// Keeps prompts on screen however many subjects there are: once they reach the
+// bottom, the rows from top down are cleared and prompting starts over at top
+static void promptRowCheck(int top) {
+    int rows, cols;
+    getmaxyx(stdscr, rows, cols);
+    if (getcury(stdscr) < rows - 3)
+        return;
+    for (int row = top; row < rows - 2; ++row) {
+        mvhline(row, 1, ' ', cols - 2);
+    }
+    move(top, 0);
+}
+
 void studentRegistration() {
     echo();
     curs_set(1); // Show cursor
     Student s;
-    s.id = num_students + 1;
-    s.total_score = 0;
+    char name[NAME_SIZE];
 
     // Get terminal size
     int rows, cols;
     getmaxyx(stdscr, rows, cols);
 
     // Get student information
-    clear();
+    erase();
     // Draw border
     box(stdscr, 0, 0);
     // Title
@@ -181,28 +777,35 @@ void studentRegistration() {
     int start_row = 4;
     mvprintw(start_row, 2, "Please enter the following information:");
 
-    // Get student number
+    // Get student number; numbers must be unique
     s.student_number = getIntegerInput("Student Number: ");
+    while (rosterFindNumber(s.student_number) >= 0) {
+        mvprintw(getcury(stdscr), 2, "Student number %d is already registered.", s.student_number);
+        move(getcury(stdscr) + 1, 0);
+        s.student_number = getIntegerInput("Student Number: ");
+    }
 
     // Get name
-    getStringInput("Name: ", s.name, sizeof(s.name));
+    getStringInput("Name: ", name, sizeof(name));
+    studentSetName(&s, name);
 
     // Get grades
-    for (int i = 0; i < NUM_SUBJECTS; ++i) {
-        char prompt[50];
+    int grades_row = getcury(stdscr);
+    for (int i = 0; i < num_subjects; ++i) {
+        char prompt[SUBJECT_NAME_SIZE + 16];
         sprintf(prompt, "%s Grade: ", subject_names[i]);
-        s.grades[i] = getIntegerInput(prompt);
-        s.total_score += s.grades[i];
-        // Assign letter grades
-        s.letter_grades[i] = assignLetterGrade(s.grades[i]);
+        promptRowCheck(grades_row);
+        s.grades[i] = getGradeInput(prompt);
     }
-    s.average = s.total_score / (double)NUM_SUBJECTS;
+    computeStudentScores(&s);
 
-    // Add student to the list
-    students[num_students++] = s;
+    // Add student to the store and indexes
+    rosterAdd(&s);
+    journalCommit();
 
     // Completion notification
-    mvprintw(start_row + NUM_SUBJECTS * 2 + 2, 2, "Student registration completed!");
+    promptRowCheck(grades_row);
+    mvprintw(getcury(stdscr) + 1, 2, "Student registration completed!");
     attron(A_DIM);
     mvprintw(rows - 2, 2, "Press Enter to return to the menu.");
     attroff(A_DIM);
@@ -211,83 +814,60 @@ void studentRegistration() {
     curs_set(0); // Hide cursor
 }
 
-char assignLetterGrade(int score) {
-    if (score >= 90 && score <= 100)
-        return 'A';
-    else if (score >= 80 && score < 90)
-        return 'B';
-    else if (score >= 70 && score < 80)
-        return 'C';
-    else if (score >= 60 && score < 70)
-        return 'D';
-    else
-        return 'F';
+// Grade code of a score under the current grading scale
+unsigned char assignLetterGrade(int subject, int score) {
+    return scaleLetterGrade(grading_scale, subject, score);
+}
+
+unsigned char scaleLetterGrade(const GradingScale *scale, int subject, int score) {
+    return scale->table[subject][(unsigned)score <= STATS_MAX_GRADE ? score : STATS_MAX_GRADE + 1];
 }
 
 void viewStudents() {
-    int highlight = 0;
     int choice = -1;
     int c;
     char *choices[] = {
             "1. Display All",
             "2. Display Sorted",
             "3. Search and Display",
-            "4. Return to Menu"
+            "4. Find by Student Number",
+            "5. Filter and Display",
+            "6. Statistics",
+            "7. Return to Menu"
     };
-    int n_choices = sizeof(choices) / sizeof(char *);
+    MenuModel menu = { choices, sizeof(choices) / sizeof(char *), 0, -1, 4, -1 };
+    int redraw = 1;
     while(1) {
-        choice = -1; // Reset choice
-        clear();
         int rows, cols;
         getmaxyx(stdscr, rows, cols);
+        if (redraw) {
+            redraw = 0;
+            drawScreenFrame("View Students");
 
-        // Draw border
-        box(stdscr, 0, 0);
-
-        // Title
-        attron(COLOR_PAIR(2) | A_BOLD);
-        mvprintw(1, (cols - strlen("View Students"))/2, "View Students");
-        attroff(COLOR_PAIR(2) | A_BOLD);
-
-        mvhline(2, 1, ACS_HLINE, cols - 2);
-
-        // Menu
-        int start_row = 4;
-        for (int i = 0; i < n_choices; ++i) {
-            if (i == highlight) {
-                attron(A_REVERSE | A_BOLD);
-                mvprintw(start_row + i, (cols - strlen(choices[i]))/2, "%s", choices[i]);
-                attroff(A_REVERSE | A_BOLD);
-            } else {
-                mvprintw(start_row + i, (cols - strlen(choices[i]))/2, "%s", choices[i]);
-            }
+            // Instructions
+            attron(A_DIM);
+            mvprintw(rows - 2, 2, "Use arrow keys to navigate, Enter to select.");
+            attroff(A_DIM);
+            menu.drawn = -1;
         }
 
-        // Instructions
-        attron(A_DIM);
-        mvprintw(rows - 2, 2, "Use arrow keys to navigate, Enter to select.");
-        attroff(A_DIM);
+        // Menu
+        menuDraw(&menu, cols);
 
         c = getch();
-        switch(c) {
-            case KEY_UP:
-                highlight = (highlight - 1 + n_choices) % n_choices;
-                break;
-            case KEY_DOWN:
-                highlight = (highlight + 1) % n_choices;
-                break;
-            case 10: // Enter key
-                choice = highlight;
-                break;
-            default:
-                break;
-        }
+        choice = menuKey(&menu, c);
+        if (c == KEY_RESIZE)
+            redraw = 1;
         if (choice != -1) // Enter key pressed
         {
+            redraw = 1;
             switch(choice) {
                 case 0:
-                    displayStudents(students, num_students, 1); // return_code = 1 (Return to View Students)
+                {
+                    StudentView all = { NULL, NULL, 1, student_store.count, -1 };
+                    displayStudents(&all, 1); // return_code = 1 (Return to View Students)
                     break;
+                }
                 case 1:
                     sortedOutput();
                     break;
@@ -295,6 +875,21 @@ void viewStudents() {
                     searchOutput();
                     break;
                 case 3:
+                {
+                    int handle = findStudentByNumber("Find Student by Number");
+                    if (handle >= 0) {
+                        StudentView found = { &handle, NULL, 1, 1, -1 };
+                        displayStudents(&found, 1);
+                    }
+                    break;
+                }
+                case 4:
+                    filterOutput();
+                    break;
+                case 5:
+                    statsScreen();
+                    break;
+                case 6:
                     return; // Return to main menu
                 default:
                     break;
@@ -303,101 +898,271 @@ void viewStudents() {
     }
 }
 
-void displayStudents(Student *list, int count, int return_code) {
-    clear();
-    int rows, cols;
-    getmaxyx(stdscr, rows, cols);
+// Clears the screen model and draws the border, title and separator; the
+// terminal itself only receives the cells that differ at the next refresh
+void drawScreenFrame(const char *title) {
+    erase();
+    int cols = getmaxx(stdscr);
 
     // Draw border
     box(stdscr, 0, 0);
 
     // Title
     attron(COLOR_PAIR(2) | A_BOLD);
-    mvprintw(1, (cols - strlen("Student List"))/2, "Student List");
+    mvprintw(1, (cols - strlen(title))/2, "%s", title);
     attroff(COLOR_PAIR(2) | A_BOLD);
 
     mvhline(2, 1, ACS_HLINE, cols - 2);
+}
 
-    int start_row = 4;
-
-    if (count == 0) {
-        mvprintw(start_row, 2, "No registered students.");
+static void menuDrawItem(const MenuModel *menu, int i, int cols) {
+    const char *text = menu->items[i];
+    int col = menu->col >= 0 ? menu->col : (cols - (int)strlen(text)) / 2;
+    if (i == menu->highlight) {
+        attron(A_REVERSE | A_BOLD);
+        mvprintw(menu->row + i, col, "%s", text);
+        attroff(A_REVERSE | A_BOLD);
     } else {
-        // Print column headers
-        int col = 2;
-        mvprintw(start_row, col, "%-3s ", "ID");
-        col += 4;
-        mvprintw(start_row, col, "%-9s ", "Number");
-        col += 10;
-        mvprintw(start_row, col, "%-14s ", "Name");
-        col += 15;
-        for (int i = 0; i < NUM_SUBJECTS; ++i) {
-            mvprintw(start_row, col, "%-15s ", subject_names[i]);
-            col += 16;
-        }
-        mvprintw(start_row, col, "%-6s %-7s", "Total", "Average");
-        mvhline(start_row + 1, 1, ACS_HLINE, cols - 2);
-
-        // Print students
-        for (int i = 0; i < count; ++i) {
-            col = 2;
-            mvprintw(start_row + 2 + i, col, "%-3d ", list[i].id);
-            col += 4;
-            mvprintw(start_row + 2 + i, col, "%-9d ", list[i].student_number);
-            col += 10;
-            mvprintw(start_row + 2 + i, col, "%-14s ", list[i].name);
-            col += 15;
-            for (int j = 0; j < NUM_SUBJECTS; ++j) {
-                char grade_info[20];
-                sprintf(grade_info, "%3d (%c)", list[i].grades[j], list[i].letter_grades[j]);
-                mvprintw(start_row + 2 + i, col, "%-15s ", grade_info);
-                col += 16;
-            }
-            mvprintw(start_row + 2 + i, col, "%-6d %-7.2f", list[i].total_score, list[i].average);
+        mvprintw(menu->row + i, col, "%s", text);
+    }
+}
+
+// Repaints only the items whose highlight changed since the last draw
+void menuDraw(MenuModel *menu, int cols) {
+    for (int i = 0; i < menu->count; ++i) {
+        if (menu->drawn < 0 || i == menu->drawn || i == menu->highlight)
+            menuDrawItem(menu, i, cols);
+    }
+    menu->drawn = menu->highlight;
+}
+
+// Moves the highlight for arrow keys; returns the chosen item on Enter, else -1
+int menuKey(MenuModel *menu, int c) {
+    switch(c) {
+        case KEY_UP:
+            menu->highlight = (menu->highlight - 1 + menu->count) % menu->count;
+            break;
+        case KEY_DOWN:
+            menu->highlight = (menu->highlight + 1) % menu->count;
+            break;
+        case 10: // Enter key
+            return menu->highlight;
+        default:
+            break;
+    }
+    return -1;
+}
+
+// Width of a subject's table column: its name, or a grade like "100 (A+)"
+static int subjectColumnWidth(int subject) {
+    int width = strlen(subject_names[subject]);
+    return width > 8 ? width : 8;
+}
+
+// Formats one table line; a NULL student gives the column headers
+static void formatStudentRow(char *line, size_t size, const Student *s) {
+    int length;
+    if (s == NULL) {
+        length = snprintf(line, size, "%-3s %-9s %-14s ", "ID", "Number", "Name");
+        for (int i = 0; i < num_subjects; ++i) {
+            length += snprintf(line + length, size - length, "%-*s ", subjectColumnWidth(i), subject_names[i]);
         }
+        snprintf(line + length, size - length, "%-6s %-7s", "Total", "Average");
+        return;
+    }
+    length = snprintf(line, size, "%-3d %-9d %-14s ", s->id, s->student_number, studentName(s));
+    for (int j = 0; j < num_subjects; ++j) {
+        char grade_info[20];
+        char grade[3];
+        gradeName(assignLetterGrade(j, s->grades[j]), grade);
+        sprintf(grade_info, "%3d (%s)", s->grades[j], grade);
+        length += snprintf(line + length, size - length, "%-*s ", subjectColumnWidth(j), grade_info);
     }
+    snprintf(line + length, size - length, "%-6d %-7.2f", s->total_score, studentAverage(s));
+}
 
-    // Instructions
-    attron(A_DIM);
-    mvprintw(rows - 4, 2, "Use arrow keys to navigate options below.");
-    attroff(A_DIM);
+// Name of a sort field as the status line shows it
+static const char *sortFieldName(int field) {
+    static const char *names[] = { "Name", "Student Number", "Total Score" };
+    return field >= SORT_BY_SUBJECT ? subject_names[field - SORT_BY_SUBJECT] : names[field];
+}
+
+// Handle shown at row i of a view
+static int viewHandleAt(const StudentView *view, int i) {
+    if (view->index != NULL)
+        return indexSelect(view->index, view->order < 0 ? view->count - 1 - i : i);
+    if (view->handles != NULL)
+        return view->handles[i];
+    return storeHandleAt(&student_store, storeSelect(&student_store, i));
+}
+
+// Shows a view as a scrolling table. Only the rows that fit on screen are
+// formatted, so each keypress costs the same however long the view is.
+// 's' cycles the sort field and 'o' flips the direction; the student at the
+// top of the table stays there across either change.
+void displayStudents(const StudentView *view, int return_code) {
+    StudentView current = *view;
+    int *sorted_handles = NULL; // Sorted copy of a handle-list view, or of the whole store for subject orders
+    int mode = view->field; // Sort field, or -1 for the order the view was given in
+    int top = 0;
 
     // Options
     char *options[] = {
             "1. Go Back",
             "2. Return to Main Menu"
     };
-    int n_options = sizeof(options) / sizeof(char *);
-    int highlight = 0;
+    MenuModel menu = { options, sizeof(options) / sizeof(char *), 0, -1, 0, 2 };
     int c;
     int choice = -1;
+    int redraw = 1; // Frame, column headers and instructions
+    int table_dirty = 1; // Visible rows and status line
     while(1) {
-        choice = -1; // Reset choice
-        // Display options
-        for (int i = 0; i < n_options; ++i) {
-            if (i == highlight) {
-                attron(A_REVERSE | A_BOLD);
-                mvprintw(rows - 3 + i, 2, "%s", options[i]);
-                attroff(A_REVERSE | A_BOLD);
+        int rows, cols;
+        getmaxyx(stdscr, rows, cols);
+
+        int start_row = 4;
+        int page = rows - start_row - 7; // Table rows between the headers and the status line
+        if (page < 1)
+            page = 1;
+        int count = current.count;
+        if (top > count - page)
+            top = count - page;
+        if (top < 0)
+            top = 0;
+        char line[1024];
+        if (redraw) {
+            redraw = 0;
+            drawScreenFrame("Student List");
+            if (count == 0) {
+                mvprintw(start_row, 2, "No registered students.");
             } else {
-                mvprintw(rows - 3 + i, 2, "%s", options[i]);
+                // Print column headers
+                formatStudentRow(line, sizeof(line), NULL);
+                mvprintw(start_row, 2, "%.*s", cols - 4, line);
+                mvhline(start_row + 1, 1, ACS_HLINE, cols - 2);
+            }
+
+            // Instructions
+            attron(A_DIM);
+            mvprintw(rows - 4, 2, "Arrows: options  PgUp/PgDn/Home/End: scroll  g: go to row  s: sort  o: order");
+            attroff(A_DIM);
+            menu.row = rows - 3;
+            menu.drawn = -1;
+            table_dirty = 1;
+        }
+        if (table_dirty && count > 0) {
+            table_dirty = 0;
+            // Print the visible students only
+            for (int i = top; i < top + page; ++i) {
+                mvhline(start_row + 2 + i - top, 1, ' ', cols - 2);
+                if (i < count) {
+                    formatStudentRow(line, sizeof(line), viewStudentAt(&current, i));
+                    mvprintw(start_row + 2 + i - top, 2, "%.*s", cols - 4, line);
+                }
             }
+            int last = top + page < count ? top + page : count;
+            mvhline(rows - 5, 1, ' ', cols - 2);
+            if (mode >= 0)
+                mvprintw(rows - 5, 2, "Rows %d-%d of %d, sorted by %s (%s)", top + 1, last, count, sortFieldName(mode), current.order > 0 ? "ascending" : "descending");
+            else
+                mvprintw(rows - 5, 2, "Rows %d-%d of %d", top + 1, last, count);
         }
+
+        // Display options
+        menuDraw(&menu, cols);
+        choice = -1; // Reset choice
         c = getch();
+        int previous_top = top;
+        choice = menuKey(&menu, c);
         switch(c) {
-            case KEY_UP:
-                highlight = (highlight - 1 + n_options) % n_options;
+            case KEY_RESIZE:
+                redraw = 1;
                 break;
-            case KEY_DOWN:
-                highlight = (highlight + 1) % n_options;
+            case KEY_NPAGE:
+                top += page;
                 break;
-            case 10: // Enter key
-                choice = highlight;
+            case KEY_PPAGE:
+                top -= page;
+                break;
+            case KEY_HOME:
+                top = 0;
+                break;
+            case KEY_END:
+                top = count;
+                break;
+            case 'g':
+            case 'G':
+                if (count > 0) {
+                    echo();
+                    curs_set(1);
+                    move(rows - 5, 0);
+                    int row = getIntegerInput("Go to row: ");
+                    noecho();
+                    curs_set(0);
+                    if (row >= 1)
+                        top = (row <= count ? row : count) - 1;
+                    redraw = 1; // The prompt may have left messages behind
+                }
+                break;
+            case 's':
+            case 'S':
+            case 'o':
+            case 'O':
+                if (count > 0) {
+                    int anchor = viewHandleAt(&current, top);
+                    if (c == 'o' || c == 'O') {
+                        if (mode < 0)
+                            break; // The original order has no direction
+                        current.order = -current.order;
+                    } else {
+                        // Next field, then each subject; views that were not sorted to begin with come back round to their own order
+                        mode = mode + 1 < SORT_BY_SUBJECT + num_subjects ? mode + 1 : (view->field >= 0 ? 0 : -1);
+                    }
+                    table_dirty = 1;
+                    current.index = NULL;
+                    current.handles = view->handles;
+                    if (mode >= 0 && mode < NUM_SORT_FIELDS && view->handles == NULL) {
+                        rosterEnsureIndexes();
+                        current.index = &sort_indexes[mode];
+                        int rank = indexRank(current.index, anchor);
+                        top = current.order > 0 ? rank : count - 1 - rank;
+                    } else if (mode >= 0) {
+                        // Search results and other short lists are sorted as a copy, as is
+                        // the whole store for subjects, which have no standing index
+                        if (sorted_handles == NULL) {
+                            sorted_handles = malloc(count * sizeof(int));
+                            if (sorted_handles == NULL)
+                                outOfMemory();
+                        }
+                        if (view->handles != NULL)
+                            memcpy(sorted_handles, view->handles, count * sizeof(int));
+                        else
+                            storeListHandles(&student_store, sorted_handles);
+                        SortKey key = { mode, current.order };
+                        sortHandles(sorted_handles, count, &key, 1);
+                        current.handles = sorted_handles;
+                    } else {
+                        current.order = 1;
+                    }
+                    if (current.index == NULL && current.handles == NULL) {
+                        top = storeRankOf(&student_store, storePositionOf(&student_store, anchor));
+                    } else if (current.index == NULL) {
+                        for (int i = 0; i < count; ++i) {
+                            if (viewHandleAt(&current, i) == anchor) {
+                                top = i;
+                                break;
+                            }
+                        }
+                    }
+                }
                 break;
             default:
                 break;
         }
+        if (top != previous_top)
+            table_dirty = 1;
         if (choice != -1) {
+            free(sorted_handles);
             if (choice == 0) { // Go Back
                 return; // Return to the previous menu
             } else { // Return to Main Menu
@@ -407,9 +1172,41 @@ void displayStudents(Student *list, int count, int return_code) {
     }
 }
 
+// Menu of the subjects in the schema; returns the chosen subject, or -1 to go back
+static int pickSubject(const char *title) {
+    char labels[MAX_SUBJECTS + 1][SUBJECT_NAME_SIZE + 8];
+    char *items[MAX_SUBJECTS + 1];
+    for (int i = 0; i <= num_subjects; ++i) {
+        sprintf(labels[i], "%d. %s", i + 1, i < num_subjects ? subject_names[i] : "Go Back");
+        items[i] = labels[i];
+    }
+    MenuModel menu = { items, num_subjects + 1, 0, -1, 4, 2 };
+    int redraw = 1;
+    while(1) {
+        int rows, cols;
+        getmaxyx(stdscr, rows, cols);
+        if (redraw) {
+            redraw = 0;
+            drawScreenFrame(title);
+
+            // Instructions
+            attron(A_DIM);
+            mvprintw(rows - 2, 2, "Use arrow keys to navigate, Enter to select.");
+            attroff(A_DIM);
+            menu.drawn = -1;
+        }
+        menuDraw(&menu, cols);
+        int c = getch();
+        int choice = menuKey(&menu, c);
+        if (c == KEY_RESIZE)
+            redraw = 1;
+        if (choice != -1)
+            return choice < num_subjects ? choice : -1;
+    }
+}
+
 void sortedOutput() {
     int sort_order = 1; // 1 for ascending, -1 for descending
-    int highlight = 1;
     int choice = -1;
     int c;
     char *choices[] = {
@@ -417,78 +1214,69 @@ void sortedOutput() {
             "1. Sort by Name",
             "2. Sort by Student Number",
             "3. Sort by Total Score",
-            "4. Go Back"
+            "4. Sort by Subject Grade",
+            "5. Go Back"
     };
-    int n_choices = sizeof(choices) / sizeof(char *);
+    MenuModel menu = { choices, sizeof(choices) / sizeof(char *), 1, -1, 4, 2 };
+    int redraw = 1;
     while(1) {
-        choice = -1; // Reset choice
-        clear();
         int rows, cols;
         getmaxyx(stdscr, rows, cols);
+        if (redraw) {
+            redraw = 0;
+            drawScreenFrame("Sorted Output");
 
-        // Draw border
-        box(stdscr, 0, 0);
-
-        // Title
-        attron(COLOR_PAIR(2) | A_BOLD);
-        mvprintw(1, (cols - strlen("Sorted Output"))/2, "Sorted Output");
-        attroff(COLOR_PAIR(2) | A_BOLD);
-
-        mvhline(2, 1, ACS_HLINE, cols - 2);
-
-        // Update sort order display
-        if (sort_order == 1)
-            choices[0] = "Sort Order: Ascending";
-        else
-            choices[0] = "Sort Order: Descending";
-
-        // Menu
-        int start_row = 4;
-        for (int i = 0; i < n_choices; ++i) {
-            if (i == highlight) {
-                attron(A_REVERSE | A_BOLD);
-                mvprintw(start_row + i, 2, "%s", choices[i]);
-                attroff(A_REVERSE | A_BOLD);
-            } else {
-                mvprintw(start_row + i, 2, "%s", choices[i]);
-            }
+            // Instructions
+            attron(A_DIM);
+            mvprintw(rows - 2, 2, "Use arrow keys to navigate, Enter to select.");
+            attroff(A_DIM);
+            menu.drawn = -1;
         }
 
-        // Instructions
-        attron(A_DIM);
-        mvprintw(rows - 2, 2, "Use arrow keys to navigate, Enter to select.");
-        attroff(A_DIM);
+        // Menu
+        menuDraw(&menu, cols);
 
         c = getch();
-        switch(c) {
-            case KEY_UP:
-                highlight = (highlight - 1 + n_choices) % n_choices;
-                break;
-            case KEY_DOWN:
-                highlight = (highlight + 1) % n_choices;
-                break;
-            case 10: // Enter key
-                choice = highlight;
-                break;
-            default:
-                break;
-        }
+        choice = menuKey(&menu, c);
+        if (c == KEY_RESIZE)
+            redraw = 1;
         if (choice != -1) {
             if (choice == 0) {
                 sort_order *= -1; // Toggle sort order
-            } else if (choice == 1) {
-                // Sort by name
-                sortStudentsByName(sort_order);
-                displayStudents(students, num_students, 2); // return_code = 2 (Return to Sorted Output)
-            } else if (choice == 2) {
-                // Sort by student number
-                sortStudentsByNumber(sort_order);
-                displayStudents(students, num_students, 2);
-            } else if (choice == 3) {
-                // Sort by total score
-                sortStudentsByTotalScore(sort_order);
-                displayStudents(students, num_students, 2);
+                // Update sort order display
+                if (sort_order == 1)
+                    choices[0] = "Sort Order: Ascending ";
+                else
+                    choices[0] = "Sort Order: Descending";
+                menu.drawn = -1;
+            } else if (choice >= 1 && choice <= 3) {
+                // Walk the standing index; the store order is left untouched
+                SortField field = SORT_BY_NAME;
+                if (choice == 2)
+                    field = SORT_BY_NUMBER;
+                else if (choice == 3)
+                    field = SORT_BY_TOTAL_SCORE;
+                rosterEnsureIndexes();
+                StudentView sorted = { NULL, &sort_indexes[field], sort_order, student_store.count, field };
+                displayStudents(&sorted, 2); // return_code = 2 (Return to Sorted Output)
+                redraw = 1;
             } else if (choice == 4) {
+                // Subjects have no standing index, so the roster is sorted for this view
+                int subject = pickSubject("Sort by Subject Grade");
+                if (subject >= 0) {
+                    int count = student_store.count;
+                    int *handles = malloc((count ? count : 1) * sizeof(int));
+                    if (handles == NULL)
+                        outOfMemory();
+                    storeListHandles(&student_store, handles);
+                    SortKey key = { SORT_BY_SUBJECT + subject, sort_order };
+                    sortHandles(handles, count, &key, 1);
+                    StudentView sorted = { handles, NULL, sort_order, count, key.field };
+                    displayStudents(&sorted, 2);
+                    free(handles);
+                }
+                redraw = 1;
+            } else if (choice == 5) {
                 // Go back to View Students menu
                 return;
             }
@@ -496,41 +1284,271 @@ void sortedOutput() {
     }
 }
 
-void sortStudentsByName(int order) {
-    // Simple bubble sort
-    for (int i = 0; i < num_students -1; ++i) {
-        for (int j = 0; j < num_students - i -1; ++j) {
-            if (order * strcmp(students[j].name, students[j+1].name) > 0) {
-                // Swap
-                Student temp = students[j];
-                students[j] = students[j+1];
-                students[j+1] = temp;
-            }
-        }
-    }
+// Sort passes cut the handles into parts of POOL_PART_ITEMS, which run in
+// parallel; every part keeps input order, so the sorts stay stable.
+static int sortParts(int count) {
+    return count > POOL_PART_ITEMS ? (count + POOL_PART_ITEMS - 1) / POOL_PART_ITEMS : 1;
 }
 
-void sortStudentsByNumber(int order) {
-    for (int i = 0; i < num_students -1; ++i) {
-        for (int j = 0; j < num_students - i -1; ++j) {
-            if (order * (students[j].student_number - students[j+1].student_number) > 0) {
-                Student temp = students[j];
-                students[j] = students[j+1];
-                students[j+1] = temp;
-            }
-        }
+typedef struct {
+    int *handles;
+    uint32_t *keys;
+    int *tmp_handles;
+    uint32_t *tmp_keys;
+    int count;
+    int shift; // Byte of the keys this pass sorts on
+    int (*offsets)[256]; // Per part: digit counts, then where the part writes each digit
+    SortKey key;
+} RadixJob;
+
+static void radixKeysPart(void *context, int part, int worker) {
+    (void)worker;
+    RadixJob *job = context;
+    int end = (part + 1) * POOL_PART_ITEMS < job->count ? (part + 1) * POOL_PART_ITEMS : job->count;
+    for (int i = part * POOL_PART_ITEMS; i < end; ++i) {
+        const Student *s = storeByHandle(&student_store, job->handles[i]);
+        int value = job->key.field == SORT_BY_NUMBER ? s->student_number
+                  : job->key.field == SORT_BY_TOTAL_SCORE ? s->total_score : s->grades[job->key.field - SORT_BY_SUBJECT];
+        // Flip the sign bit so signed order matches unsigned order; invert for descending
+        uint32_t key = (uint32_t)value ^ 0x80000000u;
+        job->keys[i] = job->key.order < 0 ? ~key : key;
     }
 }
 
-void sortStudentsByTotalScore(int order) {
-    for (int i = 0; i < num_students -1; ++i) {
-        for (int j = 0; j < num_students - i -1; ++j) {
-            if (order * (students[j].total_score - students[j+1].total_score) > 0) {
-                Student temp = students[j];
-                students[j] = students[j+1];
-                students[j+1] = temp;
-            }
-        }
+static void radixCountPart(void *context, int part, int worker) {
+    (void)worker;
+    RadixJob *job = context;
+    int *offsets = job->offsets[part];
+    memset(offsets, 0, 256 * sizeof(int));
+    int end = (part + 1) * POOL_PART_ITEMS < job->count ? (part + 1) * POOL_PART_ITEMS : job->count;
+    for (int i = part * POOL_PART_ITEMS; i < end; ++i) {
+        offsets[(job->keys[i] >> job->shift) & 0xFF]++;
+    }
+}
+
+static void radixScatterPart(void *context, int part, int worker) {
+    (void)worker;
+    RadixJob *job = context;
+    int *offsets = job->offsets[part];
+    int end = (part + 1) * POOL_PART_ITEMS < job->count ? (part + 1) * POOL_PART_ITEMS : job->count;
+    for (int i = part * POOL_PART_ITEMS; i < end; ++i) {
+        int dst = offsets[(job->keys[i] >> job->shift) & 0xFF]++;
+        job->tmp_handles[dst] = job->handles[i];
+        job->tmp_keys[dst] = job->keys[i];
+    }
+}
+
+// LSD radix sort of handles by one integer field, one byte per pass; stable.
+// Each pass counts digits per part, then every part scatters to its own slice
+// of each digit's range, so the parts need no locking.
+static void radixSortHandles(int *handles, int count, SortKey key) {
+    int parts = sortParts(count);
+    RadixJob job = { handles, malloc(count * sizeof(uint32_t)), malloc(count * sizeof(int)), malloc(count * sizeof(uint32_t)),
+                     count, 0, malloc(parts * sizeof(*job.offsets)), key };
+    if (job.keys == NULL || job.tmp_handles == NULL || job.tmp_keys == NULL || job.offsets == NULL)
+        outOfMemory();
+    poolRun(parts, radixKeysPart, &job);
+    for (job.shift = 0; job.shift < 32; job.shift += 8) {
+        poolRun(parts, radixCountPart, &job);
+        int first_digit = (job.keys[0] >> job.shift) & 0xFF, first_count = 0;
+        for (int p = 0; p < parts; ++p) {
+            first_count += job.offsets[p][first_digit];
+        }
+        if (first_count == count)
+            continue; // Every key shares this byte
+        // Digits in order, and within a digit the parts in order
+        int sum = 0;
+        for (int d = 0; d < 256; ++d) {
+            for (int p = 0; p < parts; ++p) {
+                int n = job.offsets[p][d];
+                job.offsets[p][d] = sum;
+                sum += n;
+            }
+        }
+        poolRun(parts, radixScatterPart, &job);
+        int *swap_handles = job.handles;
+        job.handles = job.tmp_handles;
+        job.tmp_handles = swap_handles;
+        uint32_t *swap_keys = job.keys;
+        job.keys = job.tmp_keys;
+        job.tmp_keys = swap_keys;
+    }
+    if (job.handles != handles) {
+        memcpy(handles, job.handles, count * sizeof(int));
+        free(job.handles);
+    } else {
+        free(job.tmp_handles);
+    }
+    free(job.keys);
+    free(job.tmp_keys);
+    free(job.offsets);
+}
+typedef struct {
+    uint64_t prefix; // First eight name bytes, big-endian, so most comparisons skip strcmp
+    const char *name;
+    int handle;
+} NameHandle;
+
+static int compareNameHandles(const NameHandle *a, const NameHandle *b) {
+    if (a->prefix != b->prefix)
+        return a->prefix < b->prefix ? -1 : 1;
+    return strcmp(a->name, b->name);
+}
+
+typedef struct {
+    int *handles;
+    NameHandle *items;
+    NameHandle *tmp;
+    int count;
+    int order;
+    int width; // Length of the sorted runs a merge pass pairs up
+} NameSortJob;
+
+// Fetches the names of one part, then sorts it: insertion sort of short runs,
+// then bottom-up merges
+static void nameSortPart(void *context, int part, int worker) {
+    (void)worker;
+    NameSortJob *job = context;
+    int lo = part * POOL_PART_ITEMS;
+    int count = (part + 1) * POOL_PART_ITEMS < job->count ? POOL_PART_ITEMS : job->count - lo;
+    NameHandle *items = job->items + lo, *tmp = job->tmp + lo;
+    for (int i = 0; i < count; ++i) {
+        const char *name = studentName(storeByHandle(&student_store, job->handles[lo + i]));
+        uint64_t prefix = 0;
+        for (int b = 0, end = 0; b < 8; ++b) {
+            end = end || name[b] == '\0';
+            prefix = prefix << 8 | (end ? 0 : (unsigned char)name[b]);
+        }
+        items[i].prefix = prefix;
+        items[i].name = name;
+        items[i].handle = job->handles[lo + i];
+    }
+
+    // Insertion sort short runs
+    int order = job->order;
+    for (int start = 0; start < count; start += SORT_INSERTION_RUN) {
+        int end = start + SORT_INSERTION_RUN < count ? start + SORT_INSERTION_RUN : count;
+        for (int i = start + 1; i < end; ++i) {
+            NameHandle item = items[i];
+            int j = i - 1;
+            while (j >= start && order * compareNameHandles(&items[j], &item) > 0) {
+                items[j + 1] = items[j];
+                --j;
+            }
+            items[j + 1] = item;
+        }
+    }
+
+    // Merge runs; ties take the left element to stay stable
+    NameHandle *from = items, *to = tmp;
+    for (int width = SORT_INSERTION_RUN; width < count; width *= 2) {
+        for (int lo = 0; lo < count; lo += 2 * width) {
+            int mid = lo + width < count ? lo + width : count;
+            int hi = lo + 2 * width < count ? lo + 2 * width : count;
+            int i = lo, j = mid, k = lo;
+            while (i < mid && j < hi) {
+                if (order * compareNameHandles(&from[i], &from[j]) <= 0)
+                    to[k++] = from[i++];
+                else
+                    to[k++] = from[j++];
+            }
+            while (i < mid)
+                to[k++] = from[i++];
+            while (j < hi)
+                to[k++] = from[j++];
+        }
+        NameHandle *swap = from;
+        from = to;
+        to = swap;
+    }
+    if (from != items)
+        memcpy(items, from, count * sizeof(NameHandle));
+}
+
+// Elements of a the first k outputs of merging a and b take, ties going to a
+static int nameMergeSplit(const NameHandle *a, int na, const NameHandle *b, int nb, int k, int order) {
+    int lo = k > nb ? k - nb : 0, hi = k < na ? k : na;
+    while (lo < hi) {
+        int i = lo + (hi - lo) / 2;
+        if (order * compareNameHandles(&a[i], &b[k - i - 1]) <= 0)
+            lo = i + 1; // a[i] comes before b[k - i - 1], so it is among the first k
+        else
+            hi = i;
+    }
+    return lo;
+}
+
+// Writes one part of the output of a merge pass over runs of job->width, from
+// items to tmp. Parts are no longer than a run, so each lies within one merge,
+// and finds where it starts in both runs by binary search.
+static void nameMergePart(void *context, int part, int worker) {
+    (void)worker;
+    NameSortJob *job = context;
+    int start = part * POOL_PART_ITEMS;
+    int end = start + POOL_PART_ITEMS < job->count ? start + POOL_PART_ITEMS : job->count;
+    int lo = start / (2 * job->width) * (2 * job->width);
+    int mid = lo + job->width < job->count ? lo + job->width : job->count;
+    int hi = lo + 2 * job->width < job->count ? lo + 2 * job->width : job->count;
+    const NameHandle *a = job->items + lo, *b = job->items + mid;
+    int na = mid - lo, nb = hi - mid;
+    int i = nameMergeSplit(a, na, b, nb, start - lo, job->order);
+    int j = start - lo - i;
+    int i_end = nameMergeSplit(a, na, b, nb, end - lo, job->order);
+    int j_end = end - lo - i_end;
+    NameHandle *out = job->tmp + start;
+    while (i < i_end && j < j_end) {
+        if (job->order * compareNameHandles(&a[i], &b[j]) <= 0)
+            *out++ = a[i++];
+        else
+            *out++ = b[j++];
+    }
+    while (i < i_end)
+        *out++ = a[i++];
+    while (j < j_end)
+        *out++ = b[j++];
+}
+
+static void nameHandlesPart(void *context, int part, int worker) {
+    (void)worker;
+    NameSortJob *job = context;
+    int end = (part + 1) * POOL_PART_ITEMS < job->count ? (part + 1) * POOL_PART_ITEMS : job->count;
+    for (int i = part * POOL_PART_ITEMS; i < end; ++i) {
+        job->handles[i] = job->items[i].handle;
+    }
+}
+
+// Merge sort of handles by name; stable, names are fetched once up front.
+// Parts are sorted in parallel, then merged pairwise with every merge pass
+// split evenly over the pool.
+static void mergeSortHandlesByName(int *handles, int count, int order) {
+    NameSortJob job = { handles, malloc(count * sizeof(NameHandle)), malloc(count * sizeof(NameHandle)), count, order, 0 };
+    if (job.items == NULL || job.tmp == NULL)
+        outOfMemory();
+    int parts = sortParts(count);
+    poolRun(parts, nameSortPart, &job);
+    for (job.width = POOL_PART_ITEMS; job.width < count; job.width *= 2) {
+        poolRun(parts, nameMergePart, &job);
+        NameHandle *swap = job.items;
+        job.items = job.tmp;
+        job.tmp = swap;
+    }
+    poolRun(parts, nameHandlesPart, &job);
+    free(job.items);
+    free(job.tmp);
+}
+
+// Stable multi-key sort of record handles; keys[0] is the primary key
+void sortHandles(int *handles, int count, const SortKey *keys, int num_keys) {
+    if (count < 2)
+        return;
+    if (count > POOL_PART_ITEMS)
+        storeLoadAll(&student_store); // Parts read records from other threads
+    // Apply keys from least to most significant; each pass is stable
+    for (int k = num_keys - 1; k >= 0; --k) {
+        if (keys[k].field == SORT_BY_NAME)
+            mergeSortHandlesByName(handles, count, keys[k].order);
+        else
+            radixSortHandles(handles, count, keys[k]);
     }
 }
 
@@ -539,19 +1557,7 @@ void searchOutput() {
         echo();
         curs_set(1); // Show cursor
         char search_name[50];
-        clear();
-        int rows, cols;
-        getmaxyx(stdscr, rows, cols);
-
-        // Draw border
-        box(stdscr, 0, 0);
-
-        // Title
-        attron(COLOR_PAIR(2) | A_BOLD);
-        mvprintw(1, (cols - strlen("Search Student by Name"))/2, "Search Student by Name");
-        attroff(COLOR_PAIR(2) | A_BOLD);
-
-        mvhline(2, 1, ACS_HLINE, cols - 2);
+        drawScreenFrame("Search Student by Name");
 
         mvprintw(4, 2, "Enter Name: ");
         move(4, 14);
@@ -562,87 +1568,120 @@ void searchOutput() {
         noecho();
         curs_set(0); // Hide cursor
 
-        // Search for students with matching name
-        Student found_students[MAX_STUDENTS];
-        int found_count = 0;
-        for (int i = 0; i < num_students; ++i) {
-            if (strcmp(students[i].name, search_name) == 0) {
-                found_students[found_count++] = students[i];
-            }
-        }
+        // Search for students whose name starts with or contains the query
+        HandleList found_handles = { NULL, 0, 0 };
+        searchNames(search_name, &found_handles);
+        int found_count = found_handles.count;
 
         // Display results
-        clear();
-        // Draw border
-        box(stdscr, 0, 0);
-
-        // Title
-        attron(COLOR_PAIR(2) | A_BOLD);
-        mvprintw(1, (cols - strlen("Search Results"))/2, "Search Results");
-        attroff(COLOR_PAIR(2) | A_BOLD);
-
-        mvhline(2, 1, ACS_HLINE, cols - 2);
+        drawScreenFrame("Search Results");
 
         int choice = -1;
         if (found_count > 0) {
-            displayStudents(found_students, found_count, 0); // return_code = 0
+            StudentView found = { found_handles.handles, NULL, 1, found_count, -1 };
+            displayStudents(&found, 0); // return_code = 0
+            free(found_handles.handles);
             // After displaying, prompt to go back
             return; // Return to View Students
         } else {
-            mvprintw(4, 2, "No students found with that name.");
+            free(found_handles.handles);
+            mvprintw(4, 2, "No students found matching that name.");
             // Options
             char *choices[] = {
-                    "1. Search Again",
-                    "2. Return to View Students",
-                    "3. Return to Menu"
+                    "1. Show Closest Matches",
+                    "2. Search Again",
+                    "3. Return to View Students",
+                    "4. Return to Menu"
             };
-            int n_choices = sizeof(choices) / sizeof(char *);
-            int highlight = 0;
+            MenuModel menu = { choices, sizeof(choices) / sizeof(char *), 0, -1, 6, 2 };
             int c;
-            while(1) {
-                choice = -1; // Reset choice
+            do {
                 // Display options
-                for (int i = 0; i < n_choices; ++i) {
-                    if (i == highlight) {
-                        attron(A_REVERSE | A_BOLD);
-                        mvprintw(6 + i, 2, "%s", choices[i]);
-                        attroff(A_REVERSE | A_BOLD);
-                    } else {
-                        mvprintw(6 + i, 2, "%s", choices[i]);
-                    }
-                }
+                menuDraw(&menu, getmaxx(stdscr));
                 c = getch();
-                switch(c) {
-                    case KEY_UP:
-                        highlight = (highlight - 1 + n_choices) % n_choices;
-                        break;
-                    case KEY_DOWN:
-                        highlight = (highlight + 1) % n_choices;
-                        break;
-                    case 10: // Enter key
-                        choice = highlight;
-                        break;
-                    default:
-                        break;
-                }
-                if (choice != -1)
-                    break;
-            }
+                choice = menuKey(&menu, c);
+            } while (choice == -1);
             if (choice == 0) {
-                continue; // Search again
-            } else if (choice == 1) {
+                // Rank every name by edit distance to the query
+                HandleList closest = { NULL, 0, 0 };
+                fuzzySearchNames(search_name, FUZZY_TOP_K, &closest);
+                StudentView found = { closest.handles, NULL, 1, closest.count, -1 };
+                displayStudents(&found, 0);
+                free(closest.handles);
                 return; // Return to View Students
+            } else if (choice == 1) {
+                continue; // Search again
             } else if (choice == 2) {
+                return; // Return to View Students
+            } else if (choice == 3) {
                 longjmp(mainMenuJmpBuf, 1); // Return to main menu
             }
         }
     }
 }
 
+void filterOutput() {
+    while(1) {
+        echo();
+        curs_set(1); // Show cursor
+        char expression[QUERY_LINE_SIZE];
+        drawScreenFrame("Filter Students");
+
+        attron(A_DIM);
+        mvprintw(6, 2, "For example: Math < 60 and (total >= 350 or any = F)");
+        mvprintw(7, 2, "Fields: a subject, total, average, number, name, any, all. Names also take ~ (contains).");
+        attroff(A_DIM);
+        mvprintw(4, 2, "Enter Filter: ");
+        move(4, 16);
+        clrtoeol();
+        refresh();
+        getnstr(expression, sizeof(expression) - 1);
+
+        noecho();
+        curs_set(0); // Hide cursor
+
+        // Compile once, then run over the whole roster
+        FilterProgram program;
+        const char *error = filterCompile(expression, &program);
+        HandleList found_handles = { NULL, 0, 0 };
+        if (error == NULL)
+            filterStudents(&program, &found_handles);
+
+        drawScreenFrame("Filter Results");
+        if (found_handles.count > 0) {
+            StudentView found = { found_handles.handles, NULL, 1, found_handles.count, -1 };
+            displayStudents(&found, 0);
+            free(found_handles.handles);
+            return; // Return to View Students
+        }
+        if (error != NULL)
+            mvprintw(4, 2, "Invalid filter: %s.", error);
+        else
+            mvprintw(4, 2, "No students match that filter.");
+        char *choices[] = {
+                "1. Filter Again",
+                "2. Return to View Students",
+                "3. Return to Menu"
+        };
+        MenuModel menu = { choices, sizeof(choices) / sizeof(char *), 0, -1, 6, 2 };
+        int c;
+        int choice;
+        do {
+            menuDraw(&menu, getmaxx(stdscr));
+            c = getch();
+            choice = menuKey(&menu, c);
+        } while (choice == -1);
+        if (choice == 1)
+            return; // Return to View Students
+        else if (choice == 2)
+            longjmp(mainMenuJmpBuf, 1); // Return to main menu
+    }
+}
+
 
 void modifyStudentInfo() {
-    if (num_students == 0) {
-        clear();
+    if (student_store.count == 0) {
+        erase();
         int rows, cols;
         getmaxyx(stdscr, rows, cols);
 
@@ -654,56 +1693,27 @@ void modifyStudentInfo() {
         return;
     }
     int highlight = 0;
-    int c;
     while(1) {
-        clear();
-        int rows, cols;
-        getmaxyx(stdscr, rows, cols);
-
-        // Draw border
-        box(stdscr, 0, 0);
-
-        // Title
-        attron(COLOR_PAIR(2) | A_BOLD);
-        mvprintw(1, (cols - strlen("Modify Student Info"))/2, "Modify Student Info");
-        attroff(COLOR_PAIR(2) | A_BOLD);
-
-        mvhline(2, 1, ACS_HLINE, cols - 2);
-
-        // Student list
-        int start_row = 4;
-        for (int i = 0; i < num_students; ++i) { // Changed loop to start from 0
-            if (i == highlight) {
-                attron(A_REVERSE | A_BOLD);
-                mvprintw(start_row + i, 2, "%d. %s", students[i].id, students[i].name);
-                attroff(A_REVERSE | A_BOLD);
-            } else {
-                mvprintw(start_row + i, 2, "%d. %s", students[i].id, students[i].name);
-            }
-        }
-
-        // Instructions
-        attron(A_DIM);
-        mvprintw(rows - 2, 2, "Use arrow keys to select, Enter to modify, 'q' to quit.");
-        attroff(A_DIM);
-
-        c = getch();
+        int c = pickStudent("Modify Student Info", "Use arrow keys to select, Enter to modify, 'f' to find by number, 'q' to quit.", &highlight);
         if (c == 'q' || c == 'Q') {
             break;
-        } else if (c == KEY_UP) {
-            highlight = (highlight - 1 + num_students) % num_students;
-        } else if (c == KEY_DOWN) {
-            highlight = (highlight + 1) % num_students;
         } else if (c == 10) { // Enter key
-            editStudent(&students[highlight]);
+            editStudent(storeHandleAt(&student_store, storeSelect(&student_store, highlight)));
+        } else if (c == 'f' || c == 'F') {
+            int handle = findStudentByNumber("Modify Student Info");
+            if (handle >= 0)
+                editStudent(handle);
         }
     }
 }
-
-void editStudent(Student *s) {
+void editStudent(int handle) {
+    // Edit a copy so the indexes can be updated when it is committed
+    Student edited;
+    studentCopy(&edited, storeByHandle(&student_store, handle));
+    Student *s = &edited;
     echo();
     curs_set(1);
-    clear();
+    erase();
     int rows, cols;
     getmaxyx(stdscr, rows, cols);
 
@@ -721,22 +1731,36 @@ void editStudent(Student *s) {
 
     mvprintw(start_row, 2, "Current Student Number: %d", s->student_number);
     s->student_number = getIntegerInput("New Student Number: ");
+    int owner;
+    while ((owner = rosterFindNumber(s->student_number)) >= 0 && owner != handle) {
+        mvprintw(getcury(stdscr), 2, "Student number %d is already registered.", s->student_number);
+        move(getcury(stdscr) + 1, 0);
+        s->student_number = getIntegerInput("New Student Number: ");
+    }
 
-    mvprintw(start_row + 2, 2, "Current Name: %s", s->name);
-    getStringInput("New Name: ", s->name, sizeof(s->name));
+    char name[NAME_SIZE];
+    mvprintw(start_row + 2, 2, "Current Name: %s", studentName(s));
+    getStringInput("New Name: ", name, sizeof(name));
+    studentSetName(s, name);
 
-    s->total_score = 0;
-    for (int i = 0; i < NUM_SUBJECTS; ++i) {
-        mvprintw(start_row + 4 + i*2, 2, "Current %s Grade: %d (%c)", subject_names[i], s->grades[i], s->letter_grades[i]);
-        char prompt[50];
-        sprintf(prompt, "New %s Grade: ", subject_names[i]);
-        s->grades[i] = getIntegerInput(prompt);
-        s->total_score += s->grades[i];
-        s->letter_grades[i] = assignLetterGrade(s->grades[i]);
+    int grades_row = start_row + 4;
+    move(grades_row, 0);
+    for (int i = 0; i < num_subjects; ++i) {
+        char grade[3];
+        gradeName(assignLetterGrade(i, s->grades[i]), grade);
+        promptRowCheck(grades_row);
+        mvprintw(getcury(stdscr), 2, "Current %s Grade: %d (%s)", subject_names[i], s->grades[i], grade);
+        move(getcury(stdscr) + 1, 0);
+        char prompt[SUBJECT_NAME_SIZE + 16];
+        sprintf(prompt, "New %.*s Grade: ", SUBJECT_NAME_SIZE - 1, subject_names[i]);
+        s->grades[i] = getGradeInput(prompt);
     }
-    s->average = s->total_score / (double)NUM_SUBJECTS;
+    computeStudentScores(s);
+    rosterUpdate(handle, s);
+    journalCommit();
 
-    mvprintw(start_row + NUM_SUBJECTS * 2 + 6, 2, "Modification completed!");
+    promptRowCheck(grades_row);
+    mvprintw(getcury(stdscr) + 1, 2, "Modification completed!");
     attron(A_DIM);
     mvprintw(rows - 2, 2, "Press Enter to return to the menu.");
     attroff(A_DIM);
@@ -746,8 +1770,8 @@ void editStudent(Student *s) {
 }
 
 void deleteStudent() {
-    if (num_students == 0) {
-        clear();
+    if (student_store.count == 0) {
+        erase();
         int rows, cols;
         getmaxyx(stdscr, rows, cols);
 
@@ -761,47 +1785,17 @@ void deleteStudent() {
     int highlight = 0;
     int c;
     while(1) {
-        clear();
+        c = pickStudent("Delete Student", "Use arrow keys to select, Enter to delete, 'f' to find by number, 'q' to quit.", &highlight);
         int rows, cols;
         getmaxyx(stdscr, rows, cols);
-
-        // Draw border
-        box(stdscr, 0, 0);
-
-        // Title
-        attron(COLOR_PAIR(2) | A_BOLD);
-        mvprintw(1, (cols - strlen("Delete Student"))/2, "Delete Student");
-        attroff(COLOR_PAIR(2) | A_BOLD);
-
-        mvhline(2, 1, ACS_HLINE, cols - 2);
-
-        // Student list
-        int start_row = 4;
-        for (int i = 0; i < num_students; ++i) { // Changed loop to start from 0
-            if (i == highlight) {
-                attron(A_REVERSE | A_BOLD);
-                mvprintw(start_row + i, 2, "%d. %s", students[i].id, students[i].name);
-                attroff(A_REVERSE | A_BOLD);
-            } else {
-                mvprintw(start_row + i, 2, "%d. %s", students[i].id, students[i].name);
-            }
-        }
-
-        // Instructions
-        attron(A_DIM);
-        mvprintw(rows - 2, 2, "Use arrow keys to select, Enter to delete, 'q' to quit.");
-        attroff(A_DIM);
-
-        c = getch();
         if (c == 'q' || c == 'Q') {
             break;
-        } else if (c == KEY_UP) {
-            highlight = (highlight - 1 + num_students) % num_students;
-        } else if (c == KEY_DOWN) {
-            highlight = (highlight + 1) % num_students;
-        } else if (c == 10) { // Enter key
+        } else if (c == 10 || c == 'f' || c == 'F') { // Enter key, or find by number
+            int target = c == 10 ? storeHandleAt(&student_store, storeSelect(&student_store, highlight)) : findStudentByNumber("Delete Student");
+            if (target < 0)
+                continue;
             // Confirm deletion
-            clear();
+            erase();
             // Draw border
             box(stdscr, 0, 0);
             mvprintw(1, (cols - strlen("Delete Student"))/2, "Delete Student");
@@ -809,10 +1803,8 @@ void deleteStudent() {
             c = getch();
             if (c == 'y' || c == 'Y') {
                 // Delete student
-                for (int i = highlight; i < num_students - 1; ++i) {
-                    students[i] = students[i + 1];
-                }
-                num_students--;
+                rosterRemove(target);
+                journalCommit();
                 mvprintw(rows / 2 + 1, (cols - strlen("Deletion completed!")) / 2, "Deletion completed!");
                 mvprintw(rows - 2, 2, "Press Enter to return to the menu.");
                 getch();
@@ -824,6 +1816,138 @@ void deleteStudent() {
     }
 }
 
+// Draws the record in slot pos as a pick list row
+static void pickDrawRow(int line, int pos, int highlighted, int cols) {
+    Student scratch;
+    const Student *s = storePeek(&student_store, pos, &scratch);
+    mvhline(line, 1, ' ', cols - 2);
+    if (highlighted)
+        attron(A_REVERSE | A_BOLD);
+    mvprintw(line, 2, "%d. %s", s->id, studentName(s));
+    if (highlighted)
+        attroff(A_REVERSE | A_BOLD);
+}
+
+// Pick list over the roster in registration order. Only the rows that fit are
+// drawn, and moving the highlight within the page repaints just the two rows
+// involved. Returns the key that ended the pick (Enter, 'f' or 'q'), with the
+// rank of the chosen student in store order in *highlight.
+int pickStudent(const char *title, const char *instructions, int *highlight) {
+    int count = student_store.count;
+    if (*highlight >= count)
+        *highlight = count - 1;
+    int top = 0;
+    int drawn_top = -1; // First row on screen, -1 when the list must be repainted
+    int drawn = -1; // Highlighted row on screen
+    int redraw = 1;
+    while(1) {
+        int rows, cols;
+        getmaxyx(stdscr, rows, cols);
+        int start_row = 4;
+        int page = rows - start_row - 3;
+        if (page < 1)
+            page = 1;
+        if (redraw) {
+            redraw = 0;
+            drawScreenFrame(title);
+
+            // Instructions
+            attron(A_DIM);
+            mvprintw(rows - 2, 2, "%s", instructions);
+            attroff(A_DIM);
+            drawn_top = -1;
+        }
+
+        // Student list, scrolled to keep the highlight in view
+        if (*highlight < top)
+            top = *highlight;
+        else if (*highlight >= top + page)
+            top = *highlight - page + 1;
+        if (top != drawn_top) {
+            int pos = storeSelect(&student_store, top);
+            for (int i = 0; i < page; ++i) {
+                if (top + i < count) {
+                    pickDrawRow(start_row + i, pos, top + i == *highlight, cols);
+                    pos = storeNextLive(&student_store, pos + 1);
+                } else {
+                    mvhline(start_row + i, 1, ' ', cols - 2);
+                }
+            }
+            drawn_top = top;
+        } else if (drawn != *highlight) {
+            pickDrawRow(start_row + drawn - top, storeSelect(&student_store, drawn), 0, cols);
+            pickDrawRow(start_row + *highlight - top, storeSelect(&student_store, *highlight), 1, cols);
+        }
+        drawn = *highlight;
+
+        int c = getch();
+        switch(c) {
+            case KEY_UP:
+                *highlight = (*highlight - 1 + count) % count;
+                break;
+            case KEY_DOWN:
+                *highlight = (*highlight + 1) % count;
+                break;
+            case KEY_PPAGE:
+                *highlight = *highlight - page > 0 ? *highlight - page : 0;
+                break;
+            case KEY_NPAGE:
+                *highlight = *highlight + page < count - 1 ? *highlight + page : count - 1;
+                break;
+            case KEY_HOME:
+                *highlight = 0;
+                break;
+            case KEY_END:
+                *highlight = count - 1;
+                break;
+            case KEY_RESIZE:
+                redraw = 1;
+                break;
+            case 10: // Enter key
+            case 'f':
+            case 'F':
+            case 'q':
+            case 'Q':
+                return c;
+            default:
+                break;
+        }
+    }
+}
+
+int findStudentByNumber(const char *title) {
+    echo();
+    curs_set(1);
+    erase();
+    int rows, cols;
+    getmaxyx(stdscr, rows, cols);
+
+    // Draw border
+    box(stdscr, 0, 0);
+
+    // Title
+    attron(COLOR_PAIR(2) | A_BOLD);
+    mvprintw(1, (cols - strlen(title))/2, "%s", title);
+    attroff(COLOR_PAIR(2) | A_BOLD);
+
+    mvhline(2, 1, ACS_HLINE, cols - 2);
+
+    move(4, 0);
+    int student_number = getIntegerInput("Student Number: ");
+    noecho();
+    curs_set(0);
+
+    int handle = rosterFindNumber(student_number);
+    if (handle < 0) {
+        mvprintw(6, 2, "No student with number %d.", student_number);
+        attron(A_DIM);
+        mvprintw(rows - 2, 2, "Press Enter to go back.");
+        attroff(A_DIM);
+        getch();
+    }
+    return handle;
+}
+
 int getIntegerInput(const char *prompt) {
     char input[50];
     int value;
@@ -833,15 +1957,7 @@ int getIntegerInput(const char *prompt) {
         clrtoeol();
         refresh();
         getnstr(input, sizeof(input) - 1);
-        int valid = 1;
-        for (int i = 0; input[i] != '\0'; ++i) {
-            if (!isdigit(input[i]) && !(i == 0 && input[i] == '-')) {
-                valid = 0;
-                break;
-            }
-        }
-        if (valid) {
-            value = atoi(input);
+        if (parseInteger(input, &value)) {
             break;
         } else {
             mvprintw(getcury(stdscr) + 1, 2, "Invalid input. Please enter a valid integer.");
@@ -852,10 +1968,5197 @@ int getIntegerInput(const char *prompt) {
     return value;
 }
 
+// Asks for a grade until one in the range a record holds is entered
+int getGradeInput(const char *prompt) {
+    int grade = getIntegerInput(prompt);
+    while (grade < 0 || grade > GRADE_MAX_SCORE) {
+        mvprintw(getcury(stdscr), 2, "Grades run from 0 to %d.", GRADE_MAX_SCORE);
+        move(getcury(stdscr) + 1, 0);
+        grade = getIntegerInput(prompt);
+    }
+    return grade;
+}
+
+// Digits with an optional leading minus sign, within int range; returns 0 if invalid
+int parseInteger(const char *text, int *value) {
+    long long result = 0;
+    int negative = text[0] == '-';
+    if (text[negative] == '\0')
+        return 0;
+    for (int i = negative; text[i] != '\0'; ++i) {
+        if (!isdigit((unsigned char)text[i]))
+            return 0;
+        result = result * 10 + (text[i] - '0');
+        if (result > (long long)INT32_MAX + negative)
+            return 0;
+    }
+    *value = (int)(negative ? -result : result);
+    return 1;
+}
+
 void getStringInput(const char *prompt, char *buffer, int buffer_size) {
     mvprintw(getcury(stdscr), 2, "%s", prompt);
     move(getcury(stdscr), strlen(prompt) + 2);
     clrtoeol();
     refresh();
     getnstr(buffer, buffer_size - 1);
-}
\ No newline at end of file
+}
+
+void outOfMemory() {
+    endwin();
+    fprintf(stderr, "Out of memory.\n");
+    exit(1);
+}
+
+void *arenaAlloc(Arena *arena, size_t size) {
+    size = (size + 15) & ~(size_t)15; // Keep allocations 16-byte aligned
+    ArenaBlock *block = arena->head;
+    if (block == NULL || block->size - block->used < size) {
+        size_t block_size = size > arena->block_size ? size : arena->block_size;
+        block = malloc(sizeof(ArenaBlock) + block_size);
+        if (block == NULL)
+            outOfMemory();
+        block->next = arena->head;
+        block->used = 0;
+        block->size = block_size;
+        arena->head = block;
+    }
+    void *ptr = block->data + block->used;
+    block->used += size;
+    return ptr;
+}
+
+static const char *nameArenaAt(const NameArena *arena, uint32_t offset) {
+    return arena->blocks[offset >> NAME_BLOCK_BITS] + (offset & (NAME_BLOCK_SIZE - 1));
+}
+
+// Name of a record, NUL-terminated
+const char *studentName(const Student *s) {
+    return nameArenaAt(&name_arena, s->name_offset);
+}
+
+static uint32_t nameHash(const char *name, size_t length) {
+    uint32_t hash = 2166136261u; // FNV-1a
+    for (size_t i = 0; i < length; ++i) {
+        hash = (hash ^ (unsigned char)name[i]) * 16777619u;
+    }
+    return hash;
+}
+
+// Copies a name to the end of the arena, in a new block if it does not fit in the last
+static uint32_t nameArenaAppend(NameArena *arena, const char *name, size_t length) {
+    if (((uint64_t)arena->num_blocks << NAME_BLOCK_BITS) - arena->used < length + 1) {
+        if (arena->num_blocks == NAME_MAX_BLOCKS)
+            outOfMemory();
+        arena->tail = malloc(NAME_BLOCK_SIZE);
+        if (arena->tail == NULL)
+            outOfMemory();
+        arena->used = (uint64_t)arena->num_blocks << NAME_BLOCK_BITS;
+        arena->blocks[arena->num_blocks++] = arena->tail;
+    }
+    uint32_t offset = arena->used;
+    char *to = arena->tail + (offset & (NAME_BLOCK_SIZE - 1));
+    memcpy(to, name, length);
+    to[length] = '\0';
+    arena->used += length + 1;
+    return offset;
+}
+
+static void nameArenaGrow(NameArena *arena) {
+    uint32_t *old_slots = arena->slots;
+    uint32_t old_capacity = arena->capacity;
+    arena->capacity = old_capacity ? old_capacity * 2 : NAME_INTERN_MIN_CAPACITY;
+    arena->slots = calloc(arena->capacity, sizeof(uint32_t));
+    if (arena->slots == NULL)
+        outOfMemory();
+    uint32_t mask = arena->capacity - 1;
+    for (uint32_t j = 0; j < old_capacity; ++j) {
+        if (old_slots[j] == 0)
+            continue;
+        const char *name = nameArenaAt(arena, old_slots[j] - 1);
+        uint32_t i = nameHash(name, strlen(name)) & mask;
+        while (arena->slots[i] != 0)
+            i = (i + 1) & mask;
+        arena->slots[i] = old_slots[j];
+    }
+    free(old_slots);
+}
+
+// Points a record at a copy of name (cut to NAME_SIZE - 1 bytes), sharing one
+// already added since the last save if it is equal. Only the writer adds names.
+void studentSetName(Student *s, const char *name) {
+    NameArena *arena = &name_arena;
+    size_t length = strnlen(name, NAME_SIZE - 1);
+    if (2 * (arena->count + 1) > arena->capacity)
+        nameArenaGrow(arena);
+    uint32_t mask = arena->capacity - 1;
+    uint32_t i = nameHash(name, length) & mask;
+    while (arena->slots[i] != 0) {
+        const char *other = nameArenaAt(arena, arena->slots[i] - 1);
+        if (strncmp(other, name, length) == 0 && other[length] == '\0')
+            break;
+        i = (i + 1) & mask;
+    }
+    if (arena->slots[i] == 0) {
+        arena->slots[i] = nameArenaAppend(arena, name, length) + 1;
+        arena->count++;
+    }
+    s->name_offset = arena->slots[i] - 1;
+    s->name_length = length;
+}
+
+// Makes a mapped snapshot heap the first blocks of an empty arena; names added later go after it
+void nameArenaMap(NameArena *arena, const char *heap, uint64_t size) {
+    while (((uint64_t)arena->num_blocks << NAME_BLOCK_BITS) < size) {
+        arena->blocks[arena->num_blocks] = heap + ((uint64_t)arena->num_blocks << NAME_BLOCK_BITS);
+        arena->num_blocks++;
+    }
+    arena->used = (uint64_t)arena->num_blocks << NAME_BLOCK_BITS;
+}
+
+// Drops the intern table; the names stay where they are
+void nameArenaForget(NameArena *arena) {
+    free(arena->slots);
+    arena->slots = NULL;
+    arena->capacity = 0;
+    arena->count = 0;
+}
+
+// Work-stealing pool for data-parallel passes. A pass is cut into parts, which
+// are dealt out in contiguous runs, one run per thread; a thread that finishes
+// its run takes parts from the others' runs. The calling thread works through
+// its own run too, then waits for the stragglers. Threads start on first use.
+typedef struct {
+    _Alignas(64) atomic_int next; // Next part of the run to take; a cache line each
+    int end;
+} PoolRun;
+
+typedef struct {
+    pthread_mutex_t pass_lock; // Held for a whole pass, so callers on several threads take turns
+    pthread_mutex_t lock;
+    pthread_cond_t start; // Signalled when a pass is posted
+    pthread_cond_t done; // Signalled when the last worker finishes a pass
+    int num_threads; // Including the caller; 0 until the pool starts
+    long pass; // Number of passes posted
+    int busy; // Workers still in the current pass
+    PoolTask task;
+    void *context;
+    PoolRun runs[POOL_MAX_THREADS];
+} WorkPool;
+
+WorkPool work_pool = { PTHREAD_MUTEX_INITIALIZER, PTHREAD_MUTEX_INITIALIZER, PTHREAD_COND_INITIALIZER, PTHREAD_COND_INITIALIZER, 0, 0, 0, NULL, NULL, {{0}} };
+int pool_threads_wanted = 0; // Set by --threads; 0 for one per online core
+
+// Takes parts from the worker's own run, then steals from the others in turn
+static void poolWork(int worker) {
+    int n = work_pool.num_threads;
+    for (int i = 0; i < n; ++i) {
+        PoolRun *run = &work_pool.runs[(worker + i) % n];
+        for (int part = atomic_fetch_add(&run->next, 1); part < run->end; part = atomic_fetch_add(&run->next, 1)) {
+            work_pool.task(work_pool.context, part, worker);
+        }
+    }
+}
+
+static void *poolWorker(void *arg) {
+    int worker = (int)(intptr_t)arg;
+    long seen = 0;
+    pthread_mutex_lock(&work_pool.lock);
+    while (1) {
+        while (work_pool.pass == seen)
+            pthread_cond_wait(&work_pool.start, &work_pool.lock);
+        seen = work_pool.pass;
+        pthread_mutex_unlock(&work_pool.lock);
+        poolWork(worker);
+        pthread_mutex_lock(&work_pool.lock);
+        if (--work_pool.busy == 0)
+            pthread_cond_signal(&work_pool.done);
+    }
+    return NULL;
+}
+
+// Threads a pass runs on, counting the caller; starts the pool if needed
+int poolThreads() {
+    if (work_pool.num_threads > 0)
+        return work_pool.num_threads;
+    long wanted = pool_threads_wanted > 0 ? pool_threads_wanted : sysconf(_SC_NPROCESSORS_ONLN);
+    if (wanted < 1)
+        wanted = 1;
+    if (wanted > POOL_MAX_THREADS)
+        wanted = POOL_MAX_THREADS;
+    // Workers block every signal, so terminal signals still reach the main thread
+    sigset_t all, previous;
+    sigfillset(&all);
+    pthread_sigmask(SIG_SETMASK, &all, &previous);
+    work_pool.num_threads = 1;
+    for (long t = 1; t < wanted; ++t) {
+        pthread_t thread;
+        if (pthread_create(&thread, NULL, poolWorker, (void *)(intptr_t)t) != 0)
+            break; // Run with the threads there are
+        pthread_detach(thread);
+        work_pool.num_threads++;
+    }
+    pthread_sigmask(SIG_SETMASK, &previous, NULL);
+    return work_pool.num_threads;
+}
+
+// Runs task on parts 0 to parts - 1, spread over the pool, and returns when all
+// are done. Parts run in no particular order, and tasks must not call poolRun.
+void poolRun(int parts, PoolTask task, void *context) {
+    pthread_mutex_lock(&work_pool.pass_lock);
+    int n = parts > 1 ? poolThreads() : 1;
+    if (n == 1) {
+        for (int part = 0; part < parts; ++part) {
+            task(context, part, 0);
+        }
+        pthread_mutex_unlock(&work_pool.pass_lock);
+        return;
+    }
+    for (int t = 0; t < n; ++t) {
+        atomic_store(&work_pool.runs[t].next, (int)((long)parts * t / n));
+        work_pool.runs[t].end = (int)((long)parts * (t + 1) / n);
+    }
+    pthread_mutex_lock(&work_pool.lock);
+    work_pool.task = task;
+    work_pool.context = context;
+    work_pool.busy = n - 1;
+    work_pool.pass++;
+    pthread_cond_broadcast(&work_pool.start);
+    pthread_mutex_unlock(&work_pool.lock);
+    poolWork(0);
+    pthread_mutex_lock(&work_pool.lock);
+    while (work_pool.busy > 0)
+        pthread_cond_wait(&work_pool.done, &work_pool.lock);
+    pthread_mutex_unlock(&work_pool.lock);
+    pthread_mutex_unlock(&work_pool.pass_lock);
+}
+
+// Bytes of one chunk, whose records are sized to the schema
+static size_t storeChunkBytes() {
+    return sizeof(StudentChunk) + STORE_CHUNK_SIZE * student_size;
+}
+
+// Record in slot i of a chunk
+static Student *chunkRecord(const StudentChunk *chunk, int i) {
+    return (Student *)(chunk->records + i * student_size);
+}
+
+// New chunk for the store, recycled if a version has given one back
+static StudentChunk *storeNewChunk(StudentStore *store) {
+    StoreVersions *versions = store->versions;
+    if (versions != NULL && versions->num_spare > 0)
+        return versions->spare_chunks[--versions->num_spare]; // Only the writer takes and recycles them
+    return arenaAlloc(&store->arena, storeChunkBytes());
+}
+
+// Copies the part of a record the store keeps. Stored records are shorter than
+// a Student, so they must never be assigned with =.
+void studentCopy(Student *to, const Student *from) {
+    memcpy(to, from, student_size);
+}
+
+int storeAppend(StudentStore *store, const Student *s) {
+    return storeAppendWithHandle(store, s, store->next_handle);
+}
+
+// Appends a record under a given handle, which must not be below next_handle
+int storeAppendWithHandle(StudentStore *store, const Student *s, int handle) {
+    if (store->slots == store->num_chunks * STORE_CHUNK_SIZE) {
+        // Out of room: add a chunk (only the directory is reallocated)
+        if (store->num_chunks == store->chunk_capacity) {
+            int new_capacity = store->chunk_capacity ? store->chunk_capacity * 2 : 16;
+            StudentChunk **chunks = realloc(store->chunks, new_capacity * sizeof(StudentChunk *));
+            int *chunk_live = realloc(store->chunk_live, new_capacity * sizeof(int));
+            if (chunks == NULL || chunk_live == NULL)
+                outOfMemory();
+            store->chunks = chunks;
+            store->chunk_live = chunk_live;
+            store->chunk_capacity = new_capacity;
+        }
+        store->chunk_live[store->num_chunks] = 0;
+        store->chunks[store->num_chunks++] = storeNewChunk(store);
+    }
+    storePositionOf(store, handle); // Rebuilds a stale handle map
+    if (handle >= store->handle_capacity) {
+        int new_capacity = store->handle_capacity ? store->handle_capacity * 2 : STORE_CHUNK_SIZE;
+        while (new_capacity <= handle)
+            new_capacity *= 2;
+        int *positions = realloc(store->handle_positions, new_capacity * sizeof(int));
+        if (positions == NULL)
+            outOfMemory();
+        store->handle_positions = positions;
+        store->handle_capacity = new_capacity;
+    }
+    while (store->next_handle < handle)
+        store->handle_positions[store->next_handle++] = -1; // Handles of deleted records
+    store->next_handle = handle + 1;
+    int pos = store->slots++;
+    store->count++;
+    store->chunk_live[pos / STORE_CHUNK_SIZE]++;
+    StudentChunk *chunk = storeWritableChunk(store, pos / STORE_CHUNK_SIZE);
+    studentCopy(chunkRecord(chunk, pos % STORE_CHUNK_SIZE), s);
+    chunk->handles[pos % STORE_CHUNK_SIZE] = handle;
+    store->handle_positions[handle] = pos;
+    return handle;
+}
+
+static const DiskRecord *storeMappedRecord(const StudentStore *store, int pos) {
+    return (const DiskRecord *)(store->mapped_records + (size_t)pos * disk_record_size);
+}
+
+// Checks that the name of a mapped record lies within one block of the heap and ends where it says
+static void storeCheckMappedName(const StudentStore *store, const Student *s) {
+    uint32_t in_block = s->name_offset & (NAME_BLOCK_SIZE - 1);
+    if (s->name_length >= NAME_SIZE || s->name_offset + (uint64_t)s->name_length >= store->mapped_heap_size
+        || in_block + s->name_length >= NAME_BLOCK_SIZE || strnlen(studentName(s), s->name_length + 1) != s->name_length) {
+        errno = 0;
+        storageFailure(SNAPSHOT_FILE);
+    }
+}
+
+// Handle of a mapped record, checked to be issued and to follow the record before
+// it, as a snapshot holds live records in handle order
+static int storeMappedHandle(const StudentStore *store, int pos) {
+    int handle = storeMappedRecord(store, pos)->handle;
+    if (handle < 0 || handle >= store->next_handle || (pos > 0 && handle <= storeMappedRecord(store, pos - 1)->handle)) {
+        errno = 0;
+        storageFailure(SNAPSHOT_FILE);
+    }
+    return handle;
+}
+
+// Copies the stored fields of a mapped record; the mapped heap is the start of
+// the name arena, so its name offset holds.
+static void storeDecodeMapped(const StudentStore *store, int pos, Student *s) {
+    memcpy(s, storeMappedRecord(store, pos)->student, student_size);
+    storeCheckMappedName(store, s);
+}
+
+// Returns chunk c, first copying it out of the mapped snapshot if needed
+StudentChunk *storeChunk(StudentStore *store, int c) {
+    StudentChunk *chunk = store->chunks[c];
+    if (chunk != NULL)
+        return chunk;
+    chunk = storeNewChunk(store);
+    int first = c * STORE_CHUNK_SIZE;
+    int end = first + STORE_CHUNK_SIZE < store->slots ? first + STORE_CHUNK_SIZE : store->slots;
+    for (int pos = first; pos < end; ++pos) {
+        storeDecodeMapped(store, pos, chunkRecord(chunk, pos - first));
+        chunk->handles[pos - first] = storeMappedHandle(store, pos);
+    }
+    store->chunks[c] = chunk;
+    return chunk;
+}
+
+// Read-only access that decodes mapped records into scratch instead of copying their chunk in
+const Student *storePeek(const StudentStore *store, int pos, Student *scratch) {
+    const StudentChunk *chunk = store->chunks[pos / STORE_CHUNK_SIZE];
+    if (chunk != NULL)
+        return chunkRecord(chunk, pos % STORE_CHUNK_SIZE);
+    storeDecodeMapped(store, pos, scratch);
+    computeStudentScores(scratch);
+    return scratch;
+}
+
+Student *storeAt(StudentStore *store, int pos) {
+    return chunkRecord(storeChunk(store, pos / STORE_CHUNK_SIZE), pos % STORE_CHUNK_SIZE);
+}
+
+int storeHandleAt(StudentStore *store, int pos) {
+    const StudentChunk *chunk = store->chunks[pos / STORE_CHUNK_SIZE];
+    if (chunk == NULL)
+        return storeMappedHandle(store, pos); // Read in place, no copy
+    return chunk->handles[pos % STORE_CHUNK_SIZE];
+}
+
+// Store position of a handle, or -1 if it was never issued or has been removed
+int storePositionOf(StudentStore *store, int handle) {
+    if (store->handle_map_stale) {
+        store->handle_map_stale = 0;
+        free(store->handle_positions);
+        store->handle_capacity = store->next_handle > STORE_CHUNK_SIZE ? store->next_handle : STORE_CHUNK_SIZE;
+        store->handle_positions = malloc(store->handle_capacity * sizeof(int));
+        if (store->handle_positions == NULL)
+            outOfMemory();
+        for (int h = 0; h < store->handle_capacity; ++h) {
+            store->handle_positions[h] = -1;
+        }
+        for (int pos = storeNextLive(store, 0); pos < store->slots; pos = storeNextLive(store, pos + 1)) {
+            store->handle_positions[storeHandleAt(store, pos)] = pos;
+        }
+    }
+    if (handle < 0 || handle >= store->next_handle)
+        return -1;
+    return store->handle_positions[handle];
+}
+
+Student *storeByHandle(StudentStore *store, int handle) {
+    return storeAt(store, storePositionOf(store, handle));
+}
+
+// Leaves a tombstone in the slot; nothing else moves, so deletion is O(1)
+void storeRemove(StudentStore *store, int pos) {
+    StudentChunk *chunk = storeWritableChunk(store, pos / STORE_CHUNK_SIZE);
+    store->handle_positions[chunk->handles[pos % STORE_CHUNK_SIZE]] = -1;
+    chunk->handles[pos % STORE_CHUNK_SIZE] = -1;
+    store->chunk_live[pos / STORE_CHUNK_SIZE]--;
+    store->count--;
+    // Compact once tombstones fill a chunk and make up an eighth of the slots
+    int dead = store->slots - store->count;
+    if (store->compact_read < 0 && dead >= STORE_CHUNK_SIZE && dead >= store->slots / 8) {
+        store->compact_read = 0;
+        store->compact_write = 0;
+    }
+}
+
+// Fills handles with the handle of every live record, in store order; returns how many
+int storeListHandles(StudentStore *store, int *handles) {
+    int count = 0;
+    for (int pos = storeNextLive(store, 0); pos < store->slots; pos = storeNextLive(store, pos + 1)) {
+        handles[count++] = storeHandleAt(store, pos);
+    }
+    return count;
+}
+
+typedef struct {
+    StudentStore *store;
+    StudentChunk **chunks; // Chunks being copied in, NULL for those already in memory
+} StoreLoadJob;
+
+static void storeLoadPart(void *context, int part, int worker) {
+    (void)worker;
+    StoreLoadJob *job = context;
+    StudentStore *store = job->store;
+    int last = (part + 1) * POOL_PART_CHUNKS < store->num_chunks ? (part + 1) * POOL_PART_CHUNKS : store->num_chunks;
+    for (int c = part * POOL_PART_CHUNKS; c < last; ++c) {
+        StudentChunk *chunk = job->chunks[c];
+        if (chunk == NULL)
+            continue;
+        int first = c * STORE_CHUNK_SIZE;
+        int end = first + STORE_CHUNK_SIZE < store->slots ? first + STORE_CHUNK_SIZE : store->slots;
+        for (int pos = first; pos < end; ++pos) {
+            storeDecodeMapped(store, pos, chunkRecord(chunk, pos - first));
+            chunk->handles[pos - first] = storeMappedHandle(store, pos);
+        }
+    }
+}
+
+// Copies every chunk still in the mapped snapshot into memory, in parallel, and
+// rebuilds a stale handle map, after which any thread may read records by handle
+void storeLoadAll(StudentStore *store) {
+    storePositionOf(store, 0);
+    StoreLoadJob job = { store, calloc(store->num_chunks ? store->num_chunks : 1, sizeof(StudentChunk *)) };
+    if (job.chunks == NULL)
+        outOfMemory();
+    int missing = 0;
+    for (int c = 0; c < store->num_chunks; ++c) {
+        if (store->chunks[c] == NULL) {
+            job.chunks[c] = storeNewChunk(store); // The arena is not thread-safe
+            ++missing;
+        }
+    }
+    if (missing > 0) {
+        poolRun((store->num_chunks + POOL_PART_CHUNKS - 1) / POOL_PART_CHUNKS, storeLoadPart, &job);
+        for (int c = 0; c < store->num_chunks; ++c) {
+            if (job.chunks[c] != NULL)
+                store->chunks[c] = job.chunks[c];
+        }
+    }
+    free(job.chunks);
+}
+
+// First live slot at or after pos, or store->slots if there is none
+int storeNextLive(StudentStore *store, int pos) {
+    while (pos < store->slots) {
+        int c = pos / STORE_CHUNK_SIZE;
+        if (store->chunk_live[c] == 0) {
+            pos = (c + 1) * STORE_CHUNK_SIZE; // Skip a chunk of tombstones
+        } else if (storeHandleAt(store, pos) < 0) {
+            ++pos;
+        } else {
+            return pos;
+        }
+    }
+    return store->slots;
+}
+
+// Slot of the live record at the given rank in store order
+int storeSelect(StudentStore *store, int rank) {
+    if (store->slots == store->count)
+        return rank; // No tombstones
+    int c = 0;
+    while (rank >= store->chunk_live[c]) {
+        rank -= store->chunk_live[c++];
+    }
+    int pos = storeNextLive(store, c * STORE_CHUNK_SIZE);
+    while (rank-- > 0) {
+        pos = storeNextLive(store, pos + 1);
+    }
+    return pos;
+}
+
+// Rank in store order of the live record in slot pos
+int storeRankOf(StudentStore *store, int pos) {
+    if (store->slots == store->count)
+        return pos;
+    int rank = 0;
+    int c = pos / STORE_CHUNK_SIZE;
+    for (int i = 0; i < c; ++i) {
+        rank += store->chunk_live[i];
+    }
+    for (int i = c * STORE_CHUNK_SIZE; i < pos; ++i) {
+        rank += storeHandleAt(store, i) >= 0;
+    }
+    return rank;
+}
+
+// Moves live records down over tombstones, examining at most max_chunks chunks
+// of slots. Positions change but handles do not, so it must only run where no
+// store position is being held (e.g. between screens). Returns 1 while work remains.
+int storeCompactStep(StudentStore *store, int max_chunks) {
+    if (store->compact_read < 0)
+        return 0;
+    storePositionOf(store, 0); // Rebuilds a stale handle map
+    int end = store->compact_read + max_chunks * STORE_CHUNK_SIZE;
+    for (int read = store->compact_read; read < end && read < store->slots; ++read) {
+        int handle = storeHandleAt(store, read);
+        if (handle < 0)
+            continue;
+        int write = store->compact_write++;
+        if (write == read)
+            continue;
+        StudentChunk *from = storeWritableChunk(store, read / STORE_CHUNK_SIZE);
+        StudentChunk *to = storeWritableChunk(store, write / STORE_CHUNK_SIZE);
+        studentCopy(chunkRecord(to, write % STORE_CHUNK_SIZE), chunkRecord(from, read % STORE_CHUNK_SIZE));
+        to->handles[write % STORE_CHUNK_SIZE] = handle;
+        from->handles[read % STORE_CHUNK_SIZE] = -1;
+        store->chunk_live[write / STORE_CHUNK_SIZE]++;
+        store->chunk_live[read / STORE_CHUNK_SIZE]--;
+        store->handle_positions[handle] = write;
+    }
+    store->compact_read = end;
+    if (end < store->slots)
+        return 1;
+    // Done: every slot from compact_write on is a tombstone; emptied chunks are kept for reuse
+    store->slots = store->compact_write;
+    store->compact_read = -1;
+    return 0;
+}
+
+// Returns chunk c ready to be written. While readers may pin versions, a chunk
+// the latest version shares is first replaced by a copy, and retired.
+StudentChunk *storeWritableChunk(StudentStore *store, int c) {
+    StudentChunk *chunk = storeChunk(store, c);
+    StoreVersions *versions = store->versions;
+    if (versions == NULL)
+        return chunk;
+    versions->latest_stale = 1;
+    const StoreVersion *latest = versions->latest;
+    if (latest == NULL || c >= latest->num_chunks || latest->chunks[c] != chunk)
+        return chunk;
+    StudentChunk *copy = storeNewChunk(store);
+    memcpy(copy, chunk, storeChunkBytes());
+    store->chunks[c] = copy;
+    pthread_mutex_lock(&versions->lock);
+    if (versions->num_retired == versions->retired_capacity) {
+        int new_capacity = versions->retired_capacity ? versions->retired_capacity * 2 : 16;
+        RetiredChunk *retired = realloc(versions->retired_chunks, new_capacity * sizeof(RetiredChunk));
+        if (retired == NULL)
+            outOfMemory();
+        versions->retired_chunks = retired;
+        versions->retired_capacity = new_capacity;
+    }
+    versions->retired_chunks[versions->num_retired++] = (RetiredChunk){ chunk, versions->epoch };
+    pthread_mutex_unlock(&versions->lock);
+    return copy;
+}
+
+Student *storeWritableAt(StudentStore *store, int pos) {
+    return chunkRecord(storeWritableChunk(store, pos / STORE_CHUNK_SIZE), pos % STORE_CHUNK_SIZE);
+}
+
+void storeAddReader(StudentStore *store, StoreReader *reader) {
+    StoreVersions *versions = store->versions;
+    pthread_mutex_lock(&versions->lock);
+    reader->epoch = 0;
+    reader->next = versions->readers;
+    versions->readers = reader;
+    pthread_mutex_unlock(&versions->lock);
+}
+
+void storeRemoveReader(StudentStore *store, StoreReader *reader) {
+    StoreVersions *versions = store->versions;
+    pthread_mutex_lock(&versions->lock);
+    StoreReader **link = &versions->readers;
+    while (*link != reader)
+        link = &(*link)->next;
+    *link = reader->next;
+    pthread_mutex_unlock(&versions->lock);
+}
+
+// Pins the current version for reader, publishing one if the store has changed
+// since the last. Writers must be held off meanwhile, but other readers need not be;
+// once pinned, the version stays readable without any lock until storeUnpin.
+const StoreVersion *storePin(StudentStore *store, StoreReader *reader) {
+    StoreVersions *versions = store->versions;
+    pthread_mutex_lock(&versions->lock);
+    if (versions->latest == NULL || versions->latest_stale) {
+        StoreVersion *version = malloc(sizeof(StoreVersion) + (store->num_chunks ? store->num_chunks : 1) * sizeof(StudentChunk *));
+        if (version == NULL)
+            outOfMemory();
+        version->scale = *grading_scale;
+        version->chunks = (StudentChunk **)(version + 1);
+        version->num_chunks = store->num_chunks;
+        memcpy(version->chunks, store->chunks, store->num_chunks * sizeof(StudentChunk *));
+        if (versions->latest != NULL) {
+            versions->latest->retired = versions->epoch;
+            versions->latest->next = versions->retired_versions;
+            versions->retired_versions = versions->latest;
+        }
+        versions->latest = version;
+        versions->latest_stale = 0;
+    }
+    reader->epoch = versions->epoch;
+    const StoreVersion *pinned = versions->latest;
+    pthread_mutex_unlock(&versions->lock);
+    return pinned;
+}
+
+void storeUnpin(StudentStore *store, StoreReader *reader) {
+    pthread_mutex_lock(&store->versions->lock);
+    reader->epoch = 0;
+    pthread_mutex_unlock(&store->versions->lock);
+}
+
+// Starts a new epoch once a batch of changes is in place, then recycles the
+// chunks and versions retired before the oldest epoch still pinned
+void storeAdvanceEpoch(StudentStore *store) {
+    StoreVersions *versions = store->versions;
+    pthread_mutex_lock(&versions->lock);
+    long oldest = ++versions->epoch;
+    for (const StoreReader *reader = versions->readers; reader != NULL; reader = reader->next) {
+        if (reader->epoch != 0 && reader->epoch < oldest)
+            oldest = reader->epoch;
+    }
+    int kept = 0;
+    for (int i = 0; i < versions->num_retired; ++i) {
+        RetiredChunk retired = versions->retired_chunks[i];
+        if (retired.epoch >= oldest) {
+            versions->retired_chunks[kept++] = retired;
+            continue;
+        }
+        if (versions->num_spare == versions->spare_capacity) {
+            int new_capacity = versions->spare_capacity ? versions->spare_capacity * 2 : 16;
+            StudentChunk **spare = realloc(versions->spare_chunks, new_capacity * sizeof(StudentChunk *));
+            if (spare == NULL)
+                outOfMemory();
+            versions->spare_chunks = spare;
+            versions->spare_capacity = new_capacity;
+        }
+        versions->spare_chunks[versions->num_spare++] = retired.chunk;
+    }
+    versions->num_retired = kept;
+    StoreVersion **link = &versions->retired_versions;
+    while (*link != NULL) {
+        StoreVersion *version = *link;
+        if (version->retired < oldest) {
+            *link = version->next;
+            free(version);
+        } else {
+            link = &version->next;
+        }
+    }
+    pthread_mutex_unlock(&versions->lock);
+}
+
+// Read-only access to a record of a pinned version, like storePeek
+const Student *versionPeek(const StudentStore *store, const StoreVersion *version, int pos, Student *scratch) {
+    const StudentChunk *chunk = version->chunks[pos / STORE_CHUNK_SIZE];
+    if (chunk != NULL)
+        return chunkRecord(chunk, pos % STORE_CHUNK_SIZE);
+    storeDecodeMapped(store, pos, scratch);
+    computeStudentScores(scratch);
+    return scratch;
+}
+
+// Orders two records by field, breaking ties by handle (registration order)
+int compareHandles(SortField field, int a, int b) {
+    const Student *sa = storeByHandle(&student_store, a);
+    const Student *sb = storeByHandle(&student_store, b);
+    int cmp;
+    if (field == SORT_BY_NAME)
+        cmp = strcmp(studentName(sa), studentName(sb));
+    else if (field == SORT_BY_NUMBER)
+        cmp = (sa->student_number > sb->student_number) - (sa->student_number < sb->student_number);
+    else if (field == SORT_BY_TOTAL_SCORE)
+        cmp = (sa->total_score > sb->total_score) - (sa->total_score < sb->total_score);
+    else {
+        int ga = sa->grades[field - SORT_BY_SUBJECT];
+        int gb = sb->grades[field - SORT_BY_SUBJECT];
+        cmp = (ga > gb) - (ga < gb);
+    }
+    if (cmp == 0)
+        cmp = (a > b) - (a < b);
+    return cmp;
+}
+
+static int indexHeight(const SortIndex *index, int n) {
+    return n < 0 ? 0 : index->nodes[n].height;
+}
+
+static int indexSize(const SortIndex *index, int n) {
+    return n < 0 ? 0 : index->nodes[n].size;
+}
+
+static void indexUpdateNode(SortIndex *index, int n) {
+    IndexNode *node = &index->nodes[n];
+    int lh = indexHeight(index, node->left);
+    int rh = indexHeight(index, node->right);
+    node->height = (lh > rh ? lh : rh) + 1;
+    node->size = indexSize(index, node->left) + indexSize(index, node->right) + 1;
+}
+
+static int indexRotateRight(SortIndex *index, int n) {
+    int l = index->nodes[n].left;
+    index->nodes[n].left = index->nodes[l].right;
+    index->nodes[l].right = n;
+    indexUpdateNode(index, n);
+    indexUpdateNode(index, l);
+    return l;
+}
+
+static int indexRotateLeft(SortIndex *index, int n) {
+    int r = index->nodes[n].right;
+    index->nodes[n].right = index->nodes[r].left;
+    index->nodes[r].left = n;
+    indexUpdateNode(index, n);
+    indexUpdateNode(index, r);
+    return r;
+}
+
+static int indexRebalance(SortIndex *index, int n) {
+    indexUpdateNode(index, n);
+    IndexNode *node = &index->nodes[n];
+    int balance = indexHeight(index, node->left) - indexHeight(index, node->right);
+    if (balance > 1) {
+        if (indexHeight(index, index->nodes[node->left].left) < indexHeight(index, index->nodes[node->left].right))
+            node->left = indexRotateLeft(index, node->left);
+        return indexRotateRight(index, n);
+    }
+    if (balance < -1) {
+        if (indexHeight(index, index->nodes[node->right].right) < indexHeight(index, index->nodes[node->right].left))
+            node->right = indexRotateRight(index, node->right);
+        return indexRotateLeft(index, n);
+    }
+    return n;
+}
+
+static int indexInsertAt(SortIndex *index, int n, int handle) {
+    if (n < 0) {
+        IndexNode *node = &index->nodes[handle];
+        node->left = node->right = -1;
+        node->height = node->size = 1;
+        return handle;
+    }
+    if (compareHandles(index->field, handle, n) < 0)
+        index->nodes[n].left = indexInsertAt(index, index->nodes[n].left, handle);
+    else
+        index->nodes[n].right = indexInsertAt(index, index->nodes[n].right, handle);
+    return indexRebalance(index, n);
+}
+
+static int indexRemoveMin(SortIndex *index, int n, int *min) {
+    if (index->nodes[n].left < 0) {
+        *min = n;
+        return index->nodes[n].right;
+    }
+    index->nodes[n].left = indexRemoveMin(index, index->nodes[n].left, min);
+    return indexRebalance(index, n);
+}
+
+static int indexRemoveAt(SortIndex *index, int n, int handle) {
+    if (n < 0)
+        return -1;
+    int cmp = compareHandles(index->field, handle, n);
+    if (cmp < 0) {
+        index->nodes[n].left = indexRemoveAt(index, index->nodes[n].left, handle);
+    } else if (cmp > 0) {
+        index->nodes[n].right = indexRemoveAt(index, index->nodes[n].right, handle);
+    } else {
+        int left = index->nodes[n].left;
+        int right = index->nodes[n].right;
+        if (left < 0)
+            return right;
+        if (right < 0)
+            return left;
+        // Replace the node with its in-order successor
+        int min;
+        right = indexRemoveMin(index, right, &min);
+        index->nodes[min].left = left;
+        index->nodes[min].right = right;
+        return indexRebalance(index, min);
+    }
+    return indexRebalance(index, n);
+}
+
+static void indexReserve(SortIndex *index, int handle) {
+    if (handle >= index->capacity) {
+        int new_capacity = index->capacity ? index->capacity * 2 : STORE_CHUNK_SIZE;
+        while (new_capacity <= handle)
+            new_capacity *= 2;
+        IndexNode *nodes = realloc(index->nodes, new_capacity * sizeof(IndexNode));
+        if (nodes == NULL)
+            outOfMemory();
+        index->nodes = nodes;
+        index->capacity = new_capacity;
+    }
+}
+
+void indexInsert(SortIndex *index, int handle) {
+    indexReserve(index, handle);
+    index->root = indexInsertAt(index, index->root, handle);
+}
+
+static int indexBuildRange(SortIndex *index, const int *sorted, int lo, int hi) {
+    if (lo >= hi)
+        return -1;
+    int mid = lo + (hi - lo) / 2;
+    int n = sorted[mid];
+    index->nodes[n].left = indexBuildRange(index, sorted, lo, mid);
+    index->nodes[n].right = indexBuildRange(index, sorted, mid + 1, hi);
+    indexUpdateNode(index, n);
+    return n;
+}
+
+// Replaces the tree with a perfectly balanced one over handles already in index order
+void indexBuild(SortIndex *index, const int *sorted, int count) {
+    for (int i = 0; i < count; ++i) {
+        indexReserve(index, sorted[i]);
+    }
+    index->root = indexBuildRange(index, sorted, 0, count);
+}
+
+// Must be called while the record still holds the values it was indexed under
+void indexRemove(SortIndex *index, int handle) {
+    index->root = indexRemoveAt(index, index->root, handle);
+}
+
+// Handle of the record at the given rank (0-based, ascending), or -1
+int indexSelect(const SortIndex *index, int rank) {
+    int n = index->root;
+    while (n >= 0) {
+        int left_size = indexSize(index, index->nodes[n].left);
+        if (rank < left_size) {
+            n = index->nodes[n].left;
+        } else if (rank == left_size) {
+            return n;
+        } else {
+            rank -= left_size + 1;
+            n = index->nodes[n].right;
+        }
+    }
+    return -1;
+}
+
+// Ascending rank of an indexed handle, found by descending with compareHandles
+int indexRank(const SortIndex *index, int handle) {
+    int rank = 0;
+    int n = index->root;
+    while (n >= 0) {
+        int cmp = compareHandles(index->field, handle, n);
+        if (cmp < 0) {
+            n = index->nodes[n].left;
+        } else {
+            rank += indexSize(index, index->nodes[n].left);
+            if (cmp == 0)
+                return rank;
+            rank += 1;
+            n = index->nodes[n].right;
+        }
+    }
+    return -1;
+}
+
+// Fills handles with every indexed handle in order, descending when order < 0
+void indexList(const SortIndex *index, int order, int *handles) {
+    int stack[INDEX_MAX_DEPTH];
+    int depth = 0;
+    int count = 0;
+    int n = index->root;
+    while (n >= 0 || depth > 0) {
+        while (n >= 0) {
+            stack[depth++] = n;
+            n = order > 0 ? index->nodes[n].left : index->nodes[n].right;
+        }
+        n = stack[--depth];
+        handles[count++] = n;
+        n = order > 0 ? index->nodes[n].right : index->nodes[n].left;
+    }
+}
+
+// Slot for a key in a table of 2^(32 - shift) slots. Fibonacci hashing: the top
+// bits of the product depend on every bit of the key, so keys that differ only in
+// their high bits (numbers a power of two apart) still spread across the table.
+static unsigned fibonacciHash(uint32_t key, int shift) {
+    return (key * 2654435769u) >> shift;
+}
+
+// log2 of a power of two
+static int log2Capacity(unsigned capacity) {
+    int bits = 0;
+    while ((1u << bits) < capacity)
+        ++bits;
+    return bits;
+}
+
+static unsigned numberHash(int student_number, const NumberIndex *index) {
+    return fibonacciHash((uint32_t)student_number, index->shift);
+}
+
+// Handle registered under student_number, or -1
+int numberIndexFind(const NumberIndex *index, int student_number) {
+    if (index->count == 0)
+        return -1;
+    unsigned mask = index->capacity - 1;
+    for (unsigned i = numberHash(student_number, index); ; i = (i + 1) & mask) {
+        const NumberSlot *slot = &index->slots[i];
+        if (slot->handle < 0)
+            return -1;
+        if (slot->student_number == student_number)
+            return slot->handle;
+    }
+}
+
+static void numberIndexPut(NumberIndex *index, int student_number, int handle) {
+    unsigned mask = index->capacity - 1;
+    unsigned i = numberHash(student_number, index);
+    while (index->slots[i].handle >= 0)
+        i = (i + 1) & mask;
+    index->slots[i].student_number = student_number;
+    index->slots[i].handle = handle;
+}
+
+// Caller guarantees student_number is not already present
+void numberIndexInsert(NumberIndex *index, int student_number, int handle) {
+    if ((index->count + 1) * 2 > index->capacity) {
+        NumberSlot *old_slots = index->slots;
+        int old_capacity = index->capacity;
+        index->capacity = old_capacity ? old_capacity * 2 : HASH_MIN_CAPACITY;
+        index->shift = 32 - log2Capacity(index->capacity);
+        index->slots = malloc(index->capacity * sizeof(NumberSlot));
+        if (index->slots == NULL)
+            outOfMemory();
+        for (int i = 0; i < index->capacity; ++i) {
+            index->slots[i].handle = -1;
+        }
+        for (int i = 0; i < old_capacity; ++i) {
+            if (old_slots[i].handle >= 0)
+                numberIndexPut(index, old_slots[i].student_number, old_slots[i].handle);
+        }
+        free(old_slots);
+    }
+    numberIndexPut(index, student_number, handle);
+    index->count++;
+}
+
+void numberIndexRemove(NumberIndex *index, int student_number) {
+    if (index->count == 0)
+        return;
+    unsigned mask = index->capacity - 1;
+    unsigned i = numberHash(student_number, index);
+    while (index->slots[i].student_number != student_number || index->slots[i].handle < 0) {
+        if (index->slots[i].handle < 0)
+            return;
+        i = (i + 1) & mask;
+    }
+    // Backward-shift deletion: pull later entries of the probe run into the gap
+    unsigned gap = i;
+    for (unsigned j = (gap + 1) & mask; index->slots[j].handle >= 0; j = (j + 1) & mask) {
+        unsigned home = numberHash(index->slots[j].student_number, index);
+        if (((j - home) & mask) >= ((j - gap) & mask)) {
+            index->slots[gap] = index->slots[j];
+            gap = j;
+        }
+    }
+    index->slots[gap].handle = -1;
+    index->count--;
+}
+
+void handleListPush(HandleList *list, int handle) {
+    if (list->count == list->capacity) {
+        int new_capacity = list->capacity ? list->capacity * 2 : 16;
+        int *handles = realloc(list->handles, new_capacity * sizeof(int));
+        if (handles == NULL)
+            outOfMemory();
+        list->handles = handles;
+        list->capacity = new_capacity;
+    }
+    list->handles[list->count++] = handle;
+}
+
+// Distinct lower-cased trigrams of text, sorted; returns how many were written
+static int nameGrams(const char *text, uint32_t *grams) {
+    int len = strlen(text);
+    int n = 0;
+    for (int i = 0; i + 2 < len; ++i) {
+        uint32_t gram = (uint32_t)tolower((unsigned char)text[i]) << 16
+                      | (uint32_t)tolower((unsigned char)text[i + 1]) << 8
+                      | (uint32_t)tolower((unsigned char)text[i + 2]);
+        // Insertion sort; a name has at most NAME_SIZE - 3 trigrams
+        int j = n++;
+        while (j > 0 && grams[j - 1] > gram) {
+            grams[j] = grams[j - 1];
+            --j;
+        }
+        grams[j] = gram;
+    }
+    int distinct = 0;
+    for (int i = 0; i < n; ++i) {
+        if (distinct == 0 || grams[distinct - 1] != grams[i])
+            grams[distinct++] = grams[i];
+    }
+    return distinct;
+}
+
+static GramSlot *gramIndexFind(const GramIndex *index, uint32_t gram) {
+    if (index->count == 0)
+        return NULL;
+    unsigned mask = index->capacity - 1;
+    for (unsigned i = fibonacciHash(gram, index->shift); index->slots[i].gram != 0; i = (i + 1) & mask) {
+        if (index->slots[i].gram == gram)
+            return &index->slots[i];
+    }
+    return NULL;
+}
+
+static GramSlot *gramIndexSlot(GramIndex *index, uint32_t gram) {
+    GramSlot *slot = gramIndexFind(index, gram);
+    if (slot != NULL)
+        return slot;
+    if ((index->count + 1) * 2 > index->capacity) {
+        GramSlot *old_slots = index->slots;
+        int old_capacity = index->capacity;
+        index->capacity = old_capacity ? old_capacity * 2 : GRAM_MIN_CAPACITY;
+        index->shift = 32 - log2Capacity(index->capacity);
+        index->slots = calloc(index->capacity, sizeof(GramSlot));
+        if (index->slots == NULL)
+            outOfMemory();
+        unsigned mask = index->capacity - 1;
+        for (int i = 0; i < old_capacity; ++i) {
+            if (old_slots[i].gram == 0)
+                continue;
+            unsigned j = fibonacciHash(old_slots[i].gram, index->shift);
+            while (index->slots[j].gram != 0)
+                j = (j + 1) & mask;
+            index->slots[j] = old_slots[i];
+        }
+        free(old_slots);
+    }
+    // Trigrams are never removed from the table, only emptied
+    unsigned mask = index->capacity - 1;
+    unsigned i = fibonacciHash(gram, index->shift);
+    while (index->slots[i].gram != 0)
+        i = (i + 1) & mask;
+    index->slots[i].gram = gram;
+    index->count++;
+    return &index->slots[i];
+}
+
+// First position in a sorted handle list holding a handle >= handle
+static int postingLowerBound(const HandleList *posting, int handle) {
+    int lo = 0, hi = posting->count;
+    while (lo < hi) {
+        int mid = (lo + hi) / 2;
+        if (posting->handles[mid] < handle)
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+    return lo;
+}
+
+void gramIndexAdd(GramIndex *index, const char *name, int handle) {
+    uint32_t grams[NAME_SIZE];
+    int n = nameGrams(name, grams);
+    for (int i = 0; i < n; ++i) {
+        HandleList *posting = &gramIndexSlot(index, grams[i])->posting;
+        // New registrations have the largest handle, so this is usually an append
+        handleListPush(posting, handle);
+        if (posting->count < 2 || posting->handles[posting->count - 2] < handle)
+            continue;
+        int at = postingLowerBound(posting, handle);
+        if (at < posting->count - 1) {
+            memmove(&posting->handles[at + 1], &posting->handles[at], (posting->count - 1 - at) * sizeof(int));
+            posting->handles[at] = handle;
+        }
+    }
+}
+
+void gramIndexRemove(GramIndex *index, const char *name, int handle) {
+    uint32_t grams[NAME_SIZE];
+    int n = nameGrams(name, grams);
+    for (int i = 0; i < n; ++i) {
+        GramSlot *slot = gramIndexFind(index, grams[i]);
+        if (slot == NULL)
+            continue;
+        HandleList *posting = &slot->posting;
+        int at = postingLowerBound(posting, handle);
+        if (at < posting->count && posting->handles[at] == handle) {
+            memmove(&posting->handles[at], &posting->handles[at + 1], (posting->count - 1 - at) * sizeof(int));
+            posting->count--;
+        }
+    }
+}
+
+static int containsIgnoreCase(const char *text, const char *query) {
+    size_t len = strlen(query);
+    for (; *text != '\0'; ++text) {
+        size_t i = 0;
+        while (i < len && text[i] != '\0' && tolower((unsigned char)text[i]) == tolower((unsigned char)query[i]))
+            ++i;
+        if (i == len)
+            return 1;
+    }
+    return len == 0;
+}
+
+static int comparePostingSizes(const void *a, const void *b) {
+    int x = (*(const HandleList * const *)a)->count, y = (*(const HandleList * const *)b)->count;
+    return (x > y) - (x < y);
+}
+
+// A scan for names containing a query, over store chunks or over the candidates
+// from the trigram postings. Parts collect their matches separately, and are
+// appended in order, so the result does not depend on how the parts ran.
+typedef struct {
+    const char *query;
+    size_t len;
+    const HandleList **postings; // Shortest first; NULL to scan the store
+    int num_postings;
+    HandleList *found; // One list per part
+} NameScanJob;
+
+static int nameScanMatches(const NameScanJob *job, const Student *s) {
+    if (s->name_length < job->len)
+        return 0; // Too short to contain the query, decided without reading the name
+    const char *name = studentName(s);
+    return strncmp(name, job->query, job->len) != 0 && containsIgnoreCase(name, job->query);
+}
+
+static void nameScanPart(void *context, int part, int worker) {
+    (void)worker;
+    NameScanJob *job = context;
+    HandleList *found = &job->found[part];
+    Student scratch;
+    if (job->postings == NULL) {
+        int first = part * POOL_PART_CHUNKS * STORE_CHUNK_SIZE;
+        int end = first + POOL_PART_CHUNKS * STORE_CHUNK_SIZE < student_store.slots ? first + POOL_PART_CHUNKS * STORE_CHUNK_SIZE : student_store.slots;
+        for (int i = storeNextLive(&student_store, first); i < end; i = storeNextLive(&student_store, i + 1)) {
+            if (nameScanMatches(job, storePeek(&student_store, i, &scratch)))
+                handleListPush(found, storeHandleAt(&student_store, i));
+        }
+        return;
+    }
+    const HandleList *shortest = job->postings[0];
+    int end = (part + 1) * POOL_PART_ITEMS < shortest->count ? (part + 1) * POOL_PART_ITEMS : shortest->count;
+    for (int i = part * POOL_PART_ITEMS; i < end; ++i) {
+        int handle = shortest->handles[i];
+        int in_all = 1;
+        for (int g = 1; g < job->num_postings && in_all; ++g) {
+            int at = postingLowerBound(job->postings[g], handle);
+            in_all = at < job->postings[g]->count && job->postings[g]->handles[at] == handle;
+        }
+        if (in_all && nameScanMatches(job, storePeek(&student_store, storePositionOf(&student_store, handle), &scratch)))
+            handleListPush(found, handle);
+    }
+}
+
+static void nameScan(NameScanJob *job, HandleList *out) {
+    int parts = job->postings == NULL ? (student_store.num_chunks + POOL_PART_CHUNKS - 1) / POOL_PART_CHUNKS
+              : (job->postings[0]->count + POOL_PART_ITEMS - 1) / POOL_PART_ITEMS;
+    job->found = calloc(parts ? parts : 1, sizeof(HandleList));
+    if (job->found == NULL)
+        outOfMemory();
+    storePositionOf(&student_store, 0); // Rebuilds a stale handle map before the parts read it
+    poolRun(parts, nameScanPart, job);
+    for (int p = 0; p < parts; ++p) {
+        for (int i = 0; i < job->found[p].count; ++i) {
+            handleListPush(out, job->found[p].handles[i]);
+        }
+        free(job->found[p].handles);
+    }
+    free(job->found);
+}
+
+// Appends handles of names starting with query (exact case, in name order), then
+// of other names containing it ignoring case (in registration order)
+void searchNames(const char *query, HandleList *out) {
+    size_t len = strlen(query);
+    if (len == 0)
+        return;
+    rosterEnsureIndexes();
+
+    // Prefix matches: lower bound in the name index, then walk forward
+    const SortIndex *names = &sort_indexes[SORT_BY_NAME];
+    int rank = 0;
+    for (int n = names->root; n >= 0; ) {
+        if (strcmp(studentName(storeByHandle(&student_store, n)), query) < 0) {
+            rank += indexSize(names, names->nodes[n].left) + 1;
+            n = names->nodes[n].right;
+        } else {
+            n = names->nodes[n].left;
+        }
+    }
+    for (; rank < student_store.count; ++rank) {
+        int handle = indexSelect(names, rank);
+        if (strncmp(studentName(storeByHandle(&student_store, handle)), query, len) != 0)
+            break;
+        handleListPush(out, handle);
+    }
+
+    // Substring matches
+    uint32_t grams[NAME_SIZE];
+    if (len >= sizeof(grams))
+        return; // Longer than any stored name
+    int num_grams = nameGrams(query, grams);
+    NameScanJob job = { query, len, NULL, num_grams, NULL };
+    if (num_grams == 0) {
+        // Queries under three bytes have no trigram, so scan the store
+        nameScan(&job, out);
+        return;
+    }
+    // Intersect postings, shortest first, then verify candidates
+    const HandleList *postings[sizeof(grams) / sizeof(grams[0])];
+    for (int g = 0; g < num_grams; ++g) {
+        GramSlot *slot = gramIndexFind(&gram_index, grams[g]);
+        if (slot == NULL || slot->posting.count == 0)
+            return;
+        postings[g] = &slot->posting;
+    }
+    qsort(postings, num_grams, sizeof(postings[0]), comparePostingSizes);
+    job.postings = postings;
+    nameScan(&job, out);
+}
+
+// Levenshtein distance from the pattern (given as per-byte match masks) to
+// FUZZY_LANES names at once, using the Myers/Hyyro bit-parallel recurrence.
+// Lanes advance in lockstep with branch-free updates so the loop vectorizes;
+// a lane stops changing once its name is exhausted.
+static void fuzzyDistanceBatch(const uint64_t peq[256], int m, unsigned char names[][NAME_SIZE],
+                               const int lens[FUZZY_LANES], int dist[FUZZY_LANES]) {
+    uint64_t vp[FUZZY_LANES], vn[FUZZY_LANES];
+    int score[FUZZY_LANES];
+    int max_len = 0;
+    for (int l = 0; l < FUZZY_LANES; ++l) {
+        vp[l] = ~(uint64_t)0;
+        vn[l] = 0;
+        score[l] = m;
+        if (lens[l] > max_len)
+            max_len = lens[l];
+    }
+    const int top = m - 1;
+    for (int j = 0; j < max_len; ++j) {
+        for (int l = 0; l < FUZZY_LANES; ++l) {
+            uint64_t active = -(uint64_t)(j < lens[l]);
+            uint64_t eq = peq[names[l][j]];
+            uint64_t x = eq | vn[l];
+            uint64_t d0 = (((eq & vp[l]) + vp[l]) ^ vp[l]) | x;
+            uint64_t hn = vp[l] & d0;
+            uint64_t hp = vn[l] | ~(vp[l] | d0);
+            // Shift in a 1: the first row of the DP table counts insertions
+            uint64_t hx = (hp << 1) | 1;
+            uint64_t new_vn = hx & d0;
+            uint64_t new_vp = (hn << 1) | ~(hx | d0);
+            int delta = (int)((hp >> top) & 1) - (int)((hn >> top) & 1);
+            score[l] += delta & (int)active;
+            vp[l] = (new_vp & active) | (vp[l] & ~active);
+            vn[l] = (new_vn & active) | (vn[l] & ~active);
+        }
+    }
+    for (int l = 0; l < FUZZY_LANES; ++l) {
+        dist[l] = score[l];
+    }
+}
+
+typedef struct {
+    int dist;
+    int order; // Store position at scoring time, breaks ties
+    int handle;
+} FuzzyMatch;
+
+// Max-heap on (dist, order): the root is the worst of the current top k
+static int fuzzyWorse(const FuzzyMatch *a, const FuzzyMatch *b) {
+    return a->dist != b->dist ? a->dist > b->dist : a->order > b->order;
+}
+
+static void fuzzyHeapOffer(FuzzyMatch *heap, int *size, int k, FuzzyMatch match) {
+    int i;
+    if (*size < k) {
+        i = (*size)++;
+        while (i > 0 && fuzzyWorse(&match, &heap[(i - 1) / 2])) {
+            heap[i] = heap[(i - 1) / 2];
+            i = (i - 1) / 2;
+        }
+        heap[i] = match;
+        return;
+    }
+    if (!fuzzyWorse(&heap[0], &match))
+        return;
+    // Replace the root and sift down
+    i = 0;
+    while (1) {
+        int child = 2 * i + 1;
+        if (child >= *size)
+            break;
+        if (child + 1 < *size && fuzzyWorse(&heap[child + 1], &heap[child]))
+            child++;
+        if (!fuzzyWorse(&heap[child], &match))
+            break;
+        heap[i] = heap[child];
+        i = child;
+    }
+    heap[i] = match;
+}
+
+static int compareFuzzyMatches(const void *a, const void *b) {
+    return fuzzyWorse(a, b) - fuzzyWorse(b, a);
+}
+
+// Appends the k names closest to query by edit distance (ignoring case), closest first
+// Scores names part by part, each part keeping its own k best; the parts' heaps
+// are then merged, and ties broken by store position, as in a single pass
+typedef struct {
+    uint64_t peq[256];
+    int m;
+    int k;
+    FuzzyMatch *heaps; // k slots per part
+    int *heap_sizes;
+} FuzzyJob;
+
+static void fuzzyScanPart(void *context, int part, int worker) {
+    (void)worker;
+    FuzzyJob *job = context;
+    FuzzyMatch *heap = job->heaps + (size_t)part * job->k;
+    int heap_size = 0, k = job->k, m = job->m;
+    int first = part * POOL_PART_CHUNKS * STORE_CHUNK_SIZE;
+    int end = first + POOL_PART_CHUNKS * STORE_CHUNK_SIZE < student_store.slots ? first + POOL_PART_CHUNKS * STORE_CHUNK_SIZE : student_store.slots;
+    Student scratch;
+    unsigned char names[FUZZY_LANES][NAME_SIZE];
+    int lens[FUZZY_LANES], positions[FUZZY_LANES], dist[FUZZY_LANES];
+    int batch = 0;
+    for (int pos = storeNextLive(&student_store, first); ; pos = storeNextLive(&student_store, pos + 1)) {
+        if (pos < end) {
+            const Student *s = storePeek(&student_store, pos, &scratch);
+            const char *name = studentName(s);
+            int len = s->name_length;
+            // The length difference bounds the distance; skip names that cannot make the cut
+            int bound = len > m ? len - m : m - len;
+            if (heap_size == k && bound >= heap[0].dist)
+                continue;
+            memset(names[batch], 0, NAME_SIZE);
+            for (int i = 0; i < len; ++i) {
+                names[batch][i] = tolower((unsigned char)name[i]);
+            }
+            lens[batch] = len;
+            positions[batch] = pos;
+            if (++batch < FUZZY_LANES)
+                continue;
+        } else if (batch == 0) {
+            break;
+        }
+        // Score a full batch, or the final partial one
+        for (int l = batch; l < FUZZY_LANES; ++l) {
+            lens[l] = 0;
+        }
+        fuzzyDistanceBatch(job->peq, m, names, lens, dist);
+        for (int l = 0; l < batch; ++l) {
+            FuzzyMatch match = { dist[l], positions[l], storeHandleAt(&student_store, positions[l]) };
+            fuzzyHeapOffer(heap, &heap_size, k, match);
+        }
+        batch = 0;
+        if (pos >= end)
+            break;
+    }
+    job->heap_sizes[part] = heap_size;
+}
+
+void fuzzySearchNames(const char *query, int k, HandleList *out) {
+    // The pattern is one bit per byte of a 64-bit mask; names are shorter than that
+    // anyway, so a longer query is matched on its first 64 bytes
+    int m = strnlen(query, 64);
+    if (m == 0 || k <= 0 || student_store.count == 0)
+        return;
+    FuzzyJob job;
+    memset(job.peq, 0, sizeof(job.peq));
+    for (int i = 0; i < m; ++i) {
+        job.peq[tolower((unsigned char)query[i])] |= (uint64_t)1 << i;
+    }
+    job.m = m;
+    job.k = k;
+    int parts = (student_store.num_chunks + POOL_PART_CHUNKS - 1) / POOL_PART_CHUNKS;
+    job.heaps = malloc((size_t)parts * k * sizeof(FuzzyMatch));
+    job.heap_sizes = malloc(parts * sizeof(int));
+    FuzzyMatch *heap = malloc(k * sizeof(FuzzyMatch));
+    if (job.heaps == NULL || job.heap_sizes == NULL || heap == NULL)
+        outOfMemory();
+    poolRun(parts, fuzzyScanPart, &job);
+
+    int heap_size = 0;
+    for (int p = 0; p < parts; ++p) {
+        for (int i = 0; i < job.heap_sizes[p]; ++i) {
+            fuzzyHeapOffer(heap, &heap_size, k, job.heaps[(size_t)p * k + i]);
+        }
+    }
+    qsort(heap, heap_size, sizeof(FuzzyMatch), compareFuzzyMatches);
+    for (int i = 0; i < heap_size; ++i) {
+        handleListPush(out, heap[i].handle);
+    }
+    free(heap);
+    free(job.heaps);
+    free(job.heap_sizes);
+}
+
+// Index of the subject with this name, or -1
+static int findSubject(const char *name) {
+    for (int i = 0; i < num_subjects; ++i) {
+        if (strcmp(name, subject_names[i]) == 0)
+            return i;
+    }
+    return -1;
+}
+
+// Filters such as: Math < 60 and (total >= 350 or any = F)
+//   filter      := conjunction ("or" conjunction)...
+//   conjunction := unary ("and" unary)...
+//   unary       := "not" unary | "(" filter ")" | FIELD OP VALUE
+// A FIELD is a subject, total, average, number, name, any (some subject) or all
+// (every subject). OP is <, <=, >, >=, =, != or, for names only, ~ (contains,
+// ignoring case). Subjects compare with a score or with a letter grade, where a
+// better grade is greater. Keywords ignore case; words with spaces are quoted.
+enum {
+    FILTER_END,
+    FILTER_WORD,
+    FILTER_QUOTED,
+    FILTER_OPERATOR,
+    FILTER_OPEN,
+    FILTER_CLOSE
+};
+
+typedef struct {
+    const char *cursor;
+    int kind; // Of the current token
+    char token[NAME_SIZE];
+    int depth; // Nesting of the unary being parsed
+    FilterProgram *program;
+    const char *error; // The first error, which ends the parse
+} FilterParser;
+
+// Moves to the next token. Quoted words use "" for a quote, as commands do.
+static void filterNext(FilterParser *parser) {
+    const char *p = parser->cursor;
+    size_t length = 0;
+    while (isspace((unsigned char)*p)) {
+        ++p;
+    }
+    if (*p == '\0') {
+        parser->kind = FILTER_END;
+    } else if (*p == '(' || *p == ')') {
+        parser->kind = *p++ == '(' ? FILTER_OPEN : FILTER_CLOSE;
+    } else if (strchr("<>=!~", *p) != NULL) {
+        parser->kind = FILTER_OPERATOR;
+        parser->token[length++] = *p++;
+        if (*p == '=')
+            parser->token[length++] = *p++;
+    } else {
+        int quoted = *p == '"';
+        parser->kind = quoted ? FILTER_QUOTED : FILTER_WORD;
+        for (p += quoted; quoted ? *p != '"' || p[1] == '"' : *p != '\0' && !isspace((unsigned char)*p) && strchr("()<>=!~\"", *p) == NULL; ++p) {
+            if (*p == '\0') {
+                parser->error = "unbalanced quotes";
+                break;
+            }
+            p += *p == '"'; // The first of ""
+            if (length == sizeof(parser->token) - 1) {
+                parser->error = "a word of the filter is too long";
+                break;
+            }
+            parser->token[length++] = *p;
+        }
+        p += quoted && *p == '"';
+    }
+    parser->token[length] = '\0';
+    parser->cursor = p;
+}
+
+static int filterKeyword(const FilterParser *parser, const char *keyword) {
+    return parser->kind == FILTER_WORD && strcasecmp(parser->token, keyword) == 0;
+}
+
+static void filterEmit(FilterParser *parser, const FilterOp *op) {
+    if (parser->program->num_ops == FILTER_MAX_OPS)
+        parser->error = "the filter has too many tests";
+    else
+        parser->program->ops[parser->program->num_ops++] = *op;
+}
+
+// Grade code of a letter grade such as "B+", or -1
+static int filterLetter(const char *word) {
+    if (!isupper((unsigned char)word[0]))
+        return -1;
+    if (word[1] == '\0')
+        return (word[0] - 'A') * 3 + 1;
+    if ((word[1] == '+' || word[1] == '-') && word[2] == '\0')
+        return (word[0] - 'A') * 3 + (word[1] == '+' ? 0 : 2);
+    return -1;
+}
+
+static void filterParseTest(FilterParser *parser) {
+    FilterOp op;
+    memset(&op, 0, sizeof(op));
+    if (parser->kind != FILTER_WORD && parser->kind != FILTER_QUOTED) {
+        parser->error = "expected a test such as Math < 60";
+        return;
+    }
+    if (filterKeyword(parser, "total") || filterKeyword(parser, "total_score")) {
+        op.code = FILTER_TOTAL;
+    } else if (filterKeyword(parser, "average")) {
+        op.code = FILTER_AVERAGE;
+    } else if (filterKeyword(parser, "number") || filterKeyword(parser, "student_number")) {
+        op.code = FILTER_NUMBER;
+    } else if (filterKeyword(parser, "name")) {
+        op.code = FILTER_NAME;
+    } else if (filterKeyword(parser, "any") || filterKeyword(parser, "all")) {
+        op.code = FILTER_GRADE;
+        op.subject = filterKeyword(parser, "any") ? FILTER_ANY : FILTER_ALL;
+    } else if ((op.subject = findSubject(parser->token)) >= 0) {
+        op.code = FILTER_GRADE;
+    } else {
+        parser->error = "tests start with a subject, total, average, number, name, any or all";
+        return;
+    }
+    filterNext(parser);
+    static const char *operators[] = { "<", "<=", ">", ">=", "=", "!=", "~" };
+    int compare = 0;
+    while (compare < 7 && (parser->kind != FILTER_OPERATOR || strcmp(parser->token, operators[compare]) != 0)) {
+        ++compare;
+    }
+    if (parser->kind == FILTER_OPERATOR && strcmp(parser->token, "==") == 0)
+        compare = FILTER_EQUAL;
+    if (compare == 7) {
+        parser->error = "expected <, <=, >, >=, =, != or ~ after the field";
+        return;
+    }
+    op.compare = compare;
+    if (op.code == FILTER_NAME && compare != FILTER_EQUAL && compare != FILTER_NOT_EQUAL && compare != FILTER_CONTAINS) {
+        parser->error = "names compare with =, != or ~";
+        return;
+    }
+    if (op.code != FILTER_NAME && compare == FILTER_CONTAINS) {
+        parser->error = "only names compare with ~";
+        return;
+    }
+    filterNext(parser);
+    if (parser->error != NULL)
+        return;
+    if (parser->kind != FILTER_WORD && parser->kind != FILTER_QUOTED) {
+        parser->error = "expected a value after the comparison";
+        return;
+    }
+    char *end;
+    if (op.code == FILTER_NAME) {
+        strcpy(op.text, parser->token);
+    } else if (op.code == FILTER_AVERAGE) {
+        op.real = strtod(parser->token, &end);
+        if (end == parser->token || *end != '\0') {
+            parser->error = "averages compare with a number";
+            return;
+        }
+    } else if (op.code == FILTER_GRADE && filterLetter(parser->token) >= 0) {
+        op.code = FILTER_LETTER;
+        op.operand = -filterLetter(parser->token);
+    } else if (!parseInteger(parser->token, &op.operand)) {
+        parser->error = op.code == FILTER_GRADE ? "grades compare with a score or a letter grade" : "expected a whole number";
+        return;
+    }
+    filterNext(parser);
+    filterEmit(parser, &op);
+}
+
+static void filterParse(FilterParser *parser, int top);
+
+static void filterParseUnary(FilterParser *parser) {
+    if (++parser->depth > FILTER_MAX_OPS) {
+        parser->error = "the filter is nested too deeply";
+    } else if (filterKeyword(parser, "not")) {
+        filterNext(parser);
+        filterParseUnary(parser);
+        FilterOp op = { .code = FILTER_NOT };
+        if (parser->error == NULL)
+            filterEmit(parser, &op);
+    } else if (parser->kind == FILTER_OPEN) {
+        filterNext(parser);
+        filterParse(parser, 0);
+        if (parser->error == NULL && parser->kind != FILTER_CLOSE)
+            parser->error = "missing )";
+        filterNext(parser);
+    } else {
+        filterParseTest(parser);
+    }
+    --parser->depth;
+}
+
+static void filterParseConjunction(FilterParser *parser, int top) {
+    FilterProgram *program = parser->program;
+    for (int first = 1; parser->error == NULL; first = 0) {
+        int start = program->num_ops;
+        filterParseUnary(parser);
+        if (parser->error != NULL)
+            return;
+        if (top && program->num_ops == start + 1)
+            program->conjuncts[program->num_conjuncts++] = start;
+        FilterOp op = { .code = FILTER_AND };
+        if (!first)
+            filterEmit(parser, &op);
+        if (!filterKeyword(parser, "and"))
+            return;
+        filterNext(parser);
+    }
+}
+
+static void filterParse(FilterParser *parser, int top) {
+    filterParseConjunction(parser, top);
+    while (parser->error == NULL && filterKeyword(parser, "or")) {
+        parser->program->num_conjuncts = 0; // None of them is required any more
+        filterNext(parser);
+        filterParseConjunction(parser, 0);
+        FilterOp op = { .code = FILTER_OR };
+        if (parser->error == NULL)
+            filterEmit(parser, &op);
+    }
+}
+
+// Compiles a filter; returns NULL, or what is wrong with it
+const char *filterCompile(const char *text, FilterProgram *program) {
+    FilterParser parser = { text, FILTER_END, "", 0, program, NULL };
+    program->num_ops = 0;
+    program->num_conjuncts = 0;
+    filterNext(&parser);
+    if (parser.kind == FILTER_END && parser.error == NULL)
+        return "the filter is empty";
+    if (parser.error == NULL)
+        filterParse(&parser, 1);
+    if (parser.error == NULL && parser.kind != FILTER_END)
+        parser.error = parser.kind == FILTER_CLOSE ? "unbalanced parentheses" : "expected and, or or the end of the filter";
+    return parser.error;
+}
+
+// One batch of records being filtered, with a result mask per slot of the
+// program's stack
+typedef struct {
+    const Student *records[STORE_CHUNK_SIZE];
+    int handles[STORE_CHUNK_SIZE];
+    int32_t values[STORE_CHUNK_SIZE]; // The column a test compares
+    double reals[STORE_CHUNK_SIZE];
+    unsigned char subject_mask[STORE_CHUNK_SIZE]; // One subject of an any or all test
+    unsigned char masks[FILTER_MAX_OPS][STORE_CHUNK_SIZE];
+} FilterBatch;
+
+// Each comparison is its own branch-free loop over the column, so all of them vectorize
+static inline void filterCompareInts(const int32_t *restrict values, int count, FilterCompare compare, int32_t operand, unsigned char *restrict mask) {
+    switch (compare) {
+    case FILTER_LESS:
+        for (int i = 0; i < count; ++i) mask[i] = values[i] < operand;
+        break;
+    case FILTER_LESS_EQUAL:
+        for (int i = 0; i < count; ++i) mask[i] = values[i] <= operand;
+        break;
+    case FILTER_GREATER:
+        for (int i = 0; i < count; ++i) mask[i] = values[i] > operand;
+        break;
+    case FILTER_GREATER_EQUAL:
+        for (int i = 0; i < count; ++i) mask[i] = values[i] >= operand;
+        break;
+    case FILTER_EQUAL:
+        for (int i = 0; i < count; ++i) mask[i] = values[i] == operand;
+        break;
+    default:
+        for (int i = 0; i < count; ++i) mask[i] = values[i] != operand;
+        break;
+    }
+}
+
+static inline void filterCompareReals(const double *restrict values, int count, FilterCompare compare, double operand, unsigned char *restrict mask) {
+    switch (compare) {
+    case FILTER_LESS:
+        for (int i = 0; i < count; ++i) mask[i] = values[i] < operand;
+        break;
+    case FILTER_LESS_EQUAL:
+        for (int i = 0; i < count; ++i) mask[i] = values[i] <= operand;
+        break;
+    case FILTER_GREATER:
+        for (int i = 0; i < count; ++i) mask[i] = values[i] > operand;
+        break;
+    case FILTER_GREATER_EQUAL:
+        for (int i = 0; i < count; ++i) mask[i] = values[i] >= operand;
+        break;
+    case FILTER_EQUAL:
+        for (int i = 0; i < count; ++i) mask[i] = values[i] == operand;
+        break;
+    default:
+        for (int i = 0; i < count; ++i) mask[i] = values[i] != operand;
+        break;
+    }
+}
+
+// Compares one subject's grades, or the letter grades they earn
+static inline void filterSubject(const FilterOp *op, FilterBatch *batch, int count, int subject, unsigned char *mask) {
+    if (op->code == FILTER_LETTER) {
+        const unsigned char *table = grading_scale->table[subject];
+        for (int i = 0; i < count; ++i) {
+            int32_t grade = batch->records[i]->grades[subject];
+            batch->values[i] = -(int32_t)table[(uint32_t)grade <= STATS_MAX_GRADE ? grade : STATS_MAX_GRADE + 1];
+        }
+    } else {
+        for (int i = 0; i < count; ++i) {
+            batch->values[i] = batch->records[i]->grades[subject];
+        }
+    }
+    filterCompareInts(batch->values, count, op->compare, op->operand, mask);
+}
+
+static inline void filterTest(const FilterOp *op, FilterBatch *batch, int count, unsigned char *mask) {
+    switch (op->code) {
+    case FILTER_TOTAL:
+    case FILTER_NUMBER:
+        for (int i = 0; i < count; ++i) {
+            batch->values[i] = op->code == FILTER_TOTAL ? batch->records[i]->total_score : batch->records[i]->student_number;
+        }
+        filterCompareInts(batch->values, count, op->compare, op->operand, mask);
+        break;
+    case FILTER_AVERAGE:
+        for (int i = 0; i < count; ++i) {
+            batch->reals[i] = studentAverage(batch->records[i]);
+        }
+        filterCompareReals(batch->reals, count, op->compare, op->real, mask);
+        break;
+    case FILTER_NAME:
+        for (int i = 0; i < count; ++i) {
+            const char *name = studentName(batch->records[i]);
+            mask[i] = op->compare == FILTER_CONTAINS ? containsIgnoreCase(name, op->text) : (strcmp(name, op->text) == 0) == (op->compare == FILTER_EQUAL);
+        }
+        break;
+    default:
+        if (op->subject >= 0) {
+            filterSubject(op, batch, count, op->subject, mask);
+            break;
+        }
+        // Any ORs the subjects together and all ANDs them
+        filterSubject(op, batch, count, 0, mask);
+        for (int s = 1; s < num_subjects; ++s) {
+            filterSubject(op, batch, count, s, batch->subject_mask);
+            if (op->subject == FILTER_ANY) {
+                for (int i = 0; i < count; ++i) mask[i] |= batch->subject_mask[i];
+            } else {
+                for (int i = 0; i < count; ++i) mask[i] &= batch->subject_mask[i];
+            }
+        }
+        break;
+    }
+}
+
+// Runs the program over the first count records of a batch, leaving the result
+// in masks[0]. Built for AVX2 and the baseline, see GRADE_KERNEL.
+GRADE_KERNEL static void filterBatchRun(const FilterProgram *program, FilterBatch *batch, int count) {
+    int top = 0;
+    for (int k = 0; k < program->num_ops; ++k) {
+        const FilterOp *op = &program->ops[k];
+        if (op->code == FILTER_AND || op->code == FILTER_OR) {
+            unsigned char *restrict left = batch->masks[top - 2];
+            const unsigned char *restrict right = batch->masks[top - 1];
+            if (op->code == FILTER_AND) {
+                for (int i = 0; i < count; ++i) left[i] &= right[i];
+            } else {
+                for (int i = 0; i < count; ++i) left[i] |= right[i];
+            }
+            --top;
+        } else if (op->code == FILTER_NOT) {
+            unsigned char *mask = batch->masks[top - 1];
+            for (int i = 0; i < count; ++i) mask[i] ^= 1;
+        } else {
+            filterTest(op, batch, count, batch->masks[top++]);
+        }
+    }
+}
+
+// A filter pass over store chunks, or over candidates from an index. Like name
+// scans, parts collect their matches separately and are appended in order.
+typedef struct {
+    const FilterProgram *program;
+    const int *candidates; // Handles in store order; NULL to scan the store
+    int num_candidates;
+    FilterBatch *batches; // One per worker
+    HandleList *found; // One list per part
+} FilterJob;
+
+static void filterKeep(const FilterBatch *batch, int count, HandleList *found) {
+    for (int i = 0; i < count; ++i) {
+        if (batch->masks[0][i])
+            handleListPush(found, batch->handles[i]);
+    }
+}
+
+static void filterPart(void *context, int part, int worker) {
+    FilterJob *job = context;
+    FilterBatch *batch = &job->batches[worker];
+    HandleList *found = &job->found[part];
+    if (job->candidates == NULL) {
+        int last = (part + 1) * POOL_PART_CHUNKS < student_store.num_chunks ? (part + 1) * POOL_PART_CHUNKS : student_store.num_chunks;
+        for (int c = part * POOL_PART_CHUNKS; c < last; ++c) {
+            const StudentChunk *chunk = student_store.chunks[c];
+            int slots = student_store.slots - c * STORE_CHUNK_SIZE < STORE_CHUNK_SIZE ? student_store.slots - c * STORE_CHUNK_SIZE : STORE_CHUNK_SIZE;
+            int count = 0;
+            for (int i = 0; i < slots; ++i) {
+                if (chunk->handles[i] < 0)
+                    continue;
+                batch->records[count] = chunkRecord(chunk, i);
+                batch->handles[count++] = chunk->handles[i];
+            }
+            filterBatchRun(job->program, batch, count);
+            filterKeep(batch, count, found);
+        }
+        return;
+    }
+    int end = (part + 1) * POOL_PART_ITEMS < job->num_candidates ? (part + 1) * POOL_PART_ITEMS : job->num_candidates;
+    for (int first = part * POOL_PART_ITEMS; first < end; first += STORE_CHUNK_SIZE) {
+        int count = end - first < STORE_CHUNK_SIZE ? end - first : STORE_CHUNK_SIZE;
+        for (int i = 0; i < count; ++i) {
+            batch->handles[i] = job->candidates[first + i];
+            batch->records[i] = storeByHandle(&student_store, batch->handles[i]);
+        }
+        filterBatchRun(job->program, batch, count);
+        filterKeep(batch, count, found);
+    }
+}
+
+// Rank in the name or total index of the first record not ordered before the
+// test's operand, or of the first ordered after it when past is set
+static int filterRank(const FilterOp *op, int past) {
+    const SortIndex *index = &sort_indexes[op->code == FILTER_NAME ? SORT_BY_NAME : SORT_BY_TOTAL_SCORE];
+    int rank = 0;
+    for (int n = index->root; n >= 0; ) {
+        const Student *s = storeByHandle(&student_store, n);
+        int cmp = op->code == FILTER_NAME ? strcmp(studentName(s), op->text) : (s->total_score > op->operand) - (s->total_score < op->operand);
+        if (cmp < 0 || (past && cmp == 0)) {
+            rank += indexSize(index, index->nodes[n].left) + 1;
+            n = index->nodes[n].right;
+        } else {
+            n = index->nodes[n].left;
+        }
+    }
+    return rank;
+}
+
+static int compareInts(const void *a, const void *b) {
+    int x = *(const int *)a, y = *(const int *)b;
+    return (x > y) - (x < y);
+}
+
+// Fills out with the candidates of the conjunct an index narrows down the most,
+// in store order. Returns 0 if none is worth it, when a scan reads fewer records
+// in total than looking up a quarter of the roster one by one. Sorted and gram
+// indexes are built only for conjuncts they can answer.
+static int filterCandidates(const FilterProgram *program, HandleList *out) {
+    const FilterOp *best = NULL;
+    int best_count = student_store.count / 4 + 1;
+    int best_from = 0;
+    for (int k = 0; k < program->num_conjuncts; ++k) {
+        const FilterOp *op = &program->ops[program->conjuncts[k]];
+        int from = 0;
+        int to = -1;
+        int sorted = (op->code == FILTER_NAME && op->compare == FILTER_EQUAL) || (op->code == FILTER_TOTAL && op->compare != FILTER_NOT_EQUAL) ||
+                     (op->code == FILTER_NAME && op->compare == FILTER_CONTAINS && strlen(op->text) >= 3);
+        if (sorted)
+            rosterEnsureIndexes(); // Only when one of them can help
+        if (op->code == FILTER_NUMBER && op->compare == FILTER_EQUAL) {
+            to = 1;
+        } else if (op->code == FILTER_NAME && op->compare == FILTER_EQUAL) {
+            from = filterRank(op, 0);
+            to = filterRank(op, 1);
+        } else if (op->code == FILTER_TOTAL && op->compare != FILTER_NOT_EQUAL) {
+            int before = filterRank(op, 0);
+            int through = filterRank(op, 1);
+            from = op->compare == FILTER_LESS || op->compare == FILTER_LESS_EQUAL ? 0 : op->compare == FILTER_GREATER ? through : before;
+            to = op->compare == FILTER_LESS ? before : op->compare == FILTER_LESS_EQUAL || op->compare == FILTER_EQUAL ? through : student_store.count;
+        } else if (sorted) {
+            // Matches are among the postings of each trigram of the text
+            uint32_t grams[NAME_SIZE];
+            int num_grams = nameGrams(op->text, grams);
+            for (int g = 0; g < num_grams; ++g) {
+                GramSlot *slot = gramIndexFind(&gram_index, grams[g]);
+                int postings = slot != NULL ? slot->posting.count : 0;
+                to = to < 0 || postings < to ? postings : to;
+            }
+        }
+        if (to >= 0 && to - from < best_count) {
+            best = op;
+            best_count = to - from;
+            best_from = from;
+        }
+    }
+    if (best == NULL)
+        return 0;
+    if (best->code == FILTER_NUMBER) {
+        int handle = rosterFindNumber(best->operand);
+        if (handle >= 0)
+            handleListPush(out, handle);
+    } else if (best->code == FILTER_NAME && best->compare == FILTER_CONTAINS) {
+        searchNames(best->text, out);
+    } else {
+        const SortIndex *index = &sort_indexes[best->code == FILTER_NAME ? SORT_BY_NAME : SORT_BY_TOTAL_SCORE];
+        for (int rank = best_from; rank < best_from + best_count; ++rank) {
+            handleListPush(out, indexSelect(index, rank));
+        }
+    }
+    // Handles only grow along the store, so their order is store order
+    if (out->count > 1)
+        qsort(out->handles, out->count, sizeof(int), compareInts);
+    return 1;
+}
+
+// Appends the handles of students passing the filter, in registration order.
+// The program runs over batches of records: those an index picks out for a
+// conjunct when one narrows the search enough, otherwise every record.
+void filterStudents(const FilterProgram *program, HandleList *out) {
+    if (student_store.count == 0)
+        return;
+    storeLoadAll(&student_store); // Batches point into chunks from every thread
+    HandleList candidates = { NULL, 0, 0 };
+    FilterJob job = { program, NULL, 0, NULL, NULL };
+    if (filterCandidates(program, &candidates)) {
+        job.candidates = candidates.handles;
+        job.num_candidates = candidates.count;
+    }
+    int parts = job.candidates == NULL ? (student_store.num_chunks + POOL_PART_CHUNKS - 1) / POOL_PART_CHUNKS
+              : (job.num_candidates + POOL_PART_ITEMS - 1) / POOL_PART_ITEMS;
+    job.batches = malloc(poolThreads() * sizeof(FilterBatch));
+    job.found = calloc(parts ? parts : 1, sizeof(HandleList));
+    if (job.batches == NULL || job.found == NULL)
+        outOfMemory();
+    poolRun(parts, filterPart, &job);
+    for (int p = 0; p < parts; ++p) {
+        for (int i = 0; i < job.found[p].count; ++i) {
+            handleListPush(out, job.found[p].handles[i]);
+        }
+        free(job.found[p].handles);
+    }
+    free(job.found);
+    free(job.batches);
+    free(candidates.handles);
+}
+
+RosterStats roster_stats;
+RankIndex rank_indexes[MAX_SUBJECTS + 1]; // Built on first use, then kept current
+int rank_indexes_stale = 1;
+
+// Histogram slots of a column: grades for a subject, or the total score
+static int statsColumnMax(int column) {
+    return column < num_subjects ? STATS_MAX_GRADE : num_subjects * STATS_MAX_GRADE;
+}
+
+// Adds a student to the aggregates (sign 1) or takes one away (sign -1)
+static void statsApply(RosterStats *stats, const Student *s, int sign) {
+    stats->count += sign;
+    for (int i = 0; i <= num_subjects; ++i) {
+        int value = i < num_subjects ? s->grades[i] : s->total_score;
+        stats->sum[i] += sign * (long long)value;
+        stats->sum_squares[i] += sign * (double)value * value;
+        if (value < 0)
+            stats->below[i] += sign;
+        else if (value > statsColumnMax(i))
+            stats->above[i] += sign;
+        else
+            stats->histogram[i][value] += sign;
+        if (i < num_subjects)
+            stats->letter_counts[i][assignLetterGrade(i, value)] += sign;
+    }
+}
+
+// Letter counts follow from the histograms, so a regrade needs no pass over the roster
+static void statsRecountLetters(RosterStats *stats, const GradingScale *scale) {
+    memset(stats->letter_counts, 0, sizeof(stats->letter_counts));
+    for (int i = 0; i < num_subjects; ++i) {
+        int *counts = stats->letter_counts[i];
+        counts[scale->table[i][STATS_MAX_GRADE + 1]] += stats->below[i] + stats->above[i];
+        for (int score = 0; score <= STATS_MAX_GRADE; ++score) {
+            counts[scale->table[i][score]] += stats->histogram[i][score];
+        }
+    }
+}
+
+// Grade codes a statistics table has columns for, in code order: those in the
+// current scale and any that students still hold
+static int statsGradeColumns(const RosterStats *stats, unsigned char *codes) {
+    int used[GRADE_CODES] = {0};
+    for (int i = 0; i < num_subjects; ++i) {
+        for (int k = 0; k < grading_scale->num_cutoffs[i]; ++k) {
+            used[grading_scale->codes[i][k]] = 1;
+        }
+        for (int code = 0; code < GRADE_CODES; ++code) {
+            used[code] |= stats->letter_counts[i][code] != 0;
+        }
+    }
+    int count = 0;
+    for (int code = 0; code < GRADE_CODES; ++code) {
+        if (used[code])
+            codes[count++] = code;
+    }
+    return count;
+}
+
+// Smallest value with at least percent of the column at or below it (nearest rank)
+int statsPercentile(const RosterStats *stats, int column, double percent) {
+    long rank = (long)ceil(percent / 100 * stats->count);
+    if (rank < 1)
+        rank = 1;
+    if (rank <= stats->below[column])
+        return STATS_BELOW_RANGE;
+    rank -= stats->below[column];
+    for (int value = 0; value <= statsColumnMax(column); ++value) {
+        rank -= stats->histogram[column][value];
+        if (rank <= 0)
+            return value;
+    }
+    return STATS_ABOVE_RANGE;
+}
+
+// Reads one column in time bounded by its histogram size, not by the roster
+void statsSummarize(const RosterStats *stats, int column, StatsSummary *summary) {
+    memset(summary, 0, sizeof(*summary));
+    if (stats->count == 0)
+        return;
+    summary->mean = stats->sum[column] / (double)stats->count;
+    double variance = stats->sum_squares[column] / stats->count - summary->mean * summary->mean;
+    summary->stddev = variance > 0 ? sqrt(variance) : 0;
+    summary->min = statsPercentile(stats, column, 0);
+    summary->p10 = statsPercentile(stats, column, 10);
+    summary->p25 = statsPercentile(stats, column, 25);
+    summary->median = statsPercentile(stats, column, 50);
+    summary->p75 = statsPercentile(stats, column, 75);
+    summary->p90 = statsPercentile(stats, column, 90);
+    summary->max = statsPercentile(stats, column, 100);
+}
+
+static void statsRebuildPart(void *context, int part, int worker) {
+    RosterStats *stats = (RosterStats *)context + worker;
+    int first = part * POOL_PART_CHUNKS * STORE_CHUNK_SIZE;
+    int end = first + POOL_PART_CHUNKS * STORE_CHUNK_SIZE < student_store.slots ? first + POOL_PART_CHUNKS * STORE_CHUNK_SIZE : student_store.slots;
+    Student scratch;
+    for (int pos = storeNextLive(&student_store, first); pos < end; pos = storeNextLive(&student_store, pos + 1)) {
+        statsApply(stats, storePeek(&student_store, pos, &scratch), 1);
+    }
+}
+
+// The aggregates are rebuilt on first use after a load, reading mapped records in
+// place. Each thread sums into its own copy, and the copies are added up; every
+// field is an exact count or sum, so the result does not depend on the split.
+const RosterStats *rosterStats() {
+    if (roster_stats_stale) {
+        roster_stats_stale = 0;
+        int threads = poolThreads();
+        RosterStats *partial = calloc(threads, sizeof(RosterStats));
+        if (partial == NULL)
+            outOfMemory();
+        poolRun((student_store.num_chunks + POOL_PART_CHUNKS - 1) / POOL_PART_CHUNKS, statsRebuildPart, partial);
+        memset(&roster_stats, 0, sizeof(roster_stats));
+        for (int t = 0; t < threads; ++t) {
+            const RosterStats *from = &partial[t];
+            roster_stats.count += from->count;
+            for (int i = 0; i <= num_subjects; ++i) {
+                roster_stats.sum[i] += from->sum[i];
+                roster_stats.sum_squares[i] += from->sum_squares[i];
+                roster_stats.below[i] += from->below[i];
+                roster_stats.above[i] += from->above[i];
+                for (int value = 0; value <= statsColumnMax(i); ++value) {
+                    roster_stats.histogram[i][value] += from->histogram[i][value];
+                }
+                if (i < num_subjects) {
+                    for (int code = 0; code < GRADE_CODES; ++code) {
+                        roster_stats.letter_counts[i][code] += from->letter_counts[i][code];
+                    }
+                }
+            }
+        }
+        free(partial);
+    }
+    return &roster_stats;
+}
+
+static int rankScore(const Student *s, int column) {
+    return column < num_subjects ? s->grades[column] : s->total_score;
+}
+
+// Bucket of a score: 0 above the histogram, then its top score down to 0, then below 0
+static int rankBucket(int column, int score) {
+    int max = statsColumnMax(column);
+    return score > max ? 0 : score < 0 ? max + 2 : max - score + 1;
+}
+
+static int rankBuckets(int column) {
+    return statsColumnMax(column) + 3;
+}
+
+static void rankTreeAdd(RankIndex *index, int buckets, int bucket, int delta) {
+    for (int i = bucket + 1; i <= buckets; i += i & -i) {
+        index->tree[i] += delta;
+    }
+}
+
+// Students in the buckets before this one
+static int rankTreeBefore(const RankIndex *index, int bucket) {
+    int sum = 0;
+    for (int i = bucket; i > 0; i -= i & -i) {
+        sum += index->tree[i];
+    }
+    return sum;
+}
+
+// Place in a bucket of the first entry not ranked before (score, handle). Only the
+// two out-of-range buckets mix scores, so only they read records.
+static int rankFind(int column, const HandleList *bucket, int in_range, int score, int handle) {
+    int lo = 0;
+    int hi = bucket->count;
+    while (lo < hi) {
+        int mid = lo + (hi - lo) / 2;
+        int h = bucket->handles[mid];
+        int other = in_range ? score : rankScore(storeByHandle(&student_store, h), column);
+        if (other > score || (other == score && h < handle))
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+    return lo;
+}
+
+// Adds a student's handle to every ranking (delta 1) or takes it out (delta -1)
+static void rankApply(const Student *s, int handle, int delta) {
+    for (int column = 0; column <= num_subjects; ++column) {
+        RankIndex *index = &rank_indexes[column];
+        int score = rankScore(s, column);
+        int b = rankBucket(column, score);
+        HandleList *bucket = &index->buckets[b];
+        int at = rankFind(column, bucket, b > 0 && b < rankBuckets(column) - 1, score, handle);
+        if (delta > 0) {
+            handleListPush(bucket, handle); // New handles are the largest, so this is usually the place
+            memmove(bucket->handles + at + 1, bucket->handles + at, (bucket->count - 1 - at) * sizeof(int));
+            bucket->handles[at] = handle;
+        } else {
+            memmove(bucket->handles + at, bucket->handles + at + 1, (bucket->count - 1 - at) * sizeof(int));
+            --bucket->count;
+        }
+        rankTreeAdd(index, rankBuckets(column), b, delta);
+    }
+}
+
+typedef struct {
+    int handle;
+    int score;
+} RankEntry;
+
+// Out-of-range buckets: higher scores first, then registration order
+static int compareRankEntries(const void *a, const void *b) {
+    const RankEntry *x = a;
+    const RankEntry *y = b;
+    if (x->score != y->score)
+        return x->score < y->score ? 1 : -1;
+    return (x->handle > y->handle) - (x->handle < y->handle);
+}
+
+// Rebuilds one column's ranking. Store order is handle order, so the in-range
+// buckets fill already sorted and only the two out-of-range ones need sorting.
+static void rankRebuildPart(void *context, int column, int worker) {
+    (void)context;
+    (void)worker;
+    RankIndex *index = &rank_indexes[column];
+    int buckets = rankBuckets(column);
+    for (int b = 0; b < buckets; ++b) {
+        index->buckets[b].count = 0;
+    }
+    memset(index->tree, 0, (buckets + 1) * sizeof(int));
+    RankEntry *outside = NULL;
+    int num_outside = 0;
+    int outside_capacity = 0;
+    Student scratch;
+    for (int pos = storeNextLive(&student_store, 0); pos < student_store.slots; pos = storeNextLive(&student_store, pos + 1)) {
+        int handle = storeHandleAt(&student_store, pos);
+        int score = rankScore(storePeek(&student_store, pos, &scratch), column);
+        int b = rankBucket(column, score);
+        if (b > 0 && b < buckets - 1) {
+            handleListPush(&index->buckets[b], handle);
+            continue;
+        }
+        if (num_outside == outside_capacity) {
+            outside_capacity = outside_capacity ? outside_capacity * 2 : 64;
+            outside = realloc(outside, outside_capacity * sizeof(RankEntry));
+            if (outside == NULL)
+                outOfMemory();
+        }
+        outside[num_outside].handle = handle;
+        outside[num_outside++].score = score;
+    }
+    if (num_outside > 1)
+        qsort(outside, num_outside, sizeof(RankEntry), compareRankEntries);
+    for (int i = 0; i < num_outside; ++i) {
+        handleListPush(&index->buckets[rankBucket(column, outside[i].score)], outside[i].handle);
+    }
+    free(outside);
+    for (int b = 0; b < buckets; ++b) {
+        rankTreeAdd(index, buckets, b, index->buckets[b].count);
+    }
+}
+
+// The rankings are built on first use after a load, one column per pool part
+void rosterEnsureRankIndexes() {
+    if (!rank_indexes_stale)
+        return;
+    rank_indexes_stale = 0;
+    poolRun(num_subjects + 1, rankRebuildPart, NULL);
+}
+
+// Handle at a 0-based rank (best first) in a column, or -1
+int rankSelect(int column, int rank) {
+    rosterEnsureRankIndexes();
+    if (rank < 0 || rank >= student_store.count)
+        return -1;
+    const RankIndex *index = &rank_indexes[column];
+    int buckets = rankBuckets(column);
+    int step = 1;
+    while (step * 2 <= buckets) {
+        step *= 2;
+    }
+    // Descend the Fenwick tree to the bucket holding the rank
+    int b = 0;
+    for (; step > 0; step /= 2) {
+        if (b + step <= buckets && index->tree[b + step] <= rank) {
+            b += step;
+            rank -= index->tree[b];
+        }
+    }
+    return index->buckets[b].handles[rank];
+}
+
+// Appends the handles ranked first to first + count - 1 in a column, best first,
+// or as many of them as there are
+void rankList(int column, int first, int count, HandleList *out) {
+    int handle = rankSelect(column, first);
+    if (handle < 0)
+        return;
+    const RankIndex *index = &rank_indexes[column];
+    int b = rankBucket(column, rankScore(storeByHandle(&student_store, handle), column));
+    int at = first - rankTreeBefore(index, b);
+    for (; count > 0 && b < rankBuckets(column); ++b, at = 0) {
+        const HandleList *bucket = &index->buckets[b];
+        for (; at < bucket->count && count > 0; ++at, --count) {
+            handleListPush(out, bucket->handles[at]);
+        }
+    }
+}
+
+// Where a student stands in a column: how many score higher and how many the same
+void rankStanding(int column, int handle, RankStanding *standing) {
+    rosterEnsureRankIndexes();
+    const RankIndex *index = &rank_indexes[column];
+    int score = rankScore(storeByHandle(&student_store, handle), column);
+    int b = rankBucket(column, score);
+    const HandleList *bucket = &index->buckets[b];
+    int in_range = b > 0 && b < rankBuckets(column) - 1;
+    int above = rankFind(column, bucket, in_range, score, -1);
+    standing->score = score;
+    standing->count = student_store.count;
+    standing->above = rankTreeBefore(index, b) + above;
+    standing->tied = (in_range ? bucket->count : rankFind(column, bucket, 0, score, INT_MAX)) - above;
+    standing->position = rankTreeBefore(index, b) + rankFind(column, bucket, in_range, score, handle);
+}
+
+// Roster operations keep the store and every index in step.
+// Student numbers are unique: adds and updates that would duplicate one return -1.
+// While the sort and name indexes are stale, changes leave them to the next rebuild,
+// so replaying a journal at startup does not build them.
+// Adds a record exactly as given; journal replay uses this to keep logged ids
+static int rosterInsert(const Student *s) {
+    rosterEnsureNumberIndex();
+    if (numberIndexFind(&number_index, s->student_number) >= 0)
+        return -1;
+    int handle = storeAppend(&student_store, s);
+    journalAppend(JOURNAL_ADD, handle, s);
+    numberIndexInsert(&number_index, s->student_number, handle);
+    if (!roster_stats_stale)
+        statsApply(&roster_stats, s, 1);
+    if (!rank_indexes_stale)
+        rankApply(s, handle, 1);
+    if (roster_indexes_stale)
+        return handle;
+    gramIndexAdd(&gram_index, studentName(s), handle);
+    for (int f = 0; f < NUM_SORT_FIELDS; ++f) {
+        indexInsert(&sort_indexes[f], handle);
+    }
+    return handle;
+}
+
+// New students get id handle + 1, so ids are never reused either
+int rosterAdd(const Student *s) {
+    Student added;
+    studentCopy(&added, s);
+    added.id = student_store.next_handle + 1;
+    return rosterInsert(&added);
+}
+
+int rosterUpdate(int handle, const Student *s) {
+    rosterEnsureNumberIndex();
+    const Student *current = storeByHandle(&student_store, handle);
+    if (s->student_number != current->student_number) {
+        if (numberIndexFind(&number_index, s->student_number) >= 0)
+            return -1;
+    }
+    journalAppend(JOURNAL_UPDATE, handle, s);
+    if (s->student_number != current->student_number) {
+        numberIndexRemove(&number_index, current->student_number);
+        numberIndexInsert(&number_index, s->student_number, handle);
+    }
+    int indexed = !roster_indexes_stale;
+    if (indexed && strcmp(studentName(s), studentName(current)) != 0) {
+        gramIndexRemove(&gram_index, studentName(current), handle);
+        gramIndexAdd(&gram_index, studentName(s), handle);
+    }
+    for (int f = 0; f < NUM_SORT_FIELDS && indexed; ++f) {
+        indexRemove(&sort_indexes[f], handle);
+    }
+    if (!roster_stats_stale) {
+        statsApply(&roster_stats, current, -1);
+        statsApply(&roster_stats, s, 1);
+    }
+    if (!rank_indexes_stale)
+        rankApply(current, handle, -1);
+    studentCopy(storeWritableAt(&student_store, storePositionOf(&student_store, handle)), s);
+    if (!rank_indexes_stale)
+        rankApply(s, handle, 1);
+    for (int f = 0; f < NUM_SORT_FIELDS && indexed; ++f) {
+        indexInsert(&sort_indexes[f], handle);
+    }
+    return handle;
+}
+
+void rosterRemove(int handle) {
+    rosterEnsureNumberIndex();
+    journalAppend(JOURNAL_REMOVE, handle, NULL);
+    numberIndexRemove(&number_index, storeByHandle(&student_store, handle)->student_number);
+    if (!roster_indexes_stale) {
+        gramIndexRemove(&gram_index, studentName(storeByHandle(&student_store, handle)), handle);
+        for (int f = 0; f < NUM_SORT_FIELDS; ++f) {
+            indexRemove(&sort_indexes[f], handle);
+        }
+    }
+    if (!roster_stats_stale)
+        statsApply(&roster_stats, storeByHandle(&student_store, handle), -1);
+    if (!rank_indexes_stale)
+        rankApply(storeByHandle(&student_store, handle), handle, -1);
+    storeRemove(&student_store, storePositionOf(&student_store, handle));
+}
+
+const Student *viewStudentAt(const StudentView *view, int i) {
+    if (view->index != NULL) {
+        // Descending views walk the ascending index from the end
+        int rank = view->order < 0 ? view->count - 1 - i : i;
+        return storeByHandle(&student_store, indexSelect(view->index, rank));
+    }
+    if (view->handles != NULL)
+        return storeByHandle(&student_store, view->handles[i]);
+    return storeAt(&student_store, storeSelect(&student_store, i));
+}
+
+// Builds the sort and name indexes from scratch after a bulk load
+void rosterRebuildIndexes() {
+    int count = student_store.count;
+    int *handles = malloc((count ? count : 1) * sizeof(int));
+    if (handles == NULL)
+        outOfMemory();
+    for (int f = 0; f < NUM_SORT_FIELDS; ++f) {
+        storeListHandles(&student_store, handles);
+        // Store order is handle order, so the stable sort matches compareHandles
+        SortKey key = { f, 1 };
+        sortHandles(handles, count, &key, 1);
+        indexBuild(&sort_indexes[f], handles, count);
+    }
+    free(handles);
+    for (int i = 0; i < gram_index.capacity; ++i) {
+        gram_index.slots[i].posting.count = 0;
+    }
+    for (int pos = storeNextLive(&student_store, 0); pos < student_store.slots; pos = storeNextLive(&student_store, pos + 1)) {
+        gramIndexAdd(&gram_index, studentName(storeAt(&student_store, pos)), storeHandleAt(&student_store, pos));
+    }
+}
+
+void rosterEnsureNumberIndex() {
+    if (!number_index_stale)
+        return;
+    number_index_stale = 0;
+    for (int i = 0; i < number_index.capacity; ++i) {
+        number_index.slots[i].handle = -1;
+    }
+    number_index.count = 0;
+    for (int i = storeNextLive(&student_store, 0); i < student_store.slots; i = storeNextLive(&student_store, i + 1)) {
+        int student_number = storeAt(&student_store, i)->student_number;
+        if (numberIndexFind(&number_index, student_number) >= 0) {
+            errno = 0;
+            storageFailure(SNAPSHOT_FILE); // Saved data holds a duplicate student number
+        }
+        numberIndexInsert(&number_index, student_number, storeHandleAt(&student_store, i));
+    }
+}
+
+// Indexes are built on first use after a load, so startup does not scale with the roster
+void rosterEnsureIndexes() {
+    rosterEnsureNumberIndex();
+    if (!roster_indexes_stale)
+        return;
+    roster_indexes_stale = 0;
+    rosterRebuildIndexes();
+}
+
+// Handle registered under student_number, or -1
+int rosterFindNumber(int student_number) {
+    rosterEnsureNumberIndex();
+    return numberIndexFind(&number_index, student_number);
+}
+
+// Derives the total from the numeric grades
+void computeStudentScores(Student *s) {
+    int total = 0;
+    for (int i = 0; i < num_subjects; ++i) {
+        total += s->grades[i];
+    }
+    s->total_score = total;
+}
+
+// Average grade, derived from the total
+double studentAverage(const Student *s) {
+    return s->total_score / (double)num_subjects;
+}
+
+// Grades outside what a record holds, from older data, are clamped into range
+uint8_t clampGrade(int grade) {
+    return grade < 0 ? 0 : grade > GRADE_MAX_SCORE ? GRADE_MAX_SCORE : grade;
+}
+
+// Reads a grade like parseInteger; returns 0 unless it is a whole number a record can hold
+int parseGrade(const char *text, uint8_t *grade) {
+    int value;
+    if (!parseInteger(text, &value) || value < 0 || value > GRADE_MAX_SCORE)
+        return 0;
+    *grade = value;
+    return 1;
+}
+
+// Name of a grade code, such as "A+" or "F"
+void gradeName(int code, char name[3]) {
+    name[0] = (char)('A' + code / 3);
+    name[1] = "+\0-"[code % 3];
+    name[2] = '\0';
+}
+
+// Builds the score lookup table from the cutoffs
+static void gradingScaleCompile(GradingScale *scale) {
+    for (int i = 0; i < num_subjects; ++i) {
+        int k = 0;
+        for (int score = STATS_MAX_GRADE; score >= 0; --score) {
+            while (score < scale->min_scores[i][k]) {
+                ++k;
+            }
+            scale->table[i][score] = scale->codes[i][k];
+        }
+        scale->table[i][STATS_MAX_GRADE + 1] = scale->codes[i][scale->num_cutoffs[i] - 1];
+    }
+}
+
+// A: 90-100, B: 80-89, C: 70-79, D: 60-69, F: below 60, in every subject
+void gradingScaleDefault(GradingScale *scale) {
+    static const char letters[] = "ABCDF";
+    for (int i = 0; i < num_subjects; ++i) {
+        scale->num_cutoffs[i] = 5;
+        for (int k = 0; k < 5; ++k) {
+            scale->codes[i][k] = (unsigned char)((letters[k] - 'A') * 3 + 1);
+            scale->min_scores[i][k] = k < 4 ? 90 - 10 * k : 0;
+        }
+    }
+    gradingScaleCompile(scale);
+}
+
+// Sets one subject's cutoffs from words like "A+:97", best grade first, ending
+// with a grade for 0. Returns NULL, or what is wrong with the words.
+const char *parseGradeCutoffs(char **words, int count, GradingScale *scale, int subject) {
+    if (count < 1 || count > GRADE_MAX_CUTOFFS)
+        return "a scale needs 1 to 16 grades";
+    for (int k = 0; k < count; ++k) {
+        const char *word = words[k];
+        int sign = word[1] == '+' ? 0 : word[1] == '-' ? 2 : 1;
+        const char *colon = word + (sign == 1 ? 1 : 2);
+        int min_score;
+        if (!isupper((unsigned char)word[0]) || *colon != ':' || !parseInteger(colon + 1, &min_score))
+            return "grades must look like A:90 or B+:87";
+        if (min_score < 0 || min_score > STATS_MAX_GRADE)
+            return "cutoff scores must be from 0 to 100";
+        int code = (word[0] - 'A') * 3 + sign;
+        if (k > 0 && min_score >= scale->min_scores[subject][k - 1])
+            return "cutoffs must fall from the best grade to the worst";
+        if (memchr(scale->codes[subject], code, k) != NULL)
+            return "each grade may appear once";
+        scale->codes[subject][k] = (unsigned char)code;
+        scale->min_scores[subject][k] = min_score;
+    }
+    if (scale->min_scores[subject][count - 1] != 0)
+        return "the last grade must start at 0";
+    scale->num_cutoffs[subject] = count;
+    gradingScaleCompile(scale);
+    return NULL;
+}
+
+// Writes one subject's cutoffs in the form parseGradeCutoffs reads
+void formatGradeCutoffs(const GradingScale *scale, int subject, char *out) {
+    for (int k = 0; k < scale->num_cutoffs[subject]; ++k) {
+        char name[3];
+        gradeName(scale->codes[subject][k], name);
+        out += sprintf(out, k > 0 ? " %s:%d" : "%s:%d", name, scale->min_scores[subject][k]);
+    }
+}
+
+// Subject names appear unquoted in CSV and JSON output and as command words, so
+// they are printable, without quotes, commas or backslashes, distinct, and
+// different from the sort fields and "all"
+static int subjectNameValid(const char *name, int count) {
+    static const char *reserved[] = { "name", "number", "total", "all" };
+    size_t length = strlen(name);
+    if (length == 0 || length >= SUBJECT_NAME_SIZE || name[0] == ' ' || name[length - 1] == ' ')
+        return 0;
+    for (const char *c = name; *c != '\0'; ++c) {
+        if (!isprint((unsigned char)*c) || strchr("\",\\", *c) != NULL)
+            return 0;
+    }
+    for (size_t k = 0; k < sizeof(reserved) / sizeof(char *); ++k) {
+        if (strcmp(name, reserved[k]) == 0)
+            return 0;
+    }
+    for (int i = 0; i < count; ++i) {
+        if (strcmp(name, subject_names[i]) == 0)
+            return 0;
+    }
+    return 1;
+}
+
+// The schema file names the subjects, one per line, in the order grades are
+// entered, imported and exported; blank lines and lines starting with '#' are
+// skipped. Without one the five default subjects are used. Stored records are
+// sized to the schema, so a snapshot only loads under the subject count it was
+// saved with.
+void loadSchema() {
+    static const char *default_subjects[] = { "Korean", "English", "Math", "Science", "Korean History" };
+    FILE *file = fopen(SCHEMA_FILE, "r");
+    if (file == NULL) {
+        if (errno != ENOENT)
+            storageFailure(SCHEMA_FILE);
+        num_subjects = sizeof(default_subjects) / sizeof(char *);
+        for (int i = 0; i < num_subjects; ++i) {
+            strcpy(subject_names[i], default_subjects[i]);
+        }
+    } else {
+        char line[QUERY_LINE_SIZE];
+        num_subjects = 0;
+        while (fgets(line, sizeof(line), file) != NULL) {
+            line[strcspn(line, "\r\n")] = '\0';
+            if (line[0] == '\0' || line[0] == '#')
+                continue;
+            errno = 0;
+            if (num_subjects == MAX_SUBJECTS || !subjectNameValid(line, num_subjects))
+                storageFailure(SCHEMA_FILE);
+            strcpy(subject_names[num_subjects++], line);
+        }
+        fclose(file);
+        errno = 0;
+        if (num_subjects == 0)
+            storageFailure(SCHEMA_FILE);
+    }
+    student_size = (offsetof(Student, grades) + num_subjects + 3) & ~(size_t)3; // Keeps the next record aligned
+    disk_record_size = sizeof(DiskRecord) + student_size;
+    student_store.arena.block_size = storeChunkBytes() * ARENA_BLOCK_CHUNKS;
+}
+
+// The scale file has a line per subject: its name, a tab, then its cutoffs.
+// Subjects it leaves out keep the default scale, and lines for subjects no
+// longer in the schema are ignored.
+void loadGradingScale() {
+    FILE *file = fopen(SCALE_FILE, "r");
+    if (file == NULL) {
+        if (errno != ENOENT)
+            storageFailure(SCALE_FILE);
+        return;
+    }
+    GradingScale *scale = &grading_scales[0];
+    char line[QUERY_LINE_SIZE];
+    while (fgets(line, sizeof(line), file) != NULL) {
+        char *words[GRADE_MAX_CUTOFFS + 1];
+        char *tab = strchr(line, '\t');
+        int subject = 0;
+        if (tab != NULL) {
+            *tab = '\0';
+            while (subject < num_subjects && strcmp(line, subject_names[subject]) != 0) {
+                ++subject;
+            }
+            if (subject == num_subjects)
+                continue;
+        }
+        int count = 0;
+        char *save;
+        for (char *word = strtok_r(tab ? tab + 1 : line, " \r\n", &save); word != NULL && count <= GRADE_MAX_CUTOFFS; word = strtok_r(NULL, " \r\n", &save)) {
+            words[count++] = word;
+        }
+        errno = 0;
+        if (tab == NULL || parseGradeCutoffs(words, count, scale, subject) != NULL)
+            storageFailure(SCALE_FILE);
+    }
+    fclose(file);
+}
+
+static void saveGradingScale(const GradingScale *scale) {
+    const char *tmp_path = SCALE_FILE ".tmp";
+    FILE *file = fopen(tmp_path, "w");
+    if (file == NULL)
+        storageFailure(tmp_path);
+    for (int i = 0; i < num_subjects; ++i) {
+        char cutoffs[GRADE_MAX_CUTOFFS * 8];
+        formatGradeCutoffs(scale, i, cutoffs);
+        fprintf(file, "%s\t%s\n", subject_names[i], cutoffs);
+    }
+    if (fflush(file) != 0 || fsync(fileno(file)) != 0 || fclose(file) != 0)
+        storageFailure(tmp_path);
+    if (rename(tmp_path, SCALE_FILE) != 0)
+        storageFailure(SCALE_FILE);
+    int dir = open(".", O_RDONLY);
+    if (dir >= 0) {
+        fsync(dir);
+        close(dir);
+    }
+}
+
+// Makes a new scale durable, then swaps it in. Letter grades are looked up
+// from the scale in use rather than stored, so re-grading the roster only
+// recounts the letter grades from the score histograms, and a crash at any
+// point leaves the saved data consistent with whichever scale file survived.
+void setGradingScale(const GradingScale *scale) {
+    GradingScale *next = grading_scale == &grading_scales[0] ? &grading_scales[1] : &grading_scales[0];
+    *next = *scale;
+    saveGradingScale(next);
+    if (!roster_stats_stale)
+        statsRecountLetters(&roster_stats, next);
+    grading_scale = next;
+    StoreVersions *versions = student_store.versions;
+    if (versions != NULL) {
+        // Versions carry the scale they were published with, so readers need a new one
+        pthread_mutex_lock(&versions->lock);
+        versions->latest_stale = 1;
+        pthread_mutex_unlock(&versions->lock);
+    }
+}
+
+void storageFailure(const char *path) {
+    int saved_errno = errno;
+    endwin();
+    fprintf(stderr, "%s: %s\n", path, saved_errno ? strerror(saved_errno) : "corrupt or unreadable data");
+    exit(1);
+}
+
+uint32_t crc32(uint32_t crc, const unsigned char *data, size_t len) {
+    static uint32_t table[256];
+    if (table[1] == 0) {
+        for (uint32_t i = 0; i < 256; ++i) {
+            uint32_t c = i;
+            for (int k = 0; k < 8; ++k)
+                c = c & 1 ? 0xEDB88320u ^ (c >> 1) : c >> 1;
+            table[i] = c;
+        }
+    }
+    crc = ~crc;
+    for (size_t i = 0; i < len; ++i) {
+        crc = table[(crc ^ data[i]) & 0xFF] ^ (crc >> 8);
+    }
+    return ~crc;
+}
+
+static void putU32(unsigned char *buf, uint32_t value) {
+    buf[0] = value;
+    buf[1] = value >> 8;
+    buf[2] = value >> 16;
+    buf[3] = value >> 24;
+}
+
+static uint32_t getU32(const unsigned char *buf) {
+    return buf[0] | (uint32_t)buf[1] << 8 | (uint32_t)buf[2] << 16 | (uint32_t)buf[3] << 24;
+}
+
+// Journal record, little-endian: handle, id, student number, grades (32 bits each,
+// as version 1 snapshots also used it), name length, name bytes.
+// Derived fields are recomputed on load. Returns the encoded size.
+int encodeStudent(unsigned char *buf, int handle, const Student *s) {
+    putU32(buf, handle);
+    putU32(buf + 4, s->id);
+    putU32(buf + 8, s->student_number);
+    for (int i = 0; i < num_subjects; ++i) {
+        putU32(buf + 12 + 4 * i, s->grades[i]);
+    }
+    int offset = 12 + 4 * num_subjects;
+    buf[offset] = s->name_length;
+    memcpy(buf + offset + 1, studentName(s), s->name_length);
+    return offset + 1 + s->name_length;
+}
+
+// Returns the number of bytes consumed, or -1 if buf does not hold a whole valid record.
+// The name is added to the name arena.
+int decodeStudent(const unsigned char *buf, size_t len, int *handle, Student *s) {
+    size_t offset = 12 + 4 * num_subjects;
+    if (len < offset + 1 || buf[offset] >= NAME_SIZE || len < offset + 1 + buf[offset])
+        return -1;
+    *handle = (int)getU32(buf);
+    s->id = (int)getU32(buf + 4);
+    s->student_number = (int)getU32(buf + 8);
+    for (int i = 0; i < num_subjects; ++i) {
+        s->grades[i] = clampGrade((int)getU32(buf + 12 + 4 * i));
+    }
+    char name[NAME_SIZE];
+    memcpy(name, buf + offset + 1, buf[offset]);
+    name[buf[offset]] = '\0';
+    studentSetName(s, name);
+    computeStudentScores(s);
+    if (*handle < 0)
+        return -1;
+    return offset + 1 + buf[offset];
+}
+
+// Journal entry: payload length, CRC-32 of the payload, then the payload
+// (operation byte followed by an encoded record, or just the handle for removals)
+void journalAppend(JournalOp op, int handle, const Student *s) {
+    if (journal.fd < 0)
+        return;
+    unsigned char *entry = journal.buffer + journal.used;
+    unsigned char *payload = entry + 8;
+    payload[0] = op;
+    int payload_len = 1;
+    if (op == JOURNAL_REMOVE) {
+        putU32(payload + 1, handle);
+        payload_len += 4;
+    } else {
+        payload_len += encodeStudent(payload + 1, handle, s);
+    }
+    putU32(entry, payload_len);
+    putU32(entry + 4, crc32(0, payload, payload_len));
+    journal.used += 8 + payload_len;
+    if (journal.used >= JOURNAL_BUFFER_SIZE)
+        journalCommit();
+}
+
+// Empties the journal and stamps it with the generation of the snapshot now on disk
+static void journalReset() {
+    unsigned char header[JOURNAL_HEADER_SIZE];
+    putU32(header, JOURNAL_MAGIC);
+    putU32(header + 4, journal.generation);
+    if (ftruncate(journal.fd, 0) != 0 || write(journal.fd, header, sizeof(header)) != sizeof(header)
+        || fdatasync(journal.fd) != 0)
+        storageFailure(JOURNAL_FILE);
+}
+
+// Writes pending entries and makes them durable with one fsync
+void journalCommit() {
+    if (journal.fd < 0 || journal.used == 0)
+        return;
+    size_t written = 0;
+    while (written < journal.used) {
+        ssize_t n = write(journal.fd, journal.buffer + written, journal.used - written);
+        if (n < 0) {
+            if (errno == EINTR)
+                continue;
+            storageFailure(JOURNAL_FILE);
+        }
+        written += n;
+    }
+    if (fdatasync(journal.fd) != 0)
+        storageFailure(JOURNAL_FILE);
+    journal.used = 0;
+}
+
+static unsigned char *readWholeFile(const char *path, size_t *size) {
+    FILE *file = fopen(path, "rb");
+    if (file == NULL) {
+        if (errno == ENOENT)
+            return NULL;
+        storageFailure(path);
+    }
+    fseek(file, 0, SEEK_END);
+    long length = ftell(file);
+    fseek(file, 0, SEEK_SET);
+    unsigned char *data = malloc(length > 0 ? length : 1);
+    if (data == NULL)
+        outOfMemory();
+    if (length < 0 || fread(data, 1, length, file) != (size_t)length)
+        storageFailure(path);
+    fclose(file);
+    *size = length;
+    return data;
+}
+
+// Version 1 snapshots are parsed record by record into the store
+static void loadSnapshotV1() {
+    size_t size;
+    unsigned char *data = readWholeFile(SNAPSHOT_FILE, &size);
+    errno = 0;
+    if (data == NULL || size < SNAPSHOT_V1_HEADER_SIZE
+        || crc32(0, data + SNAPSHOT_V1_HEADER_SIZE, size - SNAPSHOT_V1_HEADER_SIZE) != getU32(data + 16))
+        storageFailure(SNAPSHOT_FILE);
+    uint32_t count = getU32(data + 8);
+    int next_handle = (int)getU32(data + 12);
+    size_t offset = SNAPSHOT_V1_HEADER_SIZE;
+    for (uint32_t i = 0; i < count; ++i) {
+        Student s;
+        int handle;
+        int used = decodeStudent(data + offset, size - offset, &handle, &s);
+        if (used < 0 || handle < student_store.next_handle)
+            storageFailure(SNAPSHOT_FILE);
+        storeAppendWithHandle(&student_store, &s, handle);
+        offset += used;
+    }
+    if (next_handle > student_store.next_handle)
+        student_store.next_handle = next_handle;
+    free(data);
+}
+
+// Checks the header of a version 2 or later snapshot with records of record_size
+// bytes, then maps the whole file read-only
+static const char *mapSnapshotFile(int fd, size_t size, uint32_t version, size_t record_size, SnapshotHeader *header) {
+    errno = 0;
+    if (size < SNAPSHOT_PAGE_SIZE || pread(fd, header, sizeof(*header), 0) != sizeof(*header))
+        storageFailure(SNAPSHOT_FILE);
+    if (header->magic == SNAPSHOT_MAGIC && header->version == version && header->record_size != record_size) {
+        fprintf(stderr, "%s: saved with a different number of subjects than %s names\n", SNAPSHOT_FILE, SCHEMA_FILE);
+        exit(1);
+    }
+    if (header->magic != SNAPSHOT_MAGIC || header->version != version || header->byte_order != SNAPSHOT_BYTE_ORDER
+        || header->record_size != record_size || header->count > INT32_MAX || header->next_handle > INT32_MAX
+        || header->header_crc != crc32(0, (const unsigned char *)header, offsetof(SnapshotHeader, header_crc))
+        || header->records_offset + (uint64_t)header->count * record_size > header->heap_offset
+        || header->heap_offset + header->heap_size > size || header->heap_size > (uint64_t)NAME_MAX_BLOCKS << NAME_BLOCK_BITS)
+        storageFailure(SNAPSHOT_FILE);
+    const char *base = mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+    if (base == MAP_FAILED)
+        storageFailure(SNAPSHOT_FILE);
+    return base;
+}
+
+// Version 2 records held int32_t grades and had their names packed end to end,
+// so they are converted record by record into the store
+static void loadSnapshotV2(int fd, size_t size) {
+    SnapshotHeader header;
+    size_t record_size = sizeof(int32_t) * (4 + num_subjects) + 4; // Handle, id, number, name offset, grades, name length
+    const char *base = mapSnapshotFile(fd, size, 2, record_size, &header);
+    const unsigned char *records = (const unsigned char *)base + header.records_offset;
+    const char *heap = base + header.heap_offset;
+    for (uint32_t i = 0; i < header.count; ++i) {
+        const int32_t *fields = (const int32_t *)(records + (size_t)i * record_size);
+        int handle = fields[0];
+        uint32_t name_offset = fields[3];
+        uint8_t name_length = *(const uint8_t *)&fields[4 + num_subjects];
+        if (handle < student_store.next_handle || name_length >= NAME_SIZE || name_offset + (uint64_t)name_length > header.heap_size) {
+            errno = 0;
+            storageFailure(SNAPSHOT_FILE);
+        }
+        Student s;
+        char name[NAME_SIZE];
+        s.id = fields[1];
+        s.student_number = fields[2];
+        for (int j = 0; j < num_subjects; ++j) {
+            s.grades[j] = clampGrade(fields[4 + j]);
+        }
+        memcpy(name, heap + name_offset, name_length);
+        name[name_length] = '\0';
+        studentSetName(&s, name);
+        computeStudentScores(&s);
+        storeAppendWithHandle(&student_store, &s, handle);
+    }
+    if ((int)header.next_handle > student_store.next_handle)
+        student_store.next_handle = header.next_handle;
+    munmap((void *)base, size);
+}
+
+// Current snapshots are mapped and used in place: only the header is read here,
+// records are copied into the store a chunk at a time when first touched
+static void mapSnapshot(int fd, size_t size) {
+    SnapshotHeader header;
+    const char *base = mapSnapshotFile(fd, size, SNAPSHOT_VERSION, disk_record_size, &header);
+
+    StudentStore *store = &student_store;
+    store->mapped_records = (const unsigned char *)base + header.records_offset;
+    store->mapped_heap = base + header.heap_offset;
+    store->mapped_heap_size = header.heap_size;
+    nameArenaMap(&name_arena, store->mapped_heap, header.heap_size);
+    store->count = header.count;
+    store->slots = header.count;
+    store->num_chunks = (store->count + STORE_CHUNK_SIZE - 1) / STORE_CHUNK_SIZE;
+    store->chunk_capacity = store->num_chunks > 16 ? store->num_chunks : 16;
+    store->chunks = calloc(store->chunk_capacity, sizeof(StudentChunk *));
+    store->chunk_live = malloc(store->chunk_capacity * sizeof(int));
+    if (store->chunks == NULL || store->chunk_live == NULL)
+        outOfMemory();
+    for (int c = 0; c < store->num_chunks; ++c) {
+        store->chunk_live[c] = c < store->num_chunks - 1 ? STORE_CHUNK_SIZE : store->count - c * STORE_CHUNK_SIZE;
+    }
+    store->next_handle = header.next_handle;
+    store->handle_map_stale = 1;
+    journal.generation = header.generation;
+}
+
+// Loads the snapshot, replays the journal on top of it, then opens the journal for appends
+void loadStudents() {
+    // One process owns the data at a time; others must go through its --serve socket.
+    // The journal stays closed to appends until it has been replayed.
+    int journal_fd = open(JOURNAL_FILE, O_WRONLY | O_CREAT | O_APPEND, 0644);
+    if (journal_fd < 0)
+        storageFailure(JOURNAL_FILE);
+    if (flock(journal_fd, LOCK_EX | LOCK_NB) != 0) {
+        if (errno != EWOULDBLOCK)
+            storageFailure(JOURNAL_FILE);
+        fprintf(stderr, "%s: in use by another process; if it is serving, connect with --socket\n", JOURNAL_FILE);
+        exit(1);
+    }
+
+    int fd = open(SNAPSHOT_FILE, O_RDONLY);
+    if (fd >= 0) {
+        unsigned char start[8];
+        struct stat info;
+        errno = 0;
+        if (fstat(fd, &info) != 0 || pread(fd, start, sizeof(start), 0) != sizeof(start))
+            storageFailure(SNAPSHOT_FILE);
+        if (getU32(start) == SNAPSHOT_MAGIC && getU32(start + 4) == 1)
+            loadSnapshotV1();
+        else if (getU32(start) == SNAPSHOT_MAGIC && getU32(start + 4) == 2)
+            loadSnapshotV2(fd, info.st_size);
+        else
+            mapSnapshot(fd, info.st_size);
+        close(fd); // A mapping stays valid after its descriptor is closed
+        number_index_stale = 1;
+        roster_indexes_stale = 1;
+        roster_stats_stale = 1;
+        rank_indexes_stale = 1;
+    } else if (errno != ENOENT) {
+        storageFailure(SNAPSHOT_FILE);
+    }
+
+    // Replay the journal; a torn or corrupt tail from a crash is cut off. A journal
+    // stamped for an older snapshot was already folded into this one by a save that
+    // stopped before emptying it. Journals from before the stamp have no header.
+    size_t size;
+    unsigned char *data = readWholeFile(JOURNAL_FILE, &size);
+    int stamped = data != NULL && size >= JOURNAL_HEADER_SIZE && getU32(data) == JOURNAL_MAGIC;
+    int current = stamped && getU32(data + 4) == journal.generation;
+    size_t valid = stamped ? JOURNAL_HEADER_SIZE : 0;
+    if (data != NULL && (current || !stamped)) {
+        while (size - valid >= 8) {
+            uint32_t payload_len = getU32(data + valid);
+            const unsigned char *payload = data + valid + 8;
+            if (payload_len < 5 || payload_len > size - valid - 8 || crc32(0, payload, payload_len) != getU32(data + valid + 4))
+                break;
+            Student s;
+            int handle = (int)getU32(payload + 1);
+            int applied = 0;
+            if (payload[0] == JOURNAL_REMOVE) {
+                applied = storePositionOf(&student_store, handle) >= 0;
+                if (applied)
+                    rosterRemove(handle);
+            } else if (payload[0] == JOURNAL_ADD || payload[0] == JOURNAL_UPDATE) {
+                applied = decodeStudent(payload + 1, payload_len - 1, &handle, &s) == (int)payload_len - 1;
+                if (applied && payload[0] == JOURNAL_ADD)
+                    applied = handle == student_store.next_handle && rosterInsert(&s) == handle;
+                else if (applied)
+                    applied = storePositionOf(&student_store, handle) >= 0 && rosterUpdate(handle, &s) == handle;
+            }
+            // An intact entry that does not apply was logged under another schema or
+            // against other data; cutting it off would drop the committed entries after it
+            if (!applied) {
+                errno = 0;
+                storageFailure(JOURNAL_FILE);
+            }
+            valid += 8 + payload_len;
+        }
+    }
+    free(data);
+
+    journal.fd = journal_fd;
+    if (!stamped && valid > 0)
+        saveStudents(); // Moves the replayed changes into a snapshot, then stamps the journal
+    else if (!current)
+        journalReset();
+    else if (valid < size && ftruncate(journal.fd, valid) != 0)
+        storageFailure(JOURNAL_FILE);
+}
+
+// Names of the snapshot being written, each kept once: maps the arena offset of
+// the first record with a name to where the name went in the new heap
+typedef struct {
+    uint32_t from; // Arena offset plus one, 0 for an empty slot
+    uint32_t to;
+} SavedName;
+
+// Heap offset of a record's name, which is written out unless an equal one already was.
+// Like the arena, the heap keeps every name NUL-terminated within one block.
+static uint32_t saveName(SavedName *saved, uint32_t mask, const Student *s, FILE *heap, uint64_t *heap_size) {
+    static const char zeros[NAME_SIZE];
+    const char *name = studentName(s);
+    uint32_t i = nameHash(name, s->name_length) & mask;
+    for (; saved[i].from != 0; i = (i + 1) & mask) {
+        const char *other = nameArenaAt(&name_arena, saved[i].from - 1);
+        if (saved[i].from - 1 == s->name_offset || strcmp(other, name) == 0)
+            return saved[i].to;
+    }
+    uint64_t room = NAME_BLOCK_SIZE - (*heap_size & (NAME_BLOCK_SIZE - 1));
+    if (room < s->name_length + 1u) {
+        if (fwrite(zeros, 1, room, heap) != room)
+            return UINT32_MAX;
+        *heap_size += room;
+    }
+    if (fwrite(name, 1, s->name_length + 1u, heap) != s->name_length + 1u)
+        return UINT32_MAX;
+    saved[i].from = s->name_offset + 1;
+    saved[i].to = *heap_size;
+    *heap_size += s->name_length + 1u;
+    return saved[i].to;
+}
+
+// Writes a new snapshot next to the old one, swaps it in atomically, then empties the journal.
+// A crash in between leaves a journal stamped for the old snapshot, which the next start skips.
+// Chunks never touched since loading are copied straight from the old mapping.
+void saveStudents() {
+    journalCommit();
+    StudentStore *store = &student_store;
+    const char *tmp_path = SNAPSHOT_FILE ".tmp";
+    SnapshotHeader header = {0};
+    header.magic = SNAPSHOT_MAGIC;
+    header.version = SNAPSHOT_VERSION;
+    header.byte_order = SNAPSHOT_BYTE_ORDER;
+    header.record_size = disk_record_size;
+    header.count = store->count;
+    header.next_handle = store->next_handle;
+    header.generation = journal.generation + 1;
+    header.records_offset = SNAPSHOT_PAGE_SIZE;
+    header.heap_offset = header.records_offset + (uint64_t)store->count * disk_record_size;
+    header.heap_offset = (header.heap_offset + SNAPSHOT_PAGE_SIZE - 1) / SNAPSHOT_PAGE_SIZE * SNAPSHOT_PAGE_SIZE;
+
+    // Records and names go to two regions of the same file through separate streams
+    FILE *records = fopen(tmp_path, "wb");
+    FILE *heap = records ? fopen(tmp_path, "r+b") : NULL;
+    if (heap == NULL || fseek(records, header.records_offset, SEEK_SET) != 0 || fseek(heap, header.heap_offset, SEEK_SET) != 0)
+        storageFailure(tmp_path);
+    uint32_t capacity = NAME_INTERN_MIN_CAPACITY;
+    while (capacity < 2 * (uint32_t)store->count)
+        capacity *= 2;
+    SavedName *saved = calloc(capacity, sizeof(SavedName));
+    if (saved == NULL)
+        outOfMemory();
+    int32_t buffer[(sizeof(DiskRecord) + sizeof(Student) + 3) / 4];
+    DiskRecord *record = (DiskRecord *)buffer;
+    Student *s = (Student *)record->student;
+    size_t used = offsetof(Student, grades) + num_subjects;
+    for (int pos = storeNextLive(store, 0); pos < store->slots; pos = storeNextLive(store, pos + 1)) {
+        if (store->chunks[pos / STORE_CHUNK_SIZE] == NULL) {
+            memcpy(record, storeMappedRecord(store, pos), disk_record_size);
+            storeMappedHandle(store, pos);
+            storeCheckMappedName(store, s);
+        } else {
+            record->handle = storeHandleAt(store, pos);
+            studentCopy(s, storeAt(store, pos));
+        }
+        memset(record->student + used, 0, student_size - used); // Padding
+        s->name_offset = saveName(saved, capacity - 1, s, heap, &header.heap_size);
+        if (s->name_offset == UINT32_MAX || fwrite(record, disk_record_size, 1, records) != 1)
+            storageFailure(tmp_path);
+    }
+    free(saved);
+    header.header_crc = crc32(0, (const unsigned char *)&header, offsetof(SnapshotHeader, header_crc));
+    if (fflush(heap) != 0 || fclose(heap) != 0)
+        storageFailure(tmp_path);
+    if (fseek(records, 0, SEEK_SET) != 0 || fwrite(&header, sizeof(header), 1, records) != 1)
+        storageFailure(tmp_path);
+    if (fflush(records) != 0 || fsync(fileno(records)) != 0 || fclose(records) != 0)
+        storageFailure(tmp_path);
+    if (rename(tmp_path, SNAPSHOT_FILE) != 0)
+        storageFailure(SNAPSHOT_FILE);
+    int dir = open(".", O_RDONLY);
+    if (dir >= 0) {
+        fsync(dir); // Make the rename itself durable
+        close(dir);
+    }
+    journal.generation = header.generation;
+    if (journal.fd >= 0)
+        journalReset();
+    nameArenaForget(&name_arena); // Bounds the intern table; the next save shares names anyway
+}
+
+// Rows parsed from one slice of an import window, by one thread
+typedef struct {
+    const char *begin;
+    const char *end;
+    long first_line; // Line number of begin in the file
+    Student *rows; // Named once inserted, as only the writer adds names
+    char (*names)[NAME_SIZE];
+    long *row_lines;
+    long num_rows;
+    long rejected;
+    int num_messages;
+    char messages[IMPORT_MAX_MESSAGES][96];
+} ImportSlice;
+
+// Copies the field at *cursor into out, unquoting "..." fields; stops at the next
+// comma or the end of the line. Returns -1 if it does not fit or a quote is unbalanced.
+static int readCsvField(const char **cursor, const char *end, char *out, size_t out_size) {
+    const char *p = *cursor;
+    size_t len = 0;
+    if (p < end && *p == '"') {
+        for (++p; ; ) {
+            char c;
+            if (p >= end)
+                return -1;
+            if (*p == '"' && p + 1 < end && p[1] == '"') {
+                c = '"';
+                p += 2;
+            } else if (*p == '"') {
+                ++p;
+                break;
+            } else {
+                c = *p++;
+            }
+            if (len + 1 >= out_size)
+                return -1;
+            out[len++] = c;
+        }
+        if (p < end && *p != ',')
+            return -1;
+    } else {
+        while (p < end && *p != ',') {
+            if (len + 1 >= out_size)
+                return -1;
+            out[len++] = *p++;
+        }
+    }
+    out[len] = '\0';
+    *cursor = p;
+    return len;
+}
+
+// Parses "student number,name,grade,...": one grade per subject, integers validated
+// like getIntegerInput and grades like getGradeInput. The name is left in name.
+// Returns NULL on success or a description of the problem.
+static const char *parseCsvRow(const char *line, const char *end, Student *s, char *name) {
+    char field[NAME_SIZE];
+    const char *p = line;
+    for (int f = 0; f < 2 + num_subjects; ++f) {
+        if (f > 0) {
+            if (p >= end || *p != ',')
+                return "too few fields";
+            ++p;
+        }
+        int is_name = f == 1;
+        if (readCsvField(&p, end, field, is_name ? NAME_SIZE : sizeof(field)) < 0)
+            return is_name ? "name too long or badly quoted" : "invalid integer";
+        if (is_name) {
+            strcpy(name, field);
+        } else if (f == 0 ? !parseInteger(field, &s->student_number) : !parseGrade(field, &s->grades[f - 2])) {
+            return f == 0 ? "invalid student number" : "invalid grade";
+        }
+    }
+    if (p != end)
+        return "too many fields";
+    computeStudentScores(s);
+    return NULL;
+}
+
+// Parses slice number part of a window; slices run on the pool
+static void parseImportSlice(void *context, int part, int worker) {
+    (void)worker;
+    ImportSlice *slice = (ImportSlice *)context + part;
+    long capacity = (slice->end - slice->begin) / 16 + 16; // Rows are rarely shorter
+    slice->rows = malloc(capacity * sizeof(Student));
+    slice->names = malloc(capacity * NAME_SIZE);
+    slice->row_lines = malloc(capacity * sizeof(long));
+    if (slice->rows == NULL || slice->names == NULL || slice->row_lines == NULL)
+        outOfMemory();
+    long line_number = slice->first_line;
+    for (const char *line = slice->begin; line < slice->end; ++line_number) {
+        const char *newline = memchr(line, '\n', slice->end - line);
+        const char *next = newline ? newline + 1 : slice->end;
+        const char *end = newline ? newline : slice->end;
+        if (end > line && end[-1] == '\r')
+            --end;
+        if (end > line) {
+            if (slice->num_rows == capacity) {
+                capacity *= 2;
+                slice->rows = realloc(slice->rows, capacity * sizeof(Student));
+                slice->names = realloc(slice->names, capacity * NAME_SIZE);
+                slice->row_lines = realloc(slice->row_lines, capacity * sizeof(long));
+                if (slice->rows == NULL || slice->names == NULL || slice->row_lines == NULL)
+                    outOfMemory();
+            }
+            Student *s = &slice->rows[slice->num_rows];
+            const char *error = parseCsvRow(line, end, s, slice->names[slice->num_rows]);
+            if (error == NULL) {
+                slice->row_lines[slice->num_rows++] = line_number;
+            } else {
+                if (slice->num_messages < IMPORT_MAX_MESSAGES)
+                    snprintf(slice->messages[slice->num_messages++], sizeof(slice->messages[0]), "Line %ld: %s", line_number, error);
+                slice->rejected++;
+            }
+        }
+        line = next;
+    }
+}
+
+static long countLines(const char *begin, const char *end) {
+    long lines = 0;
+    while (begin < end && (begin = memchr(begin, '\n', end - begin)) != NULL) {
+        ++lines;
+        ++begin;
+    }
+    return lines;
+}
+
+static void reportImportProblem(ImportReport *report, const char *message) {
+    if (report->num_messages < IMPORT_MAX_MESSAGES)
+        snprintf(report->messages[report->num_messages++], sizeof(report->messages[0]), "%s", message);
+}
+
+// Streams a CSV file into the roster: each window of the file is split at line
+// boundaries, parsed by several threads, then inserted and committed as one batch.
+// Returns -1 (with errno set) if the file cannot be read.
+int importCsv(const char *path, ImportReport *report) {
+    memset(report, 0, sizeof(*report));
+    int fd = open(path, O_RDONLY);
+    if (fd < 0)
+        return -1;
+    struct stat info;
+    if (fstat(fd, &info) != 0) {
+        close(fd);
+        return -1;
+    }
+    size_t size = info.st_size;
+    if (size == 0) {
+        close(fd);
+        return 0;
+    }
+    const char *data = mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (data == MAP_FAILED)
+        return -1;
+    madvise((void *)data, size, MADV_SEQUENTIAL);
+    const char *end = data + size;
+
+    // Large imports leave the sort and name indexes to one bulk rebuild afterwards
+    long estimated_rows = size / 24;
+    rosterEnsureNumberIndex();
+    if (estimated_rows >= IMPORT_DEFER_ROWS && estimated_rows >= student_store.count / 4)
+        roster_indexes_stale = 1;
+
+    // A first line that does not start with a student number is a header
+    const char *p = data;
+    long line_number = 1;
+    int value;
+    char field[NAME_SIZE];
+    const char *first = p;
+    const char *first_end = memchr(p, '\n', end - p);
+    if (first_end == NULL)
+        first_end = end;
+    if (readCsvField(&first, first_end, field, sizeof(field)) < 0 || !parseInteger(field, &value)) {
+        p = first_end < end ? first_end + 1 : end;
+        line_number = 2;
+    }
+
+    long num_threads = poolThreads();
+    ImportSlice slices[POOL_MAX_THREADS];
+    while (p < end) {
+        // Cut the next window at a line boundary
+        const char *window_end = end - p > IMPORT_WINDOW_SIZE ? p + IMPORT_WINDOW_SIZE : end;
+        if (window_end < end) {
+            const char *newline = memchr(window_end, '\n', end - window_end);
+            window_end = newline ? newline + 1 : end;
+        }
+        long parts = (window_end - p) / IMPORT_MIN_SLICE;
+        if (parts < 1)
+            parts = 1;
+        if (parts > num_threads)
+            parts = num_threads;
+        const char *slice_begin = p;
+        for (long t = 0; t < parts; ++t) {
+            const char *slice_end = t == parts - 1 ? window_end : slice_begin + (window_end - p) / parts;
+            if (slice_end < window_end) {
+                const char *newline = memchr(slice_end, '\n', window_end - slice_end);
+                slice_end = newline ? newline + 1 : window_end;
+            }
+            memset(&slices[t], 0, sizeof(slices[t]));
+            slices[t].begin = slice_begin;
+            slices[t].end = slice_end;
+            slice_begin = slice_end;
+        }
+        // Line numbers of later slices depend on the lines before them
+        for (long t = 0; t < parts; ++t) {
+            slices[t].first_line = line_number;
+            line_number += countLines(slices[t].begin, slices[t].end);
+        }
+        poolRun(parts, parseImportSlice, slices);
+
+        // Insert in file order, then make the whole batch durable at once
+        for (long t = 0; t < parts; ++t) {
+            ImportSlice *slice = &slices[t];
+            for (int m = 0; m < slice->num_messages; ++m) {
+                reportImportProblem(report, slice->messages[m]);
+            }
+            report->rejected += slice->rejected;
+            for (long r = 0; r < slice->num_rows; ++r) {
+                Student *s = &slice->rows[r];
+                studentSetName(s, slice->names[r]);
+                if (rosterAdd(s) >= 0) {
+                    report->imported++;
+                } else {
+                    char message[96];
+                    snprintf(message, sizeof(message), "Line %ld: student number %d is already registered", slice->row_lines[r], s->student_number);
+                    reportImportProblem(report, message);
+                    report->rejected++;
+                }
+            }
+            free(slice->rows);
+            free(slice->names);
+            free(slice->row_lines);
+        }
+        journalCommit();
+        p = window_end;
+    }
+    munmap((void *)data, size);
+
+    // Fold the batch into the snapshot so the next start does not replay it
+    if (report->imported > 0)
+        saveStudents();
+    return 0;
+}
+
+void importScreen() {
+    echo();
+    curs_set(1);
+    erase();
+    int rows, cols;
+    getmaxyx(stdscr, rows, cols);
+
+    // Draw border
+    box(stdscr, 0, 0);
+
+    // Title
+    attron(COLOR_PAIR(2) | A_BOLD);
+    mvprintw(1, (cols - strlen("Import from CSV"))/2, "Import from CSV");
+    attroff(COLOR_PAIR(2) | A_BOLD);
+
+    mvhline(2, 1, ACS_HLINE, cols - 2);
+
+    int start_row = 4;
+    mvprintw(start_row, 2, "Columns: student number, name, then one grade per subject.");
+    move(start_row + 2, 0);
+    char path[256];
+    getStringInput("CSV File: ", path, sizeof(path));
+    noecho();
+    curs_set(0);
+
+    mvprintw(start_row + 4, 2, "Importing...");
+    refresh();
+    ImportReport report;
+    if (importCsv(path, &report) != 0) {
+        mvprintw(start_row + 4, 2, "Cannot read %s: %s", path, strerror(errno));
+    } else {
+        mvprintw(start_row + 4, 2, "Imported %ld students, rejected %ld rows.", report.imported, report.rejected);
+        for (int i = 0; i < report.num_messages; ++i) {
+            mvprintw(start_row + 6 + i, 4, "%s", report.messages[i]);
+        }
+    }
+    attron(A_DIM);
+    mvprintw(rows - 2, 2, "Press Enter to return to the menu.");
+    attroff(A_DIM);
+    getch();
+}
+
+// Buffered output: rows are formatted straight into the buffer, which is written
+// out whenever it fills, so memory use does not depend on the export size. A
+// framed writer answers a client of --serve instead: output goes out in chunks,
+// each after a FRAME_HEADER_SIZE header giving its length in hex, and every
+// answer ends with a line of "." or of "!" and an error message.
+typedef struct {
+    int fd;
+    int failed; // errno of the first failed write, 0 if none
+    int framed; // Writes chunks for a client of --serve
+    long frame; // Offset of the open chunk's header, -1 if none is open
+    const GradingScale *scale; // Letter grades are written in this scale, or in the one in use if NULL
+    size_t used;
+    char buffer[EXPORT_BUFFER_SIZE];
+} ExportWriter;
+
+// Fills in the header of the open chunk, or drops the chunk if it is empty
+static void exportCloseFrame(ExportWriter *writer) {
+    if (writer->frame < 0)
+        return;
+    size_t length = writer->used - writer->frame - FRAME_HEADER_SIZE;
+    if (length == 0) {
+        writer->used = writer->frame;
+    } else {
+        char header[FRAME_HEADER_SIZE + 1];
+        snprintf(header, sizeof(header), "%08x\n", (unsigned)length); // Chunks are under EXPORT_BUFFER_SIZE
+        memcpy(writer->buffer + writer->frame, header, FRAME_HEADER_SIZE);
+    }
+    writer->frame = -1;
+}
+
+static void exportFlush(ExportWriter *writer) {
+    exportCloseFrame(writer);
+    size_t done = 0;
+    while (done < writer->used && !writer->failed) {
+        ssize_t n = write(writer->fd, writer->buffer + done, writer->used - done);
+        if (n < 0 && errno != EINTR)
+            writer->failed = errno;
+        else if (n > 0)
+            done += n;
+    }
+    writer->used = 0;
+}
+
+// Room for at least size more bytes at the end of the buffer
+static char *exportReserve(ExportWriter *writer, size_t size) {
+    if (writer->used + size + FRAME_HEADER_SIZE > EXPORT_BUFFER_SIZE)
+        exportFlush(writer);
+    if (writer->framed && writer->frame < 0) {
+        writer->frame = writer->used;
+        writer->used += FRAME_HEADER_SIZE;
+    }
+    return writer->buffer + writer->used;
+}
+
+// Ends an answer of a framed writer, successful if error is NULL
+static void exportEndAnswer(ExportWriter *writer, const char *error) {
+    exportCloseFrame(writer);
+    size_t length = error ? strlen(error) + 2 : 2;
+    if (writer->used + length > EXPORT_BUFFER_SIZE)
+        exportFlush(writer);
+    sprintf(writer->buffer + writer->used, "%s%s\n", error ? "!" : ".", error ? error : "");
+    writer->used += length;
+}
+
+static char *formatInt(char *out, int value) {
+    char digits[12];
+    int n = 0;
+    unsigned magnitude = value < 0 ? 0u - (unsigned)value : (unsigned)value;
+    do {
+        digits[n++] = '0' + magnitude % 10;
+        magnitude /= 10;
+    } while (magnitude != 0);
+    if (value < 0)
+        *out++ = '-';
+    while (n > 0) {
+        *out++ = digits[--n];
+    }
+    return out;
+}
+
+// Same columns importCsv reads, so an export can be imported again
+static void exportCsvRow(ExportWriter *writer, const Student *s) {
+    char *start = exportReserve(writer, 2 * NAME_SIZE + 12 * (1 + num_subjects) + 4);
+    char *out = formatInt(start, s->student_number);
+    *out++ = ',';
+    int quote = studentName(s)[0] == ' ' || strpbrk(studentName(s), ",\"\r\n") != NULL;
+    if (quote)
+        *out++ = '"';
+    for (const char *c = studentName(s); *c != '\0'; ++c) {
+        if (*c == '"')
+            *out++ = '"';
+        *out++ = *c;
+    }
+    if (quote)
+        *out++ = '"';
+    for (int i = 0; i < num_subjects; ++i) {
+        *out++ = ',';
+        out = formatInt(out, s->grades[i]);
+    }
+    *out++ = '\n';
+    writer->used += out - start;
+}
+
+static char *appendText(char *out, const char *text) {
+    size_t length = strlen(text);
+    memcpy(out, text, length);
+    return out + length;
+}
+
+static void exportJsonRow(ExportWriter *writer, const Student *s) {
+    char *start = exportReserve(writer, 6 * NAME_SIZE + (2 * SUBJECT_NAME_SIZE + 32) * num_subjects + 160);
+    char *out = appendText(start, "{\"id\":");
+    out = formatInt(out, s->id);
+    out = appendText(out, ",\"student_number\":");
+    out = formatInt(out, s->student_number);
+    out = appendText(out, ",\"name\":\"");
+    for (const unsigned char *c = (const unsigned char *)studentName(s); *c != '\0'; ++c) {
+        if (*c == '"' || *c == '\\') {
+            *out++ = '\\';
+            *out++ = *c;
+        } else if (*c < 0x20) {
+            out += sprintf(out, "\\u%04x", *c);
+        } else {
+            *out++ = *c;
+        }
+    }
+    out = appendText(out, "\",\"grades\":{");
+    for (int i = 0; i < num_subjects; ++i) {
+        if (i > 0)
+            *out++ = ',';
+        *out++ = '"';
+        out = appendText(out, subject_names[i]);
+        out = appendText(out, "\":");
+        out = formatInt(out, s->grades[i]);
+    }
+    out = appendText(out, "},\"letter_grades\":{");
+    const GradingScale *scale = writer->scale != NULL ? writer->scale : grading_scale;
+    for (int i = 0; i < num_subjects; ++i) {
+        if (i > 0)
+            *out++ = ',';
+        *out++ = '"';
+        out = appendText(out, subject_names[i]);
+        out = appendText(out, "\":\"");
+        char grade[3];
+        gradeName(scaleLetterGrade(scale, i, s->grades[i]), grade);
+        out = appendText(out, grade);
+        *out++ = '"';
+    }
+    out = appendText(out, "},\"total_score\":");
+    out = formatInt(out, s->total_score);
+    // Average to two decimals, rounded half away from zero
+    double scaled = studentAverage(s) * 100;
+    long long cents = scaled < 0 ? -(long long)(0.5 - scaled) : (long long)(scaled + 0.5);
+    long long magnitude = cents < 0 ? -cents : cents;
+    out = appendText(out, ",\"average\":");
+    if (cents < 0)
+        *out++ = '-';
+    out = formatInt(out, (int)(magnitude / 100));
+    *out++ = '.';
+    *out++ = '0' + magnitude / 10 % 10;
+    *out++ = '0' + magnitude % 10;
+    out = appendText(out, "}\n");
+    writer->used += out - start;
+}
+
+static long exportRow(ExportWriter *writer, ExportFormat format, const ExportFilter *filter, const Student *s) {
+    if (filter != NULL) {
+        if (s->total_score < filter->min_total || s->total_score > filter->max_total)
+            return 0;
+        if (filter->name[0] != '\0' && !containsIgnoreCase(studentName(s), filter->name))
+            return 0;
+    }
+    if (format == EXPORT_CSV)
+        exportCsvRow(writer, s);
+    else
+        exportJsonRow(writer, s);
+    return 1;
+}
+
+static ExportWriter *exportOpen(int fd) {
+    ExportWriter *writer = malloc(sizeof(ExportWriter));
+    if (writer == NULL)
+        outOfMemory();
+    writer->fd = fd;
+    writer->failed = 0;
+    writer->framed = 0;
+    writer->frame = -1;
+    writer->scale = NULL;
+    writer->used = 0;
+    return writer;
+}
+
+// Flushes and frees the writer; returns the errno of the first failed write, or 0
+static int exportClose(ExportWriter *writer) {
+    exportFlush(writer);
+    int error = writer->failed;
+    free(writer);
+    return error;
+}
+
+// CSV column line; JSON Lines needs none
+static void exportHeader(ExportWriter *writer, ExportFormat format) {
+    if (format != EXPORT_CSV)
+        return;
+    char *out = exportReserve(writer, 32 + (SUBJECT_NAME_SIZE + 1) * num_subjects);
+    int length = sprintf(out, "student_number,name");
+    for (int i = 0; i < num_subjects; ++i) {
+        length += sprintf(out + length, ",%s", subject_names[i]);
+    }
+    out[length++] = '\n';
+    writer->used += length;
+}
+
+// Writes every record passing filter, in registration order or in index order
+// when order is given. Records are read in place: store order decodes mapped
+// records without loading them, and index order walks the tree directly.
+// Subjects have no index, so their orders sort the handles first.
+static long exportWalk(ExportWriter *writer, ExportFormat format, const SortKey *order, const ExportFilter *filter) {
+    long written = 0;
+    if (order == NULL) {
+        Student scratch;
+        for (int pos = storeNextLive(&student_store, 0); pos < student_store.slots; pos = storeNextLive(&student_store, pos + 1)) {
+            written += exportRow(writer, format, filter, storePeek(&student_store, pos, &scratch));
+        }
+        return written;
+    }
+    if (order->field >= SORT_BY_SUBJECT) {
+        int count = student_store.count;
+        int *handles = malloc((count ? count : 1) * sizeof(int));
+        if (handles == NULL)
+            outOfMemory();
+        storeListHandles(&student_store, handles);
+        sortHandles(handles, count, order, 1);
+        for (int i = 0; i < count; ++i) {
+            written += exportRow(writer, format, filter, storeByHandle(&student_store, handles[i]));
+        }
+        free(handles);
+        return written;
+    }
+    // In-order walk with an explicit stack; descending mirrors it
+    rosterEnsureIndexes();
+    const SortIndex *index = &sort_indexes[order->field];
+    int stack[INDEX_MAX_DEPTH];
+    int depth = 0;
+    int n = index->root;
+    while (n >= 0 || depth > 0) {
+        while (n >= 0) {
+            stack[depth++] = n;
+            n = order->order > 0 ? index->nodes[n].left : index->nodes[n].right;
+        }
+        n = stack[--depth];
+        written += exportRow(writer, format, filter, storeByHandle(&student_store, n));
+        n = order->order > 0 ? index->nodes[n].right : index->nodes[n].left;
+    }
+    return written;
+}
+
+// Writes the roster to path ("-" for standard output), see exportWalk.
+// Returns the number of rows written, or -1 with errno set.
+long exportStudents(const char *path, ExportFormat format, const SortKey *order, const ExportFilter *filter) {
+    int to_stdout = strcmp(path, "-") == 0;
+    int fd = to_stdout ? STDOUT_FILENO : open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0)
+        return -1;
+    ExportWriter *writer = exportOpen(fd);
+    exportHeader(writer, format);
+    long written = exportWalk(writer, format, order, filter);
+    int error = exportClose(writer);
+    if (!to_stdout && close(fd) != 0 && error == 0)
+        error = errno;
+    if (error != 0) {
+        errno = error;
+        return -1;
+    }
+    return written;
+}
+
+// Formats an order statistic, marking values beyond the histogram of the column
+static const char *formatStatValue(char *buf, int column, int value) {
+    if (value == STATS_BELOW_RANGE)
+        return "<0";
+    if (value == STATS_ABOVE_RANGE)
+        sprintf(buf, ">%d", statsColumnMax(column));
+    else
+        sprintf(buf, "%d", value);
+    return buf;
+}
+
+static void writeStats(ExportWriter *writer, ExportFormat format) {
+    const RosterStats *stats = rosterStats();
+    static const char *stat_names[] = { "min", "p10", "p25", "median", "p75", "p90", "max" };
+    unsigned char codes[GRADE_CODES];
+    int num_codes = statsGradeColumns(stats, codes);
+    char names[GRADE_CODES][3];
+    for (int g = 0; g < num_codes; ++g) {
+        gradeName(codes[g], names[g]);
+    }
+    if (format == EXPORT_CSV) {
+        char *out = exportReserve(writer, 128 + 4 * GRADE_CODES);
+        int length = sprintf(out, "subject,count,mean,stddev,min,p10,p25,median,p75,p90,max");
+        for (int g = 0; g < num_codes; ++g) {
+            length += sprintf(out + length, ",%s", names[g]);
+        }
+        out[length++] = '\n';
+        writer->used += length;
+    }
+    for (int i = 0; i <= num_subjects; ++i) {
+        const char *subject = i < num_subjects ? subject_names[i] : "Total";
+        StatsSummary summary;
+        statsSummarize(stats, i, &summary);
+        int values[] = { summary.min, summary.p10, summary.p25, summary.median, summary.p75, summary.p90, summary.max };
+        char *out = exportReserve(writer, 512 + SUBJECT_NAME_SIZE + 24 * GRADE_CODES);
+        int length;
+        if (format == EXPORT_CSV)
+            length = sprintf(out, "%s,%d,%.2f,%.2f", subject, stats->count, summary.mean, summary.stddev);
+        else
+            length = sprintf(out, "{\"subject\":\"%s\",\"count\":%d,\"mean\":%.2f,\"stddev\":%.2f", subject, stats->count, summary.mean, summary.stddev);
+        for (int k = 0; k < 7; ++k) {
+            char buf[16];
+            const char *text = stats->count ? formatStatValue(buf, i, values[k]) : "";
+            if (format == EXPORT_CSV)
+                length += sprintf(out + length, ",%s", text);
+            else if (stats->count == 0)
+                length += sprintf(out + length, ",\"%s\":null", stat_names[k]);
+            else if (values[k] == STATS_BELOW_RANGE || values[k] == STATS_ABOVE_RANGE)
+                length += sprintf(out + length, ",\"%s\":\"%s\"", stat_names[k], text);
+            else
+                length += sprintf(out + length, ",\"%s\":%s", stat_names[k], text);
+        }
+        for (int g = 0; g < num_codes; ++g) {
+            if (format == EXPORT_CSV && i < num_subjects)
+                length += sprintf(out + length, ",%d", stats->letter_counts[i][codes[g]]);
+            else if (format == EXPORT_CSV)
+                out[length++] = ',';
+            else if (i < num_subjects)
+                length += sprintf(out + length, ",\"%s\":%d", names[g], stats->letter_counts[i][codes[g]]);
+        }
+        length += sprintf(out + length, format == EXPORT_CSV ? "\n" : "}\n");
+        writer->used += length;
+    }
+}
+
+// Per-subject statistics from the running aggregates; opening it never scans the roster.
+// Rows that do not fit on screen are left out.
+void statsScreen() {
+    int redraw = 1;
+    while (1) {
+        if (redraw) {
+            redraw = 0;
+            int rows = getmaxy(stdscr);
+            drawScreenFrame("Roster Statistics");
+            const RosterStats *stats = rosterStats();
+            mvprintw(4, 2, "Students: %d", stats->count);
+            attron(A_BOLD);
+            mvprintw(6, 2, "%-16s %7s %7s %5s %5s %5s %6s %5s %5s %5s", "Subject", "Mean", "StdDev", "Min", "P10", "P25", "Median", "P75", "P90", "Max");
+            attroff(A_BOLD);
+            for (int i = 0; i <= num_subjects && 7 + i < rows - 3; ++i) {
+                StatsSummary summary;
+                statsSummarize(stats, i, &summary);
+                int values[] = { summary.min, summary.p10, summary.p25, summary.median, summary.p75, summary.p90, summary.max };
+                int width[] = { 5, 5, 5, 6, 5, 5, 5 };
+                move(7 + i, 2);
+                printw("%-16s %7.2f %7.2f", i < num_subjects ? subject_names[i] : "Total", summary.mean, summary.stddev);
+                for (int k = 0; k < 7; ++k) {
+                    char buf[16];
+                    printw(" %*s", width[k], stats->count ? formatStatValue(buf, i, values[k]) : "-");
+                }
+            }
+            unsigned char codes[GRADE_CODES];
+            int num_codes = statsGradeColumns(stats, codes);
+            int letter_row = 9 + num_subjects;
+            attron(A_BOLD);
+            if (letter_row < rows - 3) {
+                mvprintw(letter_row, 2, "%-16s", "Letter Grades");
+                for (int g = 0; g < num_codes; ++g) {
+                    char name[3];
+                    gradeName(codes[g], name);
+                    printw(" %6s", name);
+                }
+            }
+            attroff(A_BOLD);
+            for (int i = 0; i < num_subjects && letter_row + 1 + i < rows - 3; ++i) {
+                mvprintw(letter_row + 1 + i, 2, "%-16s", subject_names[i]);
+                for (int g = 0; g < num_codes; ++g) {
+                    printw(" %6d", stats->letter_counts[i][codes[g]]);
+                }
+            }
+            attron(A_DIM);
+            mvprintw(rows - 2, 2, "Press Enter to return.");
+            attroff(A_DIM);
+        }
+        if (getch() != KEY_RESIZE)
+            return;
+        redraw = 1;
+    }
+}
+
+// One student's standing in a ranking: rank 1 is the highest score, equal scores
+// share a rank, and the percentile is the share of the roster scoring lower
+static void writeRank(ExportWriter *writer, ExportFormat format, int handle, int column) {
+    RankStanding standing;
+    rankStanding(column, handle, &standing);
+    int student_number = storeByHandle(&student_store, handle)->student_number;
+    const char *subject = column < num_subjects ? subject_names[column] : "Total";
+    double percentile = 100.0 * (standing.count - standing.above - standing.tied) / standing.count;
+    char *out = exportReserve(writer, 256 + SUBJECT_NAME_SIZE);
+    if (format == EXPORT_CSV)
+        writer->used += sprintf(out, "student_number,subject,score,rank,tied,count,percentile\n%d,%s,%d,%d,%d,%d,%.2f\n", student_number, subject,
+                                standing.score, standing.above + 1, standing.tied, standing.count, percentile);
+    else
+        writer->used += sprintf(out, "{\"student_number\":%d,\"subject\":\"%s\",\"score\":%d,\"rank\":%d,\"tied\":%d,\"count\":%d,\"percentile\":%.2f}\n",
+                                student_number, subject, standing.score, standing.above + 1, standing.tied, standing.count, percentile);
+}
+
+static void writeScale(ExportWriter *writer, ExportFormat format) {
+    if (format == EXPORT_CSV) {
+        char *out = exportReserve(writer, 32);
+        writer->used += sprintf(out, "subject,cutoffs\n");
+    }
+    for (int i = 0; i < num_subjects; ++i) {
+        char *out = exportReserve(writer, 64 + SUBJECT_NAME_SIZE + 16 * GRADE_MAX_CUTOFFS);
+        int length;
+        if (format == EXPORT_CSV) {
+            length = sprintf(out, "%s,", subject_names[i]);
+            formatGradeCutoffs(grading_scale, i, out + length);
+            length += strlen(out + length);
+        } else {
+            length = sprintf(out, "{\"subject\":\"%s\",\"cutoffs\":{", subject_names[i]);
+            for (int k = 0; k < grading_scale->num_cutoffs[i]; ++k) {
+                char name[3];
+                gradeName(grading_scale->codes[i][k], name);
+                length += sprintf(out + length, k > 0 ? ",\"%s\":%d" : "\"%s\":%d", name, grading_scale->min_scores[i][k]);
+            }
+            length += sprintf(out + length, "}}");
+        }
+        out[length++] = '\n';
+        writer->used += length;
+    }
+}
+
+// Splits a command into words in place. Double quotes group words, and "" inside
+// them is a literal quote. Returns the word count, or -1 if the quotes are unbalanced
+// or there are more than max_words words.
+static int splitQuery(char *line, char **words, int max_words) {
+    int count = 0;
+    char *p = line;
+    while (1) {
+        while (isspace((unsigned char)*p)) {
+            ++p;
+        }
+        if (*p == '\0')
+            return count;
+        if (count == max_words)
+            return -1;
+        char *out = p;
+        words[count++] = out;
+        int quoted = 0;
+        while (*p != '\0' && (quoted || !isspace((unsigned char)*p))) {
+            if (*p == '"' && quoted && p[1] == '"') {
+                *out++ = '"';
+                p += 2;
+            } else if (*p == '"') {
+                quoted = !quoted;
+                ++p;
+            } else {
+                *out++ = *p++;
+            }
+        }
+        if (quoted)
+            return -1;
+        if (*p != '\0')
+            ++p;
+        *out = '\0';
+    }
+}
+
+// The expression of a filter command, which has its own syntax, or NULL
+static char *queryFilter(char *line) {
+    while (isspace((unsigned char)*line))
+        ++line;
+    if (strncmp(line, "filter", 6) != 0 || (line[6] != '\0' && !isspace((unsigned char)line[6])))
+        return NULL;
+    char *end = line + strlen(line);
+    while (end > line + 6 && isspace((unsigned char)end[-1]))
+        *--end = '\0';
+    return line + 6;
+}
+
+// total or a subject name, as a column of the statistics and rankings
+static int parseRankColumn(const char *word, int *column) {
+    if (strcmp(word, "total") == 0)
+        *column = num_subjects;
+    else if ((*column = findSubject(word)) < 0)
+        return 0;
+    return 1;
+}
+
+// The first rank and count of top FIELD COUNT or ranked FIELD FIRST LAST, whose
+// ranks start at 1; returns what is wrong with them, or NULL
+static const char *parseRankRange(char **words, int count, int *column, int *first, int *length) {
+    int last;
+    if (!parseRankColumn(words[1], column))
+        return "rankings are by total or a subject";
+    if (count == 3) {
+        *first = 0;
+        if (!parseInteger(words[2], length) || *length < 0)
+            return "top takes a count of students";
+        return NULL;
+    }
+    if (!parseInteger(words[2], first) || !parseInteger(words[3], &last) || *first < 1 || last < *first)
+        return "ranked takes a first and last rank, from 1";
+    *length = last - *first + 1;
+    --*first;
+    return NULL;
+}
+
+// name, number, total or a subject name
+static int parseSortField(const char *word, SortField *field) {
+    if (strcmp(word, "name") == 0)
+        *field = SORT_BY_NAME;
+    else if (strcmp(word, "number") == 0)
+        *field = SORT_BY_NUMBER;
+    else if (strcmp(word, "total") == 0)
+        *field = SORT_BY_TOTAL_SCORE;
+    else if (findSubject(word) >= 0)
+        *field = SORT_BY_SUBJECT + findSubject(word);
+    else
+        return 0;
+    return 1;
+}
+
+// Runs one headless command against the roster, writing any rows to writer.
+// Returns 1 if it changed the roster, 0 if not, or -1 after reporting an error.
+static int runQuery(char *line, ExportWriter *writer, ExportFormat format, const char *where) {
+    char *words[QUERY_MAX_WORDS];
+    char *filter = queryFilter(line);
+    int count = filter == NULL ? splitQuery(line, words, QUERY_MAX_WORDS) : 1;
+    const char *error = NULL;
+    int number;
+    if (count == 0) {
+        return 0;
+    } else if (filter != NULL) {
+        FilterProgram program;
+        error = filterCompile(filter, &program);
+        if (error == NULL) {
+            HandleList found = { NULL, 0, 0 };
+            filterStudents(&program, &found);
+            exportHeader(writer, format);
+            for (int i = 0; i < found.count; ++i) {
+                exportRow(writer, format, NULL, storeByHandle(&student_store, found.handles[i]));
+            }
+            free(found.handles);
+        }
+    } else if (count < 0) {
+        error = "unbalanced quotes or too many words";
+    } else if (strcmp(words[0], "list") == 0 && count == 1) {
+        exportHeader(writer, format);
+        exportWalk(writer, format, NULL, NULL);
+    } else if (strcmp(words[0], "sort") == 0 && (count == 2 || count == 3)) {
+        SortKey key = { SORT_BY_NAME, 1 };
+        if (!parseSortField(words[1], &key.field)) {
+            error = "sort field must be name, number, total or a subject";
+        } else if (count == 3 && strcmp(words[2], "asc") != 0 && strcmp(words[2], "desc") != 0) {
+            error = "sort order must be asc or desc";
+        } else {
+            key.order = count == 3 && strcmp(words[2], "desc") == 0 ? -1 : 1;
+            exportHeader(writer, format);
+            exportWalk(writer, format, &key, NULL);
+        }
+    } else if (strcmp(words[0], "search") == 0 && count == 2) {
+        HandleList found = { NULL, 0, 0 };
+        searchNames(words[1], &found);
+        exportHeader(writer, format);
+        for (int i = 0; i < found.count; ++i) {
+            exportRow(writer, format, NULL, storeByHandle(&student_store, found.handles[i]));
+        }
+        free(found.handles);
+    } else if (strcmp(words[0], "find") == 0 && count == 2) {
+        if (!parseInteger(words[1], &number)) {
+            error = "invalid student number";
+        } else {
+            int handle = rosterFindNumber(number);
+            exportHeader(writer, format);
+            if (handle >= 0)
+                exportRow(writer, format, NULL, storeByHandle(&student_store, handle));
+        }
+    } else if ((strcmp(words[0], "top") == 0 && count == 3) || (strcmp(words[0], "ranked") == 0 && count == 4)) {
+        int column, first, length;
+        error = parseRankRange(words, count, &column, &first, &length);
+        if (error == NULL) {
+            HandleList ranked = { NULL, 0, 0 };
+            rankList(column, first, length, &ranked);
+            exportHeader(writer, format);
+            for (int i = 0; i < ranked.count; ++i) {
+                exportRow(writer, format, NULL, storeByHandle(&student_store, ranked.handles[i]));
+            }
+            free(ranked.handles);
+        }
+    } else if (strcmp(words[0], "rank") == 0 && (count == 2 || count == 3)) {
+        int column = num_subjects;
+        int handle = parseInteger(words[1], &number) ? rosterFindNumber(number) : -1;
+        if (handle < 0)
+            error = "no student with that number";
+        else if (count == 3 && !parseRankColumn(words[2], &column))
+            error = "rankings are by total or a subject";
+        else
+            writeRank(writer, format, handle, column);
+    } else if (strcmp(words[0], "stats") == 0 && count == 1) {
+        writeStats(writer, format);
+    } else if (strcmp(words[0], "register") == 0 && count == 3 + num_subjects) {
+        Student s;
+        int valid = parseInteger(words[1], &s.student_number) && strlen(words[2]) < NAME_SIZE;
+        for (int i = 0; i < num_subjects && valid; ++i) {
+            valid = parseGrade(words[3 + i], &s.grades[i]);
+        }
+        if (!valid) {
+            error = "invalid student number, name or grade";
+        } else {
+            studentSetName(&s, words[2]);
+            computeStudentScores(&s);
+            if (rosterAdd(&s) < 0)
+                error = "student number is already registered";
+            else
+                return 1;
+        }
+    } else if (strcmp(words[0], "scale") == 0 && count == 1) {
+        writeScale(writer, format);
+    } else if (strcmp(words[0], "scale") == 0) {
+        // One subject or all of them; the rest of the words are the cutoffs
+        GradingScale scale = *grading_scale;
+        int subject = findSubject(words[1]);
+        if (subject < 0 && strcmp(words[1], "all") != 0) {
+            error = "scale takes a subject name or all";
+        } else {
+            for (int i = 0; i < num_subjects && error == NULL; ++i) {
+                if (i == subject || subject < 0)
+                    error = parseGradeCutoffs(words + 2, count - 2, &scale, i);
+            }
+            if (error == NULL)
+                setGradingScale(&scale);
+        }
+    } else if (strcmp(words[0], "delete") == 0 && count == 2) {
+        int handle = parseInteger(words[1], &number) ? rosterFindNumber(number) : -1;
+        if (handle < 0) {
+            error = "no student with that number";
+        } else {
+            rosterRemove(handle);
+            return 1;
+        }
+    } else {
+        error = "unknown command or wrong number of arguments";
+    }
+    if (error == NULL)
+        return 0;
+    if (writer->framed) {
+        exportEndAnswer(writer, error); // The client reports it
+        return -1;
+    }
+    exportFlush(writer); // Keep errors in order with the output before them
+    fprintf(stderr, "%s: %s\n", where, error);
+    return -1;
+}
+
+// Runs --query commands and --batch input (one command per line on standard
+// input) without starting curses. Returns the exit status: 1 if any command failed.
+int runHeadless(int argc, char *argv[]) {
+    ExportFormat format = EXPORT_CSV;
+    for (int i = 1; i + 1 < argc; ++i) {
+        if (strcmp(argv[i], "--format") == 0 && strcmp(argv[i + 1], "jsonl") == 0)
+            format = EXPORT_JSON_LINES;
+    }
+    ExportWriter *writer = exportOpen(STDOUT_FILENO);
+    int failed = 0;
+    int changed = 0;
+    int queries = 0;
+    char line[QUERY_LINE_SIZE];
+    char where[32];
+    for (int i = 1; i < argc; ++i) {
+        int result = 0;
+        if (strcmp(argv[i], "--format") == 0) {
+            ++i; // Already applied
+        } else if (strcmp(argv[i], "--query") == 0) {
+            snprintf(line, sizeof(line), "%s", argv[++i]);
+            snprintf(where, sizeof(where), "query %d", ++queries);
+            result = runQuery(line, writer, format, where);
+        } else if (strcmp(argv[i], "--batch") == 0) {
+            for (long number = 1; fgets(line, sizeof(line), stdin) != NULL; ++number) {
+                if (line[0] == '#')
+                    continue; // Comment
+                snprintf(where, sizeof(where), "line %ld", number);
+                int line_result = runQuery(line, writer, format, where);
+                failed |= line_result < 0;
+                changed |= line_result > 0;
+            }
+        }
+        failed |= result < 0;
+        changed |= result > 0;
+    }
+    int error = exportClose(writer);
+    if (error != 0) {
+        errno = error;
+        perror("standard output");
+        failed = 1;
+    }
+
+    // Changes are durable once committed; the snapshot only absorbs a journal grown large
+    if (changed) {
+        journalCommit();
+        if (lseek(journal.fd, 0, SEEK_END) >= JOURNAL_CHECKPOINT_SIZE)
+            saveStudents();
+    }
+    return failed;
+}
+
+static const char *command_usage =
+    "Usage: %s [--import FILE.csv]\n"
+    "       %s --export FILE [--format csv|jsonl] [--sort name|number|total|SUBJECT] [--desc]\n"
+    "                        [--min-total N] [--max-total N] [--name TEXT]\n"
+    "       %s [--format csv|jsonl] (--query COMMAND | --batch)...\n"
+    "       %s --bench [--sizes N,N,...] [--seed N] [--format csv|jsonl] [--threads N]\n"
+    "       %s --serve [SOCKET]\n"
+    "       %s --socket SOCKET [--format csv|jsonl] (--query COMMAND | --batch)...\n"
+    "FILE may be - for standard output. --batch reads one command per line from\n"
+    "standard input. --serve answers commands from --socket clients until\n"
+    "interrupted; SOCKET defaults to " SERVER_SOCKET ". Commands:\n"
+    "  list | sort name|number|total|SUBJECT [asc|desc] | search TEXT | find NUMBER | stats\n"
+    "  filter EXPRESSION | top total|SUBJECT COUNT | ranked total|SUBJECT FIRST LAST\n"
+    "  rank NUMBER [total|SUBJECT] | register NUMBER NAME GRADE... | delete NUMBER\n"
+    "  scale [SUBJECT|all GRADE:MIN...]\n";
+
+// Runs a command-line request without starting the interface; returns the exit status
+int commandLine(int argc, char *argv[]) {
+    if (argc == 3 && strcmp(argv[1], "--import") == 0) {
+        ImportReport report;
+        if (importCsv(argv[2], &report) != 0) {
+            perror(argv[2]);
+            return 1;
+        }
+        printf("Imported %ld students, rejected %ld rows.\n", report.imported, report.rejected);
+        for (int i = 0; i < report.num_messages; ++i) {
+            printf("  %s\n", report.messages[i]);
+        }
+        return 0;
+    }
+    if (argc >= 3 && strcmp(argv[1], "--export") == 0) {
+        ExportFormat format = EXPORT_CSV;
+        SortKey key = { SORT_BY_NAME, 1 };
+        int sorted = 0;
+        ExportFilter filter = { INT32_MIN, INT32_MAX, "" };
+        int valid = 1;
+        for (int i = 3; i < argc && valid; ++i) {
+            const char *value = i + 1 < argc ? argv[i + 1] : NULL;
+            if (strcmp(argv[i], "--desc") == 0) {
+                key.order = -1;
+                continue;
+            }
+            if (value == NULL) {
+                valid = 0;
+            } else if (strcmp(argv[i], "--format") == 0) {
+                if (strcmp(value, "csv") == 0)
+                    format = EXPORT_CSV;
+                else if (strcmp(value, "jsonl") == 0)
+                    format = EXPORT_JSON_LINES;
+                else
+                    valid = 0;
+            } else if (strcmp(argv[i], "--sort") == 0) {
+                sorted = 1;
+                valid = parseSortField(value, &key.field);
+            } else if (strcmp(argv[i], "--min-total") == 0) {
+                valid = parseInteger(value, &filter.min_total);
+            } else if (strcmp(argv[i], "--max-total") == 0) {
+                valid = parseInteger(value, &filter.max_total);
+            } else if (strcmp(argv[i], "--name") == 0) {
+                snprintf(filter.name, sizeof(filter.name), "%s", value);
+            } else {
+                valid = 0;
+            }
+            ++i; // Skip the option's value
+        }
+        if (valid && (key.order > 0 || sorted)) {
+            if (exportStudents(argv[2], format, sorted ? &key : NULL, &filter) < 0) {
+                perror(argv[2]);
+                return 1;
+            }
+            return 0;
+        }
+    }
+    if ((argc == 2 || argc == 3) && strcmp(argv[1], "--serve") == 0)
+        return runServer(argc == 3 ? argv[2] : SERVER_SOCKET);
+    if (argc >= 2) {
+        // Headless commands: every argument must be one of these options
+        int valid = 1;
+        int commands = 0;
+        for (int i = 1; i < argc && valid; ++i) {
+            if (strcmp(argv[i], "--batch") == 0 || strcmp(argv[i], "--query") == 0)
+                ++commands;
+            if (strcmp(argv[i], "--batch") == 0)
+                continue;
+            valid = i + 1 < argc && (strcmp(argv[i], "--query") == 0 ||
+                    (strcmp(argv[i], "--format") == 0 && (strcmp(argv[i + 1], "csv") == 0 || strcmp(argv[i + 1], "jsonl") == 0)));
+            ++i; // Skip the option's value
+        }
+        if (valid && commands > 0)
+            return runHeadless(argc, argv);
+    }
+    fprintf(stderr, command_usage, argv[0], argv[0], argv[0], argv[0], argv[0], argv[0]);
+    return 1;
+}
+
+// --serve: one process owns the roster and answers headless commands from
+// clients on a Unix domain socket, each connection on its own thread. A client
+// may pipeline commands; every complete line received is answered in order and
+// the answers go out together. Reads run concurrently under a shared lock, and
+// those that return rows only hold it to find them: the rows are written from a
+// pinned version of the store, so neither long answers nor slow clients hold up
+// writes. Writes are handed to a single writer thread, which applies everything
+// queued under the exclusive lock and commits the journal once for the whole batch.
+typedef struct ServerWrite {
+    char *line;
+    ExportWriter *writer; // The client's, which waits while the writer uses it
+    ExportFormat format;
+    int result;
+    int done;
+    struct ServerWrite *next;
+} ServerWrite;
+
+typedef struct {
+    pthread_rwlock_t roster_lock; // Shared by reads, exclusive for the writer
+    pthread_mutex_t lock; // Guards the write queue
+    pthread_cond_t queued; // Signalled when a write is queued
+    pthread_cond_t applied; // Broadcast when a batch of writes is committed
+    ServerWrite *head;
+    ServerWrite *tail;
+    int stopping;
+} Server;
+
+Server server = { PTHREAD_RWLOCK_WRITER_NONRECURSIVE_INITIALIZER_NP, PTHREAD_MUTEX_INITIALIZER,
+                  PTHREAD_COND_INITIALIZER, PTHREAD_COND_INITIALIZER, NULL, NULL, 0 };
+
+// Whether a command changes the roster or the grading scale
+static int queryWrites(const char *line) {
+    while (isspace((unsigned char)*line))
+        ++line;
+    size_t length = strcspn(line, " \t\r\n");
+    if (length == 5 && strncmp(line, "scale", 5) == 0)
+        return line[5 + strspn(line + 5, " \t\r\n")] != '\0'; // Only with cutoffs
+    return (length == 8 && strncmp(line, "register", 8) == 0) || (length == 6 && strncmp(line, "delete", 6) == 0);
+}
+
+static void *serverWriter(void *arg) {
+    (void)arg;
+    pthread_mutex_lock(&server.lock);
+    while (!server.stopping || server.head != NULL) {
+        if (server.head == NULL) {
+            // Idle: compact a few chunks at a time, as the main menu does
+            struct timespec deadline;
+            clock_gettime(CLOCK_REALTIME, &deadline);
+            deadline.tv_nsec += COMPACT_IDLE_MS * 1000000L;
+            deadline.tv_sec += deadline.tv_nsec / 1000000000L;
+            deadline.tv_nsec %= 1000000000L;
+            if (pthread_cond_timedwait(&server.queued, &server.lock, &deadline) == ETIMEDOUT && student_store.compact_read >= 0) {
+                pthread_mutex_unlock(&server.lock);
+                pthread_rwlock_wrlock(&server.roster_lock);
+                storeCompactStep(&student_store, COMPACT_STEP_CHUNKS);
+                storeAdvanceEpoch(&student_store);
+                pthread_rwlock_unlock(&server.roster_lock);
+                pthread_mutex_lock(&server.lock);
+            }
+            continue;
+        }
+        ServerWrite *batch = server.head;
+        server.head = server.tail = NULL;
+        pthread_mutex_unlock(&server.lock);
+
+        pthread_rwlock_wrlock(&server.roster_lock);
+        int changed = 0;
+        for (ServerWrite *w = batch; w != NULL; w = w->next) {
+            w->result = runQuery(w->line, w->writer, w->format, "");
+            changed |= w->result > 0;
+        }
+        // Changes are durable before anyone hears of them
+        if (changed) {
+            journalCommit();
+            if (lseek(journal.fd, 0, SEEK_END) >= JOURNAL_CHECKPOINT_SIZE)
+                saveStudents();
+        }
+        storeAdvanceEpoch(&student_store);
+        pthread_rwlock_unlock(&server.roster_lock);
+
+        pthread_mutex_lock(&server.lock);
+        while (batch != NULL) {
+            ServerWrite *next = batch->next; // The waiting client owns batch
+            batch->done = 1;
+            batch = next;
+        }
+        pthread_cond_broadcast(&server.applied);
+    }
+    pthread_mutex_unlock(&server.lock);
+    return NULL;
+}
+
+// Store positions of the rows a read returns, if it is list, sort, search, find,
+// filter, top or ranked with valid arguments; returns 0 for anything else, which
+// runQuery answers. The caller holds the shared lock.
+static int serverFindRows(char *line, HandleList *rows) {
+    char *words[QUERY_MAX_WORDS];
+    char *filter = queryFilter(line);
+    int count = filter == NULL ? splitQuery(line, words, QUERY_MAX_WORDS) : 0;
+    SortKey key = { SORT_BY_NAME, 1 };
+    FilterProgram program;
+    int number, column, first, length;
+    if (count == 1 && strcmp(words[0], "list") == 0) {
+        rows->handles = malloc((student_store.count ? student_store.count : 1) * sizeof(int));
+        if (rows->handles == NULL)
+            outOfMemory();
+        for (int pos = storeNextLive(&student_store, 0); pos < student_store.slots; pos = storeNextLive(&student_store, pos + 1)) {
+            rows->handles[rows->count++] = pos;
+        }
+        return 1;
+    }
+    if (count >= 2 && count <= 3 && strcmp(words[0], "sort") == 0 && parseSortField(words[1], &key.field) &&
+            (count == 2 || strcmp(words[2], "asc") == 0 || strcmp(words[2], "desc") == 0)) {
+        key.order = count == 3 && strcmp(words[2], "desc") == 0 ? -1 : 1;
+        rows->handles = malloc((student_store.count ? student_store.count : 1) * sizeof(int));
+        if (rows->handles == NULL)
+            outOfMemory();
+        rows->count = student_store.count;
+        if (key.field >= SORT_BY_SUBJECT) {
+            storeListHandles(&student_store, rows->handles);
+            sortHandles(rows->handles, rows->count, &key, 1);
+        } else {
+            indexList(&sort_indexes[key.field], key.order, rows->handles);
+        }
+    } else if (count == 2 && strcmp(words[0], "search") == 0) {
+        searchNames(words[1], rows);
+    } else if (filter != NULL && filterCompile(filter, &program) == NULL) {
+        filterStudents(&program, rows);
+    } else if (((count == 3 && strcmp(words[0], "top") == 0) || (count == 4 && strcmp(words[0], "ranked") == 0)) &&
+               parseRankRange(words, count, &column, &first, &length) == NULL) {
+        rankList(column, first, length, rows);
+    } else if (count == 2 && strcmp(words[0], "find") == 0 && parseInteger(words[1], &number)) {
+        int handle = rosterFindNumber(number);
+        if (handle >= 0)
+            handleListPush(rows, handle);
+    } else {
+        return 0;
+    }
+    for (int i = 0; i < rows->count; ++i) {
+        rows->handles[i] = storePositionOf(&student_store, rows->handles[i]);
+    }
+    return 1;
+}
+
+// Answers a read. Rows are found under the shared lock, then written from the
+// version of the store pinned before it is released.
+static int serverRead(char *line, ExportWriter *writer, ExportFormat format, StoreReader *reader) {
+    char *copy = strdup(line); // runQuery needs the line intact
+    if (copy == NULL)
+        outOfMemory();
+    HandleList rows = { NULL, 0, 0 };
+    pthread_rwlock_rdlock(&server.roster_lock);
+    if (!serverFindRows(copy, &rows)) {
+        int result = runQuery(line, writer, format, "");
+        pthread_rwlock_unlock(&server.roster_lock);
+        free(copy);
+        return result;
+    }
+    const StoreVersion *version = storePin(&student_store, reader);
+    pthread_rwlock_unlock(&server.roster_lock);
+    free(copy);
+
+    writer->scale = &version->scale;
+    exportHeader(writer, format);
+    Student scratch;
+    for (int i = 0; i < rows.count; ++i) {
+        exportRow(writer, format, NULL, versionPeek(&student_store, version, rows.handles[i], &scratch));
+    }
+    writer->scale = NULL;
+    storeUnpin(&student_store, reader);
+    free(rows.handles);
+    return 0;
+}
+
+// Answers one command line of a connection
+static void serverRequest(char *line, ExportWriter *writer, ExportFormat *format, StoreReader *reader) {
+    char *end = line + strlen(line);
+    if (end > line && end[-1] == '\r')
+        *--end = '\0';
+    int result;
+    // "format csv|jsonl" sets the format of the connection's later answers
+    if (strcmp(line, "format csv") == 0 || strcmp(line, "format jsonl") == 0) {
+        *format = line[7] == 'c' ? EXPORT_CSV : EXPORT_JSON_LINES;
+        result = 0;
+    } else if (queryWrites(line)) {
+        ServerWrite w = { line, writer, *format, 0, 0, NULL };
+        pthread_mutex_lock(&server.lock);
+        if (server.tail != NULL)
+            server.tail->next = &w;
+        else
+            server.head = &w;
+        server.tail = &w;
+        pthread_cond_signal(&server.queued);
+        while (!w.done)
+            pthread_cond_wait(&server.applied, &server.lock);
+        pthread_mutex_unlock(&server.lock);
+        result = w.result;
+    } else {
+        result = serverRead(line, writer, *format, reader);
+    }
+    if (result >= 0)
+        exportEndAnswer(writer, NULL); // Failures were answered by runQuery
+}
+
+static void *serverConnection(void *arg) {
+    int fd = (int)(intptr_t)arg;
+    ExportWriter *writer = exportOpen(fd);
+    writer->framed = 1;
+    ExportFormat format = EXPORT_CSV;
+    StoreReader reader;
+    storeAddReader(&student_store, &reader);
+    char *input = malloc(SERVER_INPUT_SIZE);
+    if (input == NULL)
+        outOfMemory();
+    size_t used = 0;
+    while (!writer->failed) {
+        ssize_t n = read(fd, input + used, SERVER_INPUT_SIZE - 1 - used);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n <= 0)
+            break;
+        used += n;
+        input[used] = '\0';
+        // Answer every complete line, then send the answers at once
+        char *line = input;
+        for (char *newline = memchr(line, '\n', used); newline != NULL; newline = memchr(line, '\n', input + used - line)) {
+            *newline = '\0';
+            serverRequest(line, writer, &format, &reader);
+            line = newline + 1;
+        }
+        used -= line - input;
+        memmove(input, line, used);
+        if (used == SERVER_INPUT_SIZE - 1) {
+            exportEndAnswer(writer, "command line too long");
+            exportFlush(writer);
+            break;
+        }
+        exportFlush(writer);
+    }
+    free(input);
+    storeRemoveReader(&student_store, &reader);
+    exportClose(writer);
+    close(fd);
+    return NULL;
+}
+
+// Binds the socket, first removing one left behind by a server that has gone
+static int serverListen(const char *path) {
+    struct sockaddr_un address = { .sun_family = AF_UNIX };
+    if (strlen(path) >= sizeof(address.sun_path)) {
+        errno = ENAMETOOLONG;
+        return -1;
+    }
+    strcpy(address.sun_path, path);
+    int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (fd < 0)
+        return -1;
+    if (bind(fd, (struct sockaddr *)&address, sizeof(address)) != 0) {
+        int probe = errno == EADDRINUSE ? socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0) : -1;
+        int stale = probe >= 0 && connect(probe, (struct sockaddr *)&address, sizeof(address)) != 0 && errno == ECONNREFUSED;
+        if (probe >= 0)
+            close(probe);
+        if (!stale || unlink(path) != 0 || bind(fd, (struct sockaddr *)&address, sizeof(address)) != 0) {
+            if (!stale && probe >= 0)
+                errno = EADDRINUSE;
+            close(fd);
+            return -1;
+        }
+    }
+    if (listen(fd, SOMAXCONN) != 0) {
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+int runServer(const char *path) {
+    // Build everything reads would otherwise build on first use, so that
+    // concurrent reads never change shared state
+    rosterEnsureIndexes();
+    rosterStats();
+    rosterEnsureRankIndexes();
+    storeLoadAll(&student_store);
+    student_store.versions = &store_versions; // Writers copy chunks that readers may have pinned
+
+    // Interrupts are read from a descriptor; a client that hangs up only fails its writes
+    sigset_t stop_signals;
+    sigemptyset(&stop_signals);
+    sigaddset(&stop_signals, SIGINT);
+    sigaddset(&stop_signals, SIGTERM);
+    sigaddset(&stop_signals, SIGHUP);
+    pthread_sigmask(SIG_BLOCK, &stop_signals, NULL);
+    signal(SIGPIPE, SIG_IGN);
+    int signal_fd = signalfd(-1, &stop_signals, SFD_CLOEXEC);
+    int listen_fd = signal_fd >= 0 ? serverListen(path) : -1;
+    if (listen_fd < 0) {
+        perror(path);
+        return 1;
+    }
+    pthread_t writer;
+    if (pthread_create(&writer, NULL, serverWriter, NULL) != 0) {
+        perror("--serve");
+        return 1;
+    }
+    fprintf(stderr, "Serving %d students on %s\n", student_store.count, path);
+
+    struct pollfd fds[2] = { { listen_fd, POLLIN, 0 }, { signal_fd, POLLIN, 0 } };
+    while (!(fds[1].revents & POLLIN)) {
+        if (poll(fds, 2, -1) < 0) {
+            if (errno == EINTR)
+                continue;
+            perror("--serve");
+            break;
+        }
+        if (!(fds[0].revents & POLLIN))
+            continue;
+        int fd = accept4(listen_fd, NULL, NULL, SOCK_CLOEXEC);
+        pthread_t thread;
+        if (fd < 0)
+            continue; // The client gave up already
+        if (pthread_create(&thread, NULL, serverConnection, (void *)(intptr_t)fd) != 0) {
+            close(fd);
+            continue;
+        }
+        pthread_detach(thread);
+    }
+
+    // Apply what is queued, then fold the journal into a snapshot under the exclusive lock
+    close(listen_fd);
+    unlink(path);
+    pthread_mutex_lock(&server.lock);
+    server.stopping = 1;
+    pthread_cond_signal(&server.queued);
+    pthread_mutex_unlock(&server.lock);
+    pthread_join(writer, NULL);
+    pthread_rwlock_wrlock(&server.roster_lock);
+    saveStudents();
+    fprintf(stderr, "Stopped serving %s\n", path);
+    return 0;
+}
+
+// Next command of a client, from the --query arguments and --batch input in
+// order; returns 0 when there are no more
+typedef struct {
+    int argc;
+    char **argv;
+    int arg; // Next argument to look at
+    int queries;
+    int batch; // Reading standard input for a --batch argument
+    long batch_line;
+} ClientInput;
+
+static int clientNextCommand(ClientInput *input, char *line, char *where) {
+    while (1) {
+        if (input->batch) {
+            if (fgets(line, QUERY_LINE_SIZE, stdin) != NULL) {
+                snprintf(where, 32, "line %ld", ++input->batch_line);
+                if (line[0] == '#')
+                    continue; // Comment
+                line[strcspn(line, "\n")] = '\0';
+                return 1;
+            }
+            input->batch = 0;
+        }
+        if (input->arg >= input->argc)
+            return 0;
+        const char *option = input->argv[input->arg++];
+        if (strcmp(option, "--format") == 0) {
+            input->arg++; // Sent first
+        } else if (strcmp(option, "--query") == 0) {
+            snprintf(line, QUERY_LINE_SIZE, "%s", input->argv[input->arg++]);
+            line[strcspn(line, "\n")] = '\0';
+            snprintf(where, 32, "query %d", ++input->queries);
+            return 1;
+        } else if (strcmp(option, "--batch") == 0) {
+            input->batch = 1;
+        }
+    }
+}
+
+// --socket: sends the commands to a server and writes its answers as a local
+// headless run would. Commands are sent ahead of their answers, up to
+// CLIENT_MAX_PENDING at a time; returns the exit status.
+int runClient(int argc, char *argv[]) {
+    int valid = argc >= 3;
+    int commands = 0;
+    const char *format = "csv";
+    for (int i = 3; i < argc && valid; ++i) {
+        if (strcmp(argv[i], "--batch") == 0) {
+            ++commands;
+            continue;
+        }
+        if (strcmp(argv[i], "--query") == 0)
+            ++commands;
+        else if (strcmp(argv[i], "--format") == 0 && i + 1 < argc && (strcmp(argv[i + 1], "csv") == 0 || strcmp(argv[i + 1], "jsonl") == 0))
+            format = argv[i + 1];
+        else
+            valid = 0;
+        valid = valid && i + 1 < argc;
+        ++i; // Skip the option's value
+    }
+    if (!valid || commands == 0) {
+        fprintf(stderr, command_usage, argv[0], argv[0], argv[0], argv[0], argv[0], argv[0]);
+        return 1;
+    }
+    const char *path = argv[2];
+    struct sockaddr_un address = { .sun_family = AF_UNIX };
+    int fd = strlen(path) < sizeof(address.sun_path) ? socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0) : -1;
+    if (fd >= 0)
+        strcpy(address.sun_path, path);
+    if (fd < 0 || connect(fd, (struct sockaddr *)&address, sizeof(address)) != 0) {
+        perror(path);
+        return 1;
+    }
+    signal(SIGPIPE, SIG_IGN);
+    fcntl(fd, F_SETFL, O_NONBLOCK);
+
+    ClientInput input = { argc, argv, 3, 0, 0, 0 };
+    static char pending[CLIENT_MAX_PENDING][32]; // Where each unanswered command came from
+    int first_pending = 0, num_pending = 0;
+    static char out[SERVER_INPUT_SIZE];
+    size_t out_used = sprintf(out, "format %s\n", format);
+    strcpy(pending[num_pending++], "format");
+    static char in[EXPORT_BUFFER_SIZE];
+    size_t in_used = 0;
+    long frame_left = 0; // Bytes of the current chunk still to copy out
+    int more = 1, sent_all = 0, failed = 0, closed = 0;
+    ExportWriter *writer = exportOpen(STDOUT_FILENO);
+    while ((more || num_pending > 0 || out_used > 0) && !closed) {
+        // Queue commands while there is room
+        char line[QUERY_LINE_SIZE];
+        char where[32];
+        while (more && num_pending < CLIENT_MAX_PENDING && out_used + QUERY_LINE_SIZE + 1 <= sizeof(out)) {
+            more = clientNextCommand(&input, line, where);
+            if (!more)
+                break;
+            out_used += sprintf(out + out_used, "%s\n", line);
+            strcpy(pending[(first_pending + num_pending++) % CLIENT_MAX_PENDING], where);
+        }
+        if (!more && out_used == 0 && !sent_all) {
+            shutdown(fd, SHUT_WR); // Nothing more to ask
+            sent_all = 1;
+        }
+
+        struct pollfd p = { fd, POLLIN | (out_used > 0 ? POLLOUT : 0), 0 };
+        if (poll(&p, 1, -1) < 0) {
+            if (errno == EINTR)
+                continue;
+            break;
+        }
+        if (p.revents & POLLOUT) {
+            ssize_t n = write(fd, out, out_used);
+            if (n > 0) {
+                out_used -= n;
+                memmove(out, out + n, out_used);
+            } else if (n < 0 && errno != EAGAIN && errno != EINTR) {
+                closed = 1;
+            }
+        }
+        if (!(p.revents & (POLLIN | POLLHUP | POLLERR)))
+            continue;
+        ssize_t n = read(fd, in + in_used, sizeof(in) - in_used);
+        if (n == 0 || (n < 0 && errno != EAGAIN && errno != EINTR)) {
+            closed = 1;
+            continue;
+        }
+        if (n < 0)
+            continue;
+        in_used += n;
+
+        // Copy out chunks and report the end of each answer
+        size_t at = 0;
+        while (at < in_used) {
+            if (frame_left > 0) {
+                size_t take = in_used - at < (size_t)frame_left ? in_used - at : (size_t)frame_left;
+                if (take > QUERY_LINE_SIZE)
+                    take = QUERY_LINE_SIZE; // A piece the writer has room for
+                memcpy(exportReserve(writer, take), in + at, take);
+                writer->used += take;
+                at += take;
+                frame_left -= take;
+                continue;
+            }
+            char *newline = memchr(in + at, '\n', in_used - at);
+            if (newline == NULL)
+                break; // Wait for the rest of the line
+            *newline = '\0';
+            if (in[at] == '.' || in[at] == '!') {
+                if (in[at] == '!') {
+                    exportFlush(writer); // Keep errors in order with the output before them
+                    fprintf(stderr, "%s: %s\n", pending[first_pending], in + at + 1);
+                    failed = 1;
+                }
+                first_pending = (first_pending + 1) % CLIENT_MAX_PENDING;
+                num_pending--;
+            } else {
+                frame_left = strtol(in + at, NULL, 16);
+            }
+            at = newline + 1 - in;
+        }
+        in_used -= at;
+        memmove(in, in + at, in_used);
+    }
+    if (num_pending > 0 || more) {
+        exportFlush(writer);
+        fprintf(stderr, "%s: connection closed by the server\n", path);
+        failed = 1;
+    }
+    int error = exportClose(writer);
+    if (error != 0) {
+        errno = error;
+        perror("standard output");
+        failed = 1;
+    }
+    close(fd);
+    return failed;
+}
+
+void exportScreen() {
+    echo();
+    curs_set(1);
+    erase();
+    int rows, cols;
+    getmaxyx(stdscr, rows, cols);
+
+    // Draw border
+    box(stdscr, 0, 0);
+
+    // Title
+    attron(COLOR_PAIR(2) | A_BOLD);
+    mvprintw(1, (cols - strlen("Export to File"))/2, "Export to File");
+    attroff(COLOR_PAIR(2) | A_BOLD);
+
+    mvhline(2, 1, ACS_HLINE, cols - 2);
+
+    int start_row = 4;
+    char path[256];
+    move(start_row, 0);
+    getStringInput("Output File: ", path, sizeof(path));
+
+    int format;
+    do {
+        move(start_row + 1, 0);
+        clrtoeol();
+        format = getIntegerInput("Format (1: CSV, 2: JSON Lines): ");
+    } while (format != 1 && format != 2);
+
+    int order;
+    do {
+        move(start_row + 2, 0);
+        clrtoeol();
+        order = getIntegerInput("Order (1: Registration, 2: Name, 3: Student Number, 4: Total Score, 5: Subject Grade): ");
+    } while (order < 1 || order > 5);
+    SortKey key = { SORT_BY_NAME, 1 };
+    if (order == 3)
+        key.field = SORT_BY_NUMBER;
+    else if (order == 4)
+        key.field = SORT_BY_TOTAL_SCORE;
+    int direction_row = start_row + 3;
+    if (order == 5) {
+        char prompt[32];
+        sprintf(prompt, "Subject (1-%d): ", num_subjects);
+        int subject;
+        do {
+            move(start_row + 3, 0);
+            clrtoeol();
+            subject = getIntegerInput(prompt);
+        } while (subject < 1 || subject > num_subjects);
+        key.field = SORT_BY_SUBJECT + subject - 1;
+        direction_row = start_row + 4;
+    }
+    if (order > 1) {
+        int descending;
+        do {
+            move(direction_row, 0);
+            clrtoeol();
+            descending = getIntegerInput("Direction (1: Ascending, 2: Descending): ");
+        } while (descending != 1 && descending != 2);
+        key.order = descending == 2 ? -1 : 1;
+    }
+
+    // Optional filters; leaving a field empty keeps every row
+    ExportFilter filter = { INT32_MIN, INT32_MAX, "" };
+    char text[16];
+    int filter_row = direction_row + 2;
+    move(filter_row, 0);
+    getStringInput("Minimum Total Score (empty for none): ", text, sizeof(text));
+    if (text[0] != '\0')
+        parseInteger(text, &filter.min_total);
+    move(filter_row + 1, 0);
+    getStringInput("Maximum Total Score (empty for none): ", text, sizeof(text));
+    if (text[0] != '\0')
+        parseInteger(text, &filter.max_total);
+    move(filter_row + 2, 0);
+    getStringInput("Name Contains (empty for any): ", filter.name, sizeof(filter.name));
+    noecho();
+    curs_set(0);
+
+    mvprintw(filter_row + 4, 2, "Exporting...");
+    refresh();
+    long written = exportStudents(path, format == 1 ? EXPORT_CSV : EXPORT_JSON_LINES, order > 1 ? &key : NULL, &filter);
+    move(filter_row + 4, 0);
+    clrtoeol();
+    if (written < 0)
+        mvprintw(filter_row + 4, 2, "Cannot write %s: %s", path, strerror(errno));
+    else
+        mvprintw(filter_row + 4, 2, "Exported %ld students to %s.", written, path);
+    box(stdscr, 0, 0);
+    attron(A_DIM);
+    mvprintw(rows - 2, 2, "Press Enter to return to the menu.");
+    attroff(A_DIM);
+    getch();
+}
+
+void scaleScreen() {
+    echo();
+    curs_set(1);
+    erase();
+    int rows, cols;
+    getmaxyx(stdscr, rows, cols);
+
+    // Draw border
+    box(stdscr, 0, 0);
+
+    // Title
+    attron(COLOR_PAIR(2) | A_BOLD);
+    mvprintw(1, (cols - strlen("Grading Scale"))/2, "Grading Scale");
+    attroff(COLOR_PAIR(2) | A_BOLD);
+
+    mvhline(2, 1, ACS_HLINE, cols - 2);
+
+    // Subjects that do not fit above the prompts are left out of the list
+    int start_row = 4;
+    int prompt_row = start_row + num_subjects + 1 < rows - 7 ? start_row + num_subjects + 1 : rows - 7;
+    for (int i = 0; i < num_subjects && start_row + i < prompt_row - 1; ++i) {
+        char cutoffs[GRADE_MAX_CUTOFFS * 8];
+        formatGradeCutoffs(grading_scale, i, cutoffs);
+        mvprintw(start_row + i, 2, "%d. %-16s %s", i + 1, subject_names[i], cutoffs);
+    }
+
+    char prompt[32];
+    sprintf(prompt, "Subject (1-%d, 0 for all): ", num_subjects);
+    int subject;
+    do {
+        move(prompt_row, 0);
+        clrtoeol();
+        subject = getIntegerInput(prompt);
+    } while (subject < 0 || subject > num_subjects);
+    char text[QUERY_LINE_SIZE];
+    move(prompt_row + 1, 0);
+    getStringInput("Cutoffs, best grade first (e.g. A:90 B+:85 B:80 C:70 D:60 F:0): ", text, sizeof(text));
+    noecho();
+    curs_set(0);
+
+    if (text[0] != '\0') {
+        char *words[GRADE_MAX_CUTOFFS];
+        int count = splitQuery(text, words, GRADE_MAX_CUTOFFS);
+        GradingScale scale = *grading_scale;
+        const char *error = count < 0 ? "a scale needs 1 to 16 grades" : NULL;
+        for (int i = 0; i < num_subjects && error == NULL; ++i) {
+            if (subject == 0 || i == subject - 1)
+                error = parseGradeCutoffs(words, count, &scale, i);
+        }
+        if (error != NULL) {
+            mvprintw(prompt_row + 3, 2, "Scale not changed: %s.", error);
+        } else {
+            mvprintw(prompt_row + 3, 2, "Re-grading...");
+            refresh();
+            setGradingScale(&scale);
+            mvprintw(prompt_row + 3, 2, "Re-graded %d students.", student_store.count);
+        }
+    }
+    box(stdscr, 0, 0);
+    attron(A_DIM);
+    mvprintw(rows - 2, 2, "Press Enter to return to the menu.");
+    attroff(A_DIM);
+    getch();
+}
+
+// Deterministic generator for synthetic rosters (splitmix64)
+static uint64_t bench_state;
+
+static uint64_t benchRandom() {
+    uint64_t z = (bench_state += 0x9E3779B97F4A7C15ull);
+    z = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9ull;
+    z = (z ^ (z >> 27)) * 0x94D049BB133111EBull;
+    return z ^ (z >> 31);
+}
+
+static uint64_t benchNow() {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (uint64_t)now.tv_sec * 1000000000ull + now.tv_nsec;
+}
+
+static const char *bench_surnames[] = {
+    "Kim", "Lee", "Park", "Choi", "Jung", "Kang", "Cho", "Yoon", "Jang", "Lim",
+    "Han", "Oh", "Seo", "Shin", "Kwon", "Hwang", "Ahn", "Song", "Yoo", "Hong"
+};
+static const char *bench_syllables[] = {
+    "min", "ji", "seo", "yeon", "hyun", "woo", "jun", "soo", "eun", "ha",
+    "young", "jae", "hee", "sung", "dong", "hoon", "kyung", "na", "ra", "bin",
+    "yun", "tae", "gyu", "won", "chan", "ho", "jin", "mi", "sol", "ah"
+};
+
+// Synthetic student i; student numbers are a permutation of i, so they never repeat
+static void benchStudent(int i, Student *s) {
+    int syllables = sizeof(bench_syllables) / sizeof(char *);
+    const char *given = bench_syllables[benchRandom() % syllables];
+    char name[NAME_SIZE];
+    snprintf(name, sizeof(name), "%s %c%s%s", bench_surnames[benchRandom() % (sizeof(bench_surnames) / sizeof(char *))],
+             toupper((unsigned char)given[0]), given + 1, bench_syllables[benchRandom() % syllables]);
+    studentSetName(s, name);
+    s->student_number = (int)(((uint32_t)i * 2654435761u) & 0x7fffffffu); // Odd multiplier: a bijection mod 2^31
+    for (int j = 0; j < num_subjects; ++j) {
+        s->grades[j] = (benchRandom() % 101 + benchRandom() % 101) / 2; // Bunched towards the middle
+    }
+    computeStudentScores(s);
+}
+
+static int compareLatencies(const void *a, const void *b) {
+    uint64_t x = *(const uint64_t *)a, y = *(const uint64_t *)b;
+    return (x > y) - (x < y);
+}
+
+// Writes one result line: items processed, wall time, and the latency percentiles
+// of the timed samples (each sample is one operation or one repetition)
+static void benchReport(ExportFormat format, int size, const char *operation, long items, uint64_t *samples, long num_samples) {
+    uint64_t total = 0;
+    for (long i = 0; i < num_samples; ++i) {
+        total += samples[i];
+    }
+    qsort(samples, num_samples, sizeof(uint64_t), compareLatencies);
+    double seconds = total / 1e9;
+    double p50 = samples[(num_samples - 1) / 2] / 1e3;
+    double p99 = samples[(num_samples - 1) * 99 / 100] / 1e3;
+    double throughput = seconds > 0 ? items / seconds : 0;
+    if (format == EXPORT_CSV)
+        printf("%d,%s,%ld,%ld,%.6f,%.0f,%.3f,%.3f\n", size, operation, items, num_samples, seconds, throughput, p50, p99);
+    else
+        printf("{\"size\":%d,\"operation\":\"%s\",\"items\":%ld,\"samples\":%ld,\"seconds\":%.6f,\"items_per_second\":%.0f,\"p50_us\":%.3f,\"p99_us\":%.3f}\n",
+               size, operation, items, num_samples, seconds, throughput, p50, p99);
+    fflush(stdout);
+}
+
+// Times each engine operation on a fresh synthetic roster of the given size
+static void benchRoster(int size, uint64_t seed, ExportFormat format) {
+    bench_state = seed;
+    long scan_reps = BENCH_SCAN_BUDGET / size > 1 ? BENCH_SCAN_BUDGET / size : 1;
+    if (scan_reps > 20)
+        scan_reps = 20;
+    long most_samples = size > BENCH_LOOKUPS ? size : BENCH_LOOKUPS;
+    uint64_t *samples = malloc(most_samples * sizeof(uint64_t));
+    int *handles = malloc(size * sizeof(int));
+    if (samples == NULL || handles == NULL)
+        outOfMemory();
+
+    // Registration, one student at a time through every index
+    Student s;
+    for (int i = 0; i < size; ++i) {
+        benchStudent(i, &s);
+        uint64_t start = benchNow();
+        rosterAdd(&s);
+        samples[i] = benchNow() - start;
+    }
+    benchReport(format, size, "insert", size, samples, size);
+
+    // Full sorts of the handle array, one sample per repetition
+    static const char *sort_names[NUM_SORT_FIELDS] = { "sort_name", "sort_number", "sort_total" };
+    for (int f = 0; f < NUM_SORT_FIELDS; ++f) {
+        SortKey key = { f, 1 };
+        for (long r = 0; r < scan_reps; ++r) {
+            for (int i = 0; i < size; ++i) {
+                handles[i] = storeHandleAt(&student_store, storeSelect(&student_store, i));
+            }
+            uint64_t start = benchNow();
+            sortHandles(handles, size, &key, 1);
+            samples[r] = benchNow() - start;
+        }
+        benchReport(format, size, sort_names[f], (long)size * scan_reps, samples, scan_reps);
+    }
+    for (long r = 0; r < scan_reps; ++r) {
+        uint64_t start = benchNow();
+        rosterRebuildIndexes();
+        samples[r] = benchNow() - start;
+    }
+    benchReport(format, size, "rebuild_indexes", (long)size * scan_reps, samples, scan_reps);
+
+    // Exact lookups by student number
+    for (int q = 0; q < BENCH_LOOKUPS; ++q) {
+        int number = (int)(((uint32_t)(benchRandom() % size) * 2654435761u) & 0x7fffffffu);
+        uint64_t start = benchNow();
+        rosterFindNumber(number);
+        samples[q] = benchNow() - start;
+    }
+    benchReport(format, size, "find_number", BENCH_LOOKUPS, samples, BENCH_LOOKUPS);
+
+    // Name searches for a prefix and for a substring of a registered name, and
+    // for a two-byte substring, which has no trigram and scans the whole store
+    static const char *search_names[] = { "search_prefix", "search_substring", "search_scan" };
+    for (int kind = 0; kind < 3; ++kind) {
+        int searches = kind < 2 ? BENCH_SEARCHES : (int)scan_reps;
+        for (int q = 0; q < searches; ++q) {
+            Student scratch;
+            const char *name = studentName(storePeek(&student_store, storeSelect(&student_store, benchRandom() % size), &scratch));
+            // The first five bytes, or three or two from the given name
+            const char *from = kind == 0 ? name : strchr(name, ' ') + 1;
+            char query[8];
+            size_t length = strnlen(from, kind == 0 ? 5 : kind == 1 ? 3 : 2);
+            memcpy(query, from, length);
+            query[length] = '\0';
+            HandleList found = { NULL, 0, 0 };
+            uint64_t start = benchNow();
+            searchNames(query, &found);
+            samples[q] = benchNow() - start;
+            free(found.handles);
+        }
+        benchReport(format, size, search_names[kind], kind < 2 ? searches : (long)size * searches, samples, searches);
+    }
+
+    // A filter no index narrows is a scan of every record; one on an exact total looks up its candidates
+    static const char *filter_names[] = { "filter_scan", "filter_index" };
+    for (int kind = 0; kind < 2; ++kind) {
+        int filters = kind == 0 ? (int)scan_reps : BENCH_SEARCHES;
+        for (int q = 0; q < filters; ++q) {
+            char text[NAME_SIZE + 64];
+            if (kind == 0)
+                snprintf(text, sizeof(text), "\"%s\" < %d and any = F", subject_names[0], (int)(benchRandom() % 100));
+            else
+                snprintf(text, sizeof(text), "total = %d and \"%s\" >= 50", (int)(benchRandom() % (num_subjects * 100 + 1)), subject_names[0]);
+            FilterProgram program;
+            HandleList found = { NULL, 0, 0 };
+            uint64_t start = benchNow();
+            filterCompile(text, &program);
+            filterStudents(&program, &found);
+            samples[q] = benchNow() - start;
+            free(found.handles);
+        }
+        benchReport(format, size, filter_names[kind], kind == 0 ? (long)size * filters : filters, samples, filters);
+    }
+
+    // Statistics are read from the running aggregates the inserts kept current
+    for (int r = 0; r < BENCH_SEARCHES; ++r) {
+        StatsSummary summary;
+        uint64_t start = benchNow();
+        const RosterStats *stats = rosterStats();
+        for (int i = 0; i <= num_subjects; ++i) {
+            statsSummarize(stats, i, &summary);
+        }
+        samples[r] = benchNow() - start;
+    }
+    benchReport(format, size, "statistics", BENCH_SEARCHES, samples, BENCH_SEARCHES);
+    for (long r = 0; r < scan_reps; ++r) {
+        roster_stats_stale = 1;
+        uint64_t start = benchNow();
+        rosterStats();
+        samples[r] = benchNow() - start;
+    }
+    benchReport(format, size, "statistics_rebuild", (long)size * scan_reps, samples, scan_reps);
+
+    // Rankings: rebuilt per column in parallel, then a student's standing in the
+    // total score and the top 50 in one subject; later deletions keep them current
+    for (long r = 0; r < scan_reps; ++r) {
+        rank_indexes_stale = 1;
+        uint64_t start = benchNow();
+        rosterEnsureRankIndexes();
+        samples[r] = benchNow() - start;
+    }
+    benchReport(format, size, "rank_rebuild", (long)size * scan_reps, samples, scan_reps);
+    for (int q = 0; q < BENCH_SEARCHES; ++q) {
+        int handle = storeHandleAt(&student_store, storeSelect(&student_store, benchRandom() % size));
+        RankStanding standing;
+        uint64_t start = benchNow();
+        rankStanding(num_subjects, handle, &standing);
+        samples[q] = benchNow() - start;
+    }
+    benchReport(format, size, "rank_lookup", BENCH_SEARCHES, samples, BENCH_SEARCHES);
+    for (int q = 0; q < BENCH_SEARCHES; ++q) {
+        HandleList top = { NULL, 0, 0 };
+        uint64_t start = benchNow();
+        rankList(q % num_subjects, 0, 50, &top);
+        samples[q] = benchNow() - start;
+        free(top.handles);
+    }
+    benchReport(format, size, "top_50", BENCH_SEARCHES, samples, BENCH_SEARCHES);
+
+    // Re-grading recounts letter grades from the histograms, without a pass over the roster
+    for (long r = 0; r < scan_reps; ++r) {
+        uint64_t start = benchNow();
+        statsRecountLetters(&roster_stats, grading_scale);
+        samples[r] = benchNow() - start;
+    }
+    benchReport(format, size, "regrade", (long)size * scan_reps, samples, scan_reps);
+
+    // Deletions from the middle of the roster
+    int deletes = size / 10 < BENCH_DELETES ? size / 10 : BENCH_DELETES;
+    for (int d = 0; d < deletes; ++d) {
+        int handle = storeHandleAt(&student_store, storeSelect(&student_store, student_store.count / 2));
+        uint64_t start = benchNow();
+        rosterRemove(handle);
+        samples[d] = benchNow() - start;
+    }
+    if (deletes > 0)
+        benchReport(format, size, "delete_middle", deletes, samples, deletes);
+    free(samples);
+    free(handles);
+}
+
+// --bench: one line per roster size and operation on standard output. Each size
+// runs in its own process, so every roster starts from empty memory.
+int runBenchmark(int argc, char *argv[]) {
+    int sizes[BENCH_MAX_SIZES] = { 1000, 10000, 100000, 1000000, 10000000 };
+    int num_sizes = 5;
+    uint64_t seed = 1;
+    ExportFormat format = EXPORT_JSON_LINES;
+    for (int i = 2; i < argc; i += 2) {
+        const char *value = i + 1 < argc ? argv[i + 1] : "";
+        int valid = 1;
+        if (strcmp(argv[i], "--sizes") == 0) {
+            char list[256];
+            snprintf(list, sizeof(list), "%s", value);
+            num_sizes = 0;
+            for (char *item = strtok(list, ","); item != NULL && valid; item = strtok(NULL, ",")) {
+                valid = num_sizes < BENCH_MAX_SIZES && parseInteger(item, &sizes[num_sizes]) && sizes[num_sizes] > 0;
+                ++num_sizes;
+            }
+            valid = valid && num_sizes > 0;
+        } else if (strcmp(argv[i], "--seed") == 0) {
+            int value_seed;
+            valid = parseInteger(value, &value_seed);
+            seed = (uint64_t)value_seed;
+        } else if (strcmp(argv[i], "--format") == 0 && (strcmp(value, "csv") == 0 || strcmp(value, "jsonl") == 0)) {
+            format = strcmp(value, "csv") == 0 ? EXPORT_CSV : EXPORT_JSON_LINES;
+        } else if (strcmp(argv[i], "--threads") == 0) {
+            valid = parseInteger(value, &pool_threads_wanted) && pool_threads_wanted > 0 && pool_threads_wanted <= POOL_MAX_THREADS;
+        } else {
+            valid = 0;
+        }
+        if (!valid) {
+            fprintf(stderr, "Usage: %s --bench [--sizes N,N,...] [--seed N] [--format csv|jsonl] [--threads N]\n", argv[0]);
+            return 1;
+        }
+    }
+
+    if (format == EXPORT_CSV)
+        printf("size,operation,items,samples,seconds,items_per_second,p50_us,p99_us\n");
+    fflush(stdout);
+    int failed = 0;
+    for (int i = 0; i < num_sizes; ++i) {
+        pid_t child = fork();
+        if (child == 0) {
+            benchRoster(sizes[i], seed, format);
+            exit(0);
+        }
+        int status;
+        if (child < 0 || waitpid(child, &status, 0) != child || !WIFEXITED(status) || WEXITSTATUS(status) != 0) {
+            fprintf(stderr, "Benchmark of %d students did not finish.\n", sizes[i]);
+            failed = 1;
+        }
+    }
+    return failed;
+}